@@ -0,0 +1,94 @@
+#if !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include "arena.h"
+
+#include "return_codes.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ARENA_MMAP
+#include <sys/mman.h>
+#endif
+
+// Arenas from this size on ask for huge pages and are rounded up to whole ones
+#define ARENA_HUGE_SIZE (4 * 1024 * 1024)
+#define ARENA_HUGE_PAGE (2 * 1024 * 1024)
+
+size_t arena_add(size_t total, size_t size)
+{
+	if (size > SIZE_MAX - ARENA_ALIGNMENT)
+	{
+		return SIZE_MAX;
+	}
+	size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+	return total < SIZE_MAX - size ? total + size : SIZE_MAX;
+}
+
+int arena_reserve(struct arena *arena, size_t size)
+{
+	arena->used = 0;
+	if (arena->capacity >= size)
+	{
+		return SUCCESS;
+	}
+	arena_release(arena);
+
+#if defined(ARENA_MMAP)
+	size_t capacity = size;
+	if (size >= ARENA_HUGE_SIZE && size <= SIZE_MAX - ARENA_HUGE_PAGE)
+	{
+		capacity = (size + ARENA_HUGE_PAGE - 1) & ~(size_t)(ARENA_HUGE_PAGE - 1);
+	}
+	void *base = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+#if defined(MADV_HUGEPAGE)
+	if (capacity >= ARENA_HUGE_SIZE)
+	{
+		// only advice, a kernel without transparent huge pages refuses it and the arena works all the same
+		madvise(base, capacity, MADV_HUGEPAGE);
+	}
+#endif
+#else
+	size_t capacity = size;
+	void *base = malloc(capacity);
+	if (base == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+#endif
+	arena->base = base;
+	arena->capacity = capacity;
+	return SUCCESS;
+}
+
+unsigned char *arena_take(struct arena *arena, size_t size)
+{
+	unsigned char *buffer = arena->base + arena->used;
+	arena->used = arena_add(arena->used, size);
+	return buffer;
+}
+
+void arena_release(struct arena *arena)
+{
+	if (arena->base != NULL)
+	{
+#if defined(ARENA_MMAP)
+		munmap(arena->base, arena->capacity);
+#else
+		free(arena->base);
+#endif
+	}
+	arena->base = NULL;
+	arena->capacity = 0;
+	arena->used = 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+
+// One block of memory that all the buffers of an image are taken from. On POSIX it is mapped straight from the system and
+// large arenas are advised to use transparent huge pages. Every function returns one of the return_codes.h values
+
+#define ARENA_ALIGNMENT 64	  // every buffer starts on a cache line
+
+struct arena
+{
+	unsigned char *base;
+	size_t capacity;
+	size_t used;
+};
+
+// total plus the room a buffer of size takes in an arena, SIZE_MAX once that no longer fits into a size_t
+size_t arena_add(size_t total, size_t size);
+
+// Empties the arena and makes sure it holds size bytes, the memory is kept when it already is large enough
+int arena_reserve(struct arena *arena, size_t size);
+
+// The next size bytes, which arena_add must have counted
+unsigned char *arena_take(struct arena *arena, size_t size);
+
+void arena_release(struct arena *arena);
@@ -0,0 +1,532 @@
+#if !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include "async_io.h"
+
+#include "return_codes.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+// only the kernel header is needed, the ring is driven through the system calls themselves
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#define ASYNC_IO_ENTRIES 16			 // requests in flight at once
+#define ASYNC_IO_CHUNK (1u << 30)	 // most bytes of one request, whose length has 32 bits
+
+int async_io_parse_backend(const char *name, enum async_io_backend *backend)
+{
+	static const char *names[] = { "auto", "io_uring", "pread", "off" };
+	for (int i = 0; i < 4; i++)
+	{
+		if (strcmp(name, names[i]) == 0)
+		{
+			*backend = (enum async_io_backend)i;
+			return SUCCESS;
+		}
+	}
+	fprintf(stderr, "unknown batch I/O %s, expected auto, io_uring, pread or off\n", name);
+	return ERROR_PARAMETER_INVALID;
+}
+
+#if defined(HAVE_POSIX)
+struct async_file
+{
+	int fd;
+	unsigned char *data;
+	size_t size, done;
+	int writing;
+	int submitted;	  // a request for it is with the kernel
+	int complete;
+	int result;
+	char *path;		 // of a file being written, removed again when writing fails
+	int *report;	 // where the result of a write goes
+};
+
+struct async_io
+{
+	enum async_io_backend backend;	  // ASYNC_IO_URING or ASYNC_IO_PREAD
+	unsigned int in_flight;			  // requests with the kernel
+	unsigned int writes;			  // files being written
+#if defined(HAVE_IO_URING)
+	int ring;
+	unsigned int entries;
+	unsigned int *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_map_size, cq_map_size, sqes_size;
+#endif
+};
+
+// Moves the rest of the data of a file in the calling thread. A read stops early at the end of a file that got shorter
+static int transfer(struct async_file *file)
+{
+	while (file->done < file->size)
+	{
+		size_t length = file->size - file->done < ASYNC_IO_CHUNK ? file->size - file->done : ASYNC_IO_CHUNK;
+		ssize_t moved = file->writing ? pwrite(file->fd, file->data + file->done, length, (off_t)file->done)
+									  : pread(file->fd, file->data + file->done, length, (off_t)file->done);
+		if (moved < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (moved == 0 && !file->writing)
+		{
+			file->size = file->done;
+			break;
+		}
+		if (moved <= 0)
+		{
+			return file->writing ? ERROR_UNKNOWN : ERROR_DATA_INVALID;
+		}
+		file->done += moved;
+	}
+	return SUCCESS;
+}
+
+// A read is kept for async_io_wait, a written file is closed and handed back
+static void finish(struct async_io *io, struct async_file *file, int result)
+{
+	if (!file->writing)
+	{
+		if (result != SUCCESS)
+		{
+			fprintf(stderr, "error while reading a file\n");
+		}
+		file->result = result;
+		file->complete = 1;
+		return;
+	}
+	if (close(file->fd) != 0 && result == SUCCESS)
+	{
+		result = ERROR_UNKNOWN;
+	}
+	if (result != SUCCESS)
+	{
+		fprintf(stderr, "error while writing a file\n");
+		remove(file->path);
+	}
+	*file->report = result;
+	io->writes--;
+	free(file->data);
+	free(file->path);
+	free(file);
+}
+
+#if defined(HAVE_IO_URING)
+static void uring_release(struct async_io *io)
+{
+	if (io->sqes != NULL)
+	{
+		munmap(io->sqes, io->sqes_size);
+	}
+	if (io->cq_map != NULL && io->cq_map != io->sq_map)
+	{
+		munmap(io->cq_map, io->cq_map_size);
+	}
+	if (io->sq_map != NULL)
+	{
+		munmap(io->sq_map, io->sq_map_size);
+	}
+	close(io->ring);
+}
+
+static int uring_setup(struct async_io *io)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	if ((io->ring = (int)syscall(__NR_io_uring_setup, ASYNC_IO_ENTRIES, &params)) < 0)
+	{
+		return ERROR_UNSUPPORTED;
+	}
+	io->entries = params.sq_entries;
+	io->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	io->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single)
+	{
+		io->sq_map_size = io->cq_map_size = io->sq_map_size > io->cq_map_size ? io->sq_map_size : io->cq_map_size;
+	}
+	io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	void *sq_map = mmap(NULL, io->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring, IORING_OFF_SQ_RING);
+	io->sq_map = sq_map != MAP_FAILED ? sq_map : NULL;
+	void *cq_map = single ? sq_map : mmap(NULL, io->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring, IORING_OFF_CQ_RING);
+	io->cq_map = cq_map != MAP_FAILED ? cq_map : NULL;
+	void *sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring, IORING_OFF_SQES);
+	io->sqes = sqes != MAP_FAILED ? sqes : NULL;
+	if (io->sq_map == NULL || io->cq_map == NULL || io->sqes == NULL)
+	{
+		uring_release(io);
+		io->sq_map = io->cq_map = NULL;
+		io->sqes = NULL;
+		return ERROR_UNSUPPORTED;
+	}
+
+	unsigned char *sq = io->sq_map, *cq = io->cq_map;
+	io->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	io->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	io->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	io->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	io->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	io->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	io->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return SUCCESS;
+}
+
+static int uring_enter(struct async_io *io, unsigned int submit, unsigned int wait)
+{
+	long result;
+	do
+	{
+		result = syscall(__NR_io_uring_enter, io->ring, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (result < 0 && errno == EINTR);
+	return (int)result;
+}
+
+static void start(struct async_io *io, struct async_file *file);
+
+// Handles the completion of a request that moved res bytes or failed with -res
+static void uring_complete(struct async_io *io, struct async_file *file, int res)
+{
+	if (res == -EINTR || res == -EAGAIN)
+	{
+		start(io, file);
+	}
+	else if (res == -EINVAL || res == -EOPNOTSUPP)
+	{
+		// a kernel from before IORING_OP_READ and IORING_OP_WRITE, pread from now on
+		io->backend = ASYNC_IO_PREAD;
+		finish(io, file, transfer(file));
+	}
+	else if (res < 0 || (res == 0 && file->writing))
+	{
+		finish(io, file, file->writing ? ERROR_UNKNOWN : ERROR_DATA_INVALID);
+	}
+	else if (res == 0)
+	{
+		file->size = file->done;
+		finish(io, file, SUCCESS);
+	}
+	else if ((file->done += (size_t)res) < file->size)
+	{
+		start(io, file);
+	}
+	else
+	{
+		finish(io, file, SUCCESS);
+	}
+}
+
+// Takes every completion there is, after waiting for at least one when asked to
+static int uring_reap(struct async_io *io, int wait)
+{
+	if (wait && uring_enter(io, 0, 1) < 0)
+	{
+		fprintf(stderr, "io_uring failed\n");
+		return ERROR_UNKNOWN;
+	}
+	unsigned int head = *io->cq_head;
+	unsigned int tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++)
+	{
+		struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+		struct async_file *file = (struct async_file *)(uintptr_t)cqe->user_data;
+		int res = cqe->res;
+		// the entry is given back first, handling the completion may submit the next request
+		__atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+		io->in_flight--;
+		file->submitted = 0;
+		uring_complete(io, file, res);
+	}
+	return SUCCESS;
+}
+
+// Submits the next request of a file, SUCCESS once the kernel has it
+static int uring_submit(struct async_io *io, struct async_file *file)
+{
+	// the completion queue has twice the entries, so it cannot overflow while this holds
+	while (io->in_flight == io->entries)
+	{
+		if (uring_reap(io, 1) != SUCCESS)
+		{
+			return ERROR_UNKNOWN;
+		}
+	}
+	unsigned int tail = *io->sq_tail, index = tail & *io->sq_mask;
+	size_t length = file->size - file->done < ASYNC_IO_CHUNK ? file->size - file->done : ASYNC_IO_CHUNK;
+	struct io_uring_sqe *sqe = &io->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = file->writing ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = file->fd;
+	sqe->addr = (uint64_t)(uintptr_t)(file->data + file->done);
+	sqe->len = (uint32_t)length;
+	sqe->off = file->done;
+	sqe->user_data = (uint64_t)(uintptr_t)file;
+	io->sq_array[index] = index;
+	__atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	if (uring_enter(io, 1, 0) != 1)
+	{
+		// nothing was taken, the entry is withdrawn again
+		__atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+		return ERROR_UNKNOWN;
+	}
+	io->in_flight++;
+	file->submitted = 1;
+	return SUCCESS;
+}
+#endif
+
+// Hands the rest of a file to the kernel, or moves it right away without io_uring
+static void start(struct async_io *io, struct async_file *file)
+{
+#if defined(HAVE_IO_URING)
+	if (io->backend == ASYNC_IO_URING && file->done < file->size && uring_submit(io, file) == SUCCESS)
+	{
+		return;
+	}
+#endif
+	finish(io, file, transfer(file));
+}
+
+// Waits for the next completion, there has to be a request in flight
+static int wait_one(struct async_io *io)
+{
+#if defined(HAVE_IO_URING)
+	if (io->in_flight > 0)
+	{
+		return uring_reap(io, 1);
+	}
+#else
+	(void)io;
+#endif
+	return ERROR_UNKNOWN;
+}
+
+int async_io_create(struct async_io **io, enum async_io_backend backend)
+{
+	if ((*io = calloc(1, sizeof(struct async_io))) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	(*io)->backend = ASYNC_IO_PREAD;
+	if (backend == ASYNC_IO_AUTO || backend == ASYNC_IO_URING)
+	{
+#if defined(HAVE_IO_URING)
+		if (uring_setup(*io) == SUCCESS)
+		{
+			(*io)->backend = ASYNC_IO_URING;
+			return SUCCESS;
+		}
+#endif
+		if (backend == ASYNC_IO_URING)
+		{
+			fprintf(stderr, "io_uring is not available\n");
+			free(*io);
+			*io = NULL;
+			return ERROR_UNSUPPORTED;
+		}
+	}
+	return SUCCESS;
+}
+
+void async_io_destroy(struct async_io *io)
+{
+	if (io == NULL)
+	{
+		return;
+	}
+	async_io_settle(io, 0);
+#if defined(HAVE_IO_URING)
+	// also after falling back to pread
+	if (io->sq_map != NULL)
+	{
+		uring_release(io);
+	}
+#endif
+	free(io);
+}
+
+const char *async_io_backend_name(const struct async_io *io)
+{
+	return io->backend == ASYNC_IO_URING ? "io_uring" : "pread";
+}
+
+int async_io_read(struct async_io *io, const char *path, struct async_file **file)
+{
+	struct stat status;
+	if ((*file = calloc(1, sizeof(struct async_file))) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	struct async_file *read = *file;
+	if ((read->fd = open(path, O_RDONLY)) < 0)
+	{
+		fprintf(stderr, "Cannot open file %s\n", path);
+		free(read);
+		*file = NULL;
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	// pipes and devices have no size to read up to
+	if (fstat(read->fd, &status) != 0 || !S_ISREG(status.st_mode) || (uint64_t)status.st_size > SIZE_MAX)
+	{
+		close(read->fd);
+		free(read);
+		*file = NULL;
+		return ERROR_UNSUPPORTED;
+	}
+	read->size = (size_t)status.st_size;
+	if ((read->data = malloc(read->size > 0 ? read->size : 1)) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		close(read->fd);
+		free(read);
+		*file = NULL;
+		return ERROR_OUT_OF_MEMORY;
+	}
+	start(io, read);
+	return SUCCESS;
+}
+
+int async_io_wait(struct async_io *io, struct async_file *file, const unsigned char **data, size_t *size)
+{
+	while (!file->complete)
+	{
+		if (wait_one(io) != SUCCESS)
+		{
+			return ERROR_UNKNOWN;
+		}
+	}
+	*data = file->data;
+	*size = file->size;
+	return file->result;
+}
+
+void async_io_close(struct async_io *io, struct async_file *file)
+{
+	// the kernel may still be writing into the buffer
+	while (file->submitted && wait_one(io) == SUCCESS)
+	{
+	}
+	close(file->fd);
+	free(file->data);
+	free(file);
+}
+
+int async_io_write(struct async_io *io, const char *path, unsigned char *data, size_t size, int *result)
+{
+	struct async_file *file = calloc(1, sizeof(struct async_file));
+	char *name = malloc(strlen(path) + 1);
+	if (file == NULL || name == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		free(file);
+		free(name);
+		free(data);
+		return *result = ERROR_OUT_OF_MEMORY;
+	}
+	if ((file->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+	{
+		fprintf(stderr, "cannot open file %s\n", path);
+		free(file);
+		free(name);
+		free(data);
+		return *result = ERROR_CANNOT_OPEN_FILE;
+	}
+	strcpy(name, path);
+	*result = ASYNC_IO_PENDING;
+	file->path = name;
+	file->data = data;
+	file->size = size;
+	file->writing = 1;
+	file->report = result;
+	io->writes++;
+	start(io, file);
+	return SUCCESS;
+}
+
+void async_io_settle(struct async_io *io, unsigned int pending)
+{
+	while (io->writes > pending && wait_one(io) == SUCCESS)
+	{
+	}
+}
+#else
+// Without POSIX files there is nothing to overlap, the batch streams every file through the decoder
+int async_io_create(struct async_io **io, enum async_io_backend backend)
+{
+	(void)backend;
+	*io = NULL;
+	return ERROR_UNSUPPORTED;
+}
+
+void async_io_destroy(struct async_io *io)
+{
+	(void)io;
+}
+
+const char *async_io_backend_name(const struct async_io *io)
+{
+	(void)io;
+	return "none";
+}
+
+int async_io_read(struct async_io *io, const char *path, struct async_file **file)
+{
+	(void)io;
+	(void)path;
+	*file = NULL;
+	return ERROR_UNSUPPORTED;
+}
+
+int async_io_wait(struct async_io *io, struct async_file *file, const unsigned char **data, size_t *size)
+{
+	(void)io;
+	(void)file;
+	*data = NULL;
+	*size = 0;
+	return ERROR_UNSUPPORTED;
+}
+
+void async_io_close(struct async_io *io, struct async_file *file)
+{
+	(void)io;
+	(void)file;
+}
+
+int async_io_write(struct async_io *io, const char *path, unsigned char *data, size_t size, int *result)
+{
+	(void)io;
+	(void)path;
+	(void)size;
+	free(data);
+	return *result = ERROR_UNSUPPORTED;
+}
+
+void async_io_settle(struct async_io *io, unsigned int pending)
+{
+	(void)io;
+	(void)pending;
+}
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+
+// File I/O for batch conversions that overlaps with decoding: inputs are read whole ahead of the image being decoded and
+// finished PNM files are written behind it. Goes through io_uring on Linux when the kernel allows it, otherwise pread and
+// pwrite do the same work in the calling thread without the overlap. An async_io belongs to one thread, every function
+// returns one of the return_codes.h values
+
+enum async_io_backend
+{
+	ASYNC_IO_AUTO,	  // io_uring when it can be set up, pread otherwise
+	ASYNC_IO_URING,
+	ASYNC_IO_PREAD,
+	ASYNC_IO_OFF	// no async_io at all, the decoder streams every file itself
+};
+
+struct async_io;
+
+// A file being read
+struct async_file;
+
+// ERROR_UNSUPPORTED for io_uring on a system or kernel without it, and for any backend on a system without pread
+int async_io_create(struct async_io **io, enum async_io_backend backend);
+
+// Waits for the writes still in flight first
+void async_io_destroy(struct async_io *io);
+
+// Accepts "auto", "io_uring", "pread" and "off"
+int async_io_parse_backend(const char *name, enum async_io_backend *backend);
+
+// The backend the async_io ended up with
+const char *async_io_backend_name(const struct async_io *io);
+
+// Opens path and starts reading all of it
+int async_io_read(struct async_io *io, const char *path, struct async_file **file);
+
+// Waits until the whole file has been read, data stays valid until async_io_close
+int async_io_wait(struct async_io *io, struct async_file *file, const unsigned char **data, size_t *size);
+
+// Also for a file that is still being read
+void async_io_close(struct async_io *io, struct async_file *file);
+
+// *result of a write that is still in flight
+#define ASYNC_IO_PENDING (-1)
+
+// Creates path and starts writing size bytes of data to it, then data is freed. *result is ASYNC_IO_PENDING until it
+// receives SUCCESS or the error once the file is written and closed, a file that could not be written is removed again;
+// it is only touched from within calls on io
+int async_io_write(struct async_io *io, const char *path, unsigned char *data, size_t size, int *result);
+
+// Waits until no more than pending writes are in flight
+void async_io_settle(struct async_io *io, unsigned int pending);
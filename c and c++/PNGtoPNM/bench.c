@@ -0,0 +1,574 @@
+#if !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include "bench.h"
+
+#include "chunk.h"
+#include "crc32.h"
+#include "filter.h"
+#include "inflater.h"
+#include "paths.h"
+#include "return_codes.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(ZLIB)
+#include <zlib.h>
+#elif defined(LIBDEFLATE)
+#include <libdeflate.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX
+#include <unistd.h>
+#endif
+
+#define BENCH_RUNS 7
+#define BENCH_IDAT_LENGTH (64 * 1024)
+
+// A PNG held in memory
+struct bench_image
+{
+	char *name;
+	unsigned char *data;
+	size_t size;
+};
+
+struct bench_corpus
+{
+	struct bench_image *items;
+	size_t count, capacity;
+};
+
+static int corpus_add(struct bench_corpus *corpus, const char *name, unsigned char *data, size_t size)
+{
+	if (corpus->count == corpus->capacity)
+	{
+		size_t capacity = corpus->capacity ? corpus->capacity * 2 : 32;
+		struct bench_image *temp = realloc(corpus->items, capacity * sizeof(struct bench_image));
+		if (temp == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			free(data);
+			return ERROR_OUT_OF_MEMORY;
+		}
+		corpus->items = temp;
+		corpus->capacity = capacity;
+	}
+	struct bench_image *image = &corpus->items[corpus->count];
+	if ((image->name = malloc(strlen(name) + 1)) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		free(data);
+		return ERROR_OUT_OF_MEMORY;
+	}
+	strcpy(image->name, name);
+	image->data = data;
+	image->size = size;
+	corpus->count++;
+	return SUCCESS;
+}
+
+static void corpus_free(struct bench_corpus *corpus)
+{
+	for (size_t i = 0; i < corpus->count; i++)
+	{
+		free(corpus->items[i].name);
+		free(corpus->items[i].data);
+	}
+	free(corpus->items);
+}
+
+static int load_file(struct bench_corpus *corpus, const char *name)
+{
+	FILE *file = fopen(name, "rb");
+	if (file == NULL)
+	{
+		fprintf(stderr, "Cannot open file %s\n", name);
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	unsigned char *data = NULL;
+	size_t size = 0, capacity = 0, got;
+	do
+	{
+		if (size == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 1024 * 1024;
+			unsigned char *temp = realloc(data, capacity);
+			if (temp == NULL)
+			{
+				fprintf(stderr, "out of memory\n");
+				free(data);
+				fclose(file);
+				return ERROR_OUT_OF_MEMORY;
+			}
+			data = temp;
+		}
+		got = fread(data + size, 1, capacity - size, file);
+		size += got;
+	} while (got > 0);
+	int failed = ferror(file);
+	fclose(file);
+	if (failed)
+	{
+		fprintf(stderr, "error while reading a file\n");
+		free(data);
+		return ERROR_UNKNOWN;
+	}
+	return corpus_add(corpus, name, data, size);
+}
+
+// Generated images are a smooth gradient with a little noise, which compresses about like a photograph, and their rows
+// cycle through every filter type
+struct synthetic_type
+{
+	const char *name;
+	unsigned char color_type, bit_depth;
+	int channels;
+};
+
+static const struct synthetic_type synthetic_types[] = {
+	{ "gray8", 0, 8, 1 }, { "gray16", 0, 16, 1 }, { "rgb8", 2, 8, 3 }, { "rgba8", 6, 8, 4 }, { "palette8", 3, 8, 1 }, { "palette4", 3, 4, 1 },
+};
+static const int synthetic_sizes[] = { 256, 1024, 2048 };
+
+static int compress_rows(const unsigned char *raw, size_t raw_size, unsigned char **compressed, size_t *compressed_size)
+{
+#if defined(ZLIB)
+	uLongf bound = compressBound(raw_size);
+	if ((*compressed = malloc(bound)) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	if (compress2(*compressed, &bound, raw, raw_size, Z_DEFAULT_COMPRESSION) != Z_OK)
+	{
+		fprintf(stderr, "failed to compress data\n");
+		free(*compressed);
+		return ERROR_UNKNOWN;
+	}
+	*compressed_size = bound;
+	return SUCCESS;
+#elif defined(LIBDEFLATE)
+	struct libdeflate_compressor *compressor = libdeflate_alloc_compressor(6);
+	if (compressor == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	size_t bound = libdeflate_zlib_compress_bound(compressor, raw_size);
+	if ((*compressed = malloc(bound)) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		libdeflate_free_compressor(compressor);
+		return ERROR_OUT_OF_MEMORY;
+	}
+	*compressed_size = libdeflate_zlib_compress(compressor, raw, raw_size, *compressed, bound);
+	libdeflate_free_compressor(compressor);
+	return SUCCESS;
+#else
+	(void)raw;
+	(void)raw_size;
+	(void)compressed;
+	(void)compressed_size;
+	return ERROR_UNSUPPORTED;
+#endif
+}
+
+// One sample of the gradient, scaled to the bit depth
+static unsigned int synthetic_sample(int x, int y, int channel, int size, int bit_depth, uint32_t *noise)
+{
+	*noise ^= *noise << 13;
+	*noise ^= *noise >> 17;
+	*noise ^= *noise << 5;
+	unsigned int maxval = (1u << bit_depth) - 1;
+	unsigned int value = (unsigned int)((uint64_t)maxval * ((x + (channel + 1) * y) % (2 * size)) / (2 * size));
+	unsigned int spread = maxval > 15 ? maxval / 64 + 1 : 2;
+	value += *noise % spread;
+	return value > maxval ? maxval : value;
+}
+
+static int generate_image(struct bench_corpus *corpus, const struct synthetic_type *type, int size)
+{
+	int bits_per_pixel = type->channels * type->bit_depth;
+	size_t bytes_per_pixel = bits_per_pixel < 8 ? 1 : bits_per_pixel / 8;
+	size_t row_length = ((size_t)size * bits_per_pixel + 7) / 8;
+	size_t raw_size = (row_length + 1) * size;
+	unsigned char *raw = malloc(raw_size);
+	unsigned char *rows = calloc(2, row_length);
+	if (raw == NULL || rows == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		free(raw);
+		free(rows);
+		return ERROR_OUT_OF_MEMORY;
+	}
+
+	uint32_t noise = 0x9E3779B9;
+	unsigned char *row = rows, *previous = rows + row_length;
+	for (int y = 0; y < size; y++)
+	{
+		memset(row, 0, row_length);
+		for (int x = 0; x < size; x++)
+		{
+			for (int c = 0; c < type->channels; c++)
+			{
+				unsigned int value = synthetic_sample(x, y, c, size, type->bit_depth, &noise);
+				size_t sample = (size_t)x * type->channels + c;
+				if (type->bit_depth == 16)
+				{
+					row[2 * sample] = value >> 8;
+					row[2 * sample + 1] = value;
+				}
+				else if (type->bit_depth == 8)
+				{
+					row[sample] = value;
+				}
+				else
+				{
+					int shift = 8 - type->bit_depth - (int)(sample * type->bit_depth % 8);
+					row[sample * type->bit_depth / 8] |= value << shift;
+				}
+			}
+		}
+		filter_apply(raw + y * (row_length + 1), row, previous, row_length, bytes_per_pixel, y % 5);
+		unsigned char *temp = previous;
+		previous = row;
+		row = temp;
+	}
+	free(rows);
+
+	unsigned char *compressed;
+	size_t compressed_size;
+	int result = compress_rows(raw, raw_size, &compressed, &compressed_size);
+	free(raw);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+
+	unsigned char palette[256 * 3];
+	int palette_entries = type->color_type == 3 ? 1 << type->bit_depth : 0;
+	for (int i = 0; i < palette_entries; i++)
+	{
+		palette[3 * i] = i * 255 / (palette_entries - 1);
+		palette[3 * i + 1] = 255 - palette[3 * i];
+		palette[3 * i + 2] = i * 97;
+	}
+
+	size_t chunks = (compressed_size + BENCH_IDAT_LENGTH - 1) / BENCH_IDAT_LENGTH;
+	unsigned char *png = malloc(8 + 25 + 12 + sizeof(palette) + compressed_size + 12 * chunks + 12);
+	if (png == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		free(compressed);
+		return ERROR_OUT_OF_MEMORY;
+	}
+	static const unsigned char signature[8] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
+	unsigned char header[13];
+	chunk_put_u32(header, size);
+	chunk_put_u32(header + 4, size);
+	header[8] = type->bit_depth;
+	header[9] = type->color_type;
+	header[10] = header[11] = header[12] = 0;
+
+	memcpy(png, signature, 8);
+	unsigned char *out = chunk_put(png + 8, "IHDR", header, 13);
+	if (palette_entries > 0)
+	{
+		out = chunk_put(out, "PLTE", palette, palette_entries * 3);
+	}
+	for (size_t offset = 0; offset < compressed_size; offset += BENCH_IDAT_LENGTH)
+	{
+		size_t length = compressed_size - offset < BENCH_IDAT_LENGTH ? compressed_size - offset : BENCH_IDAT_LENGTH;
+		out = chunk_put(out, "IDAT", compressed + offset, length);
+	}
+	out = chunk_put(out, "IEND", NULL, 0);
+	free(compressed);
+
+	char name[64];
+	snprintf(name, sizeof(name), "synthetic/%s_%d", type->name, size);
+	return corpus_add(corpus, name, png, out - png);
+}
+
+static int compare_doubles(const void *first, const void *second)
+{
+	double a = *(const double *)first, b = *(const double *)second;
+	return a < b ? -1 : a > b;
+}
+
+// Nearest rank percentile, values are sorted in place
+static double percentile(double *values, int count, double p)
+{
+	qsort(values, count, sizeof(double), compare_doubles);
+	int rank = (int)ceil(p / 100 * count);
+	return values[rank > 0 ? rank - 1 : 0];
+}
+
+static void print_name(const char *name, int json)
+{
+	if (!json)
+	{
+		// names with a comma or a quote are quoted the CSV way
+		if (strpbrk(name, ",\"") == NULL)
+		{
+			fputs(name, stdout);
+			return;
+		}
+		putchar('"');
+		for (; *name; name++)
+		{
+			if (*name == '"')
+			{
+				putchar('"');
+			}
+			putchar(*name);
+		}
+		putchar('"');
+		return;
+	}
+	putchar('"');
+	for (; *name; name++)
+	{
+		if (*name == '"' || *name == '\\')
+		{
+			putchar('\\');
+		}
+		putchar(*name);
+	}
+	putchar('"');
+}
+
+// Prints the median of every stage and percentiles of the total over the runs
+static void report(const struct bench_image *item, const struct png_image *image, enum inflate_backend backend, int verify,
+				   struct png_decode_stats *samples, int runs, int json, int first)
+{
+	double values[PNG_STAGE_COUNT + 1];
+	double *times = malloc(runs * sizeof(double));
+	if (times == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return;
+	}
+	for (int stage = 0; stage < PNG_STAGE_COUNT; stage++)
+	{
+		for (int i = 0; i < runs; i++)
+		{
+			times[i] = samples[i].seconds[stage];
+		}
+		values[stage] = percentile(times, runs, 50);
+	}
+	for (int i = 0; i < runs; i++)
+	{
+		times[i] = samples[i].total_seconds;
+	}
+	double p50 = percentile(times, runs, 50), p90 = percentile(times, runs, 90), p99 = percentile(times, runs, 99);
+	free(times);
+	double megabytes = (double)image->row_length * image->height / 1e6;
+	double megapixels = (double)image->width * image->height / 1e6;
+
+	if (json)
+	{
+		printf("%s\n  { \"image\": ", first ? "" : ",");
+		print_name(item->name, 1);
+		printf(", \"width\": %d, \"height\": %d, \"channels\": %d, \"sample_size\": %d, \"backend\": \"%s\", \"verify\": %s, \"runs\": %d,",
+			   image->width, image->height, image->channels, image->sample_size, inflater_backend_name(backend), verify ? "true" : "false", runs);
+		for (int stage = 0; stage < PNG_STAGE_COUNT; stage++)
+		{
+			printf(" \"%s_ms\": %.3f,", png_decoder_stage_name((enum png_stage)stage), values[stage] * 1e3);
+		}
+		printf(" \"total_p50_ms\": %.3f, \"total_p90_ms\": %.3f, \"total_p99_ms\": %.3f, \"mb_per_s\": %.1f, \"mp_per_s\": %.1f }",
+			   p50 * 1e3, p90 * 1e3, p99 * 1e3, megabytes / p50, megapixels / p50);
+		return;
+	}
+	print_name(item->name, 0);
+	printf(",%d,%d,%d,%d,%s,%d,%d", image->width, image->height, image->channels, image->sample_size, inflater_backend_name(backend), verify,
+		   runs);
+	for (int stage = 0; stage < PNG_STAGE_COUNT; stage++)
+	{
+		printf(",%.3f", values[stage] * 1e3);
+	}
+	printf(",%.3f,%.3f,%.3f,%.1f,%.1f\n", p50 * 1e3, p90 * 1e3, p99 * 1e3, megabytes / p50, megapixels / p50);
+}
+
+// A file of its own in the temporary directory that the PNMs are written to, so that the write stage is that of a
+// conversion. Not /dev/null: a conversion that fails removes its output
+static int output_file(char *name, size_t size)
+{
+#if defined(HAVE_POSIX)
+	const char *directory = getenv("TMPDIR");
+	snprintf(name, size, "%s/png2pnm-bench-XXXXXX", directory != NULL && *directory != '\0' ? directory : "/tmp");
+	int fd = mkstemp(name);
+	if (fd < 0)
+	{
+		fprintf(stderr, "cannot create a file in the temporary directory\n");
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	close(fd);
+#else
+	if (size < L_tmpnam || tmpnam(name) == NULL)
+	{
+		fprintf(stderr, "cannot create a file in the temporary directory\n");
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+#endif
+	return SUCCESS;
+}
+
+// One warm-up conversion, then runs timed ones, every one writing the PNM to output_name
+static int bench_image(struct png_decoder *decoder, const struct bench_image *item, int runs, struct png_decode_stats *samples,
+					   const char *output_name, struct png_image *image)
+{
+	int result = png_decoder_read_info(decoder, item->data, item->size, image);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	for (int i = -1; i < runs; i++)
+	{
+		if ((result = png_decoder_convert_memory(decoder, item->data, item->size, output_name)) != SUCCESS)
+		{
+			return result;
+		}
+		if (i >= 0)
+		{
+			png_decoder_stats(decoder, &samples[i]);
+		}
+	}
+	return SUCCESS;
+}
+
+int bench_main(int argc, char *argv[], const struct png_decode_options *options)
+{
+	int runs = BENCH_RUNS, json = 0, first = 0;
+	for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++)
+	{
+		if (strcmp(argv[first], "--runs") == 0 && first + 1 < argc && (runs = atoi(argv[first + 1])) > 0)
+		{
+			first++;
+		}
+		else if (strcmp(argv[first], "--json") == 0)
+		{
+			json = 1;
+		}
+		else
+		{
+			fprintf(stderr, "Usage: --bench [--runs <count>] [--json] [<input_file|input_directory|@list_file>...]\n");
+			return ERROR_PARAMETER_INVALID;
+		}
+	}
+
+	// the decoders are created first, they set up the crc tables the generated images need. Every backend runs with the
+	// crcs checked and without, whatever --verify says, so that what checking them costs shows
+	struct png_decoder *decoders[INFLATE_ISAL + 1][2] = { { NULL } };
+	int result = SUCCESS;
+	for (int backend = INFLATE_AUTO; result == SUCCESS && backend <= INFLATE_ISAL; backend++)
+	{
+		for (int verify = 0; result == SUCCESS && verify < 2 && inflater_available((enum inflate_backend)backend); verify++)
+		{
+			struct png_decode_options bench_options = *options;
+			bench_options.backend = (enum inflate_backend)backend;
+			bench_options.verify = verify;
+			bench_options.stats = PNG_STATS_WALL;
+			result = png_decoder_create(&decoders[backend][verify], &bench_options);
+		}
+	}
+
+	struct bench_corpus corpus = { 0 };
+	for (size_t t = 0; result == SUCCESS && t < sizeof(synthetic_types) / sizeof(synthetic_types[0]); t++)
+	{
+		for (size_t s = 0; result == SUCCESS && s < sizeof(synthetic_sizes) / sizeof(synthetic_sizes[0]); s++)
+		{
+			result = generate_image(&corpus, &synthetic_types[t], synthetic_sizes[s]);
+		}
+	}
+	if (result == ERROR_UNSUPPORTED)
+	{
+		// there is no compressor to generate images with, only the given files are measured
+		result = SUCCESS;
+	}
+	struct path_list inputs = { 0 };
+	for (int i = first; result == SUCCESS && i < argc; i++)
+	{
+		result = collect_inputs(&inputs, argv[i]);
+	}
+	for (size_t i = 0; result == SUCCESS && i < inputs.count; i++)
+	{
+		result = load_file(&corpus, inputs.items[i]);
+	}
+	path_list_free(&inputs);
+
+	struct png_decode_stats *samples = malloc(runs * sizeof(struct png_decode_stats));
+	if (result == SUCCESS && samples == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		result = ERROR_OUT_OF_MEMORY;
+	}
+	char output_name[4096];
+	if (result == SUCCESS)
+	{
+		result = output_file(output_name, sizeof(output_name));
+	}
+	int failed = SUCCESS, reported = 0, started = result == SUCCESS;
+	if (started)
+	{
+		if (json)
+		{
+			printf("[");
+		}
+		else
+		{
+			printf("image,width,height,channels,sample_size,backend,verify,runs");
+			for (int stage = 0; stage < PNG_STAGE_COUNT; stage++)
+			{
+				printf(",%s_ms", png_decoder_stage_name((enum png_stage)stage));
+			}
+			printf(",total_p50_ms,total_p90_ms,total_p99_ms,mb_per_s,mp_per_s\n");
+		}
+	}
+	for (size_t i = 0; result == SUCCESS && i < corpus.count; i++)
+	{
+		for (int backend = INFLATE_AUTO; result == SUCCESS && backend <= INFLATE_ISAL; backend++)
+		{
+			for (int verify = 0; verify < 2 && decoders[backend][verify] != NULL; verify++)
+			{
+				struct png_image image;
+				int image_result = bench_image(decoders[backend][verify], &corpus.items[i], runs, samples, output_name, &image);
+				if (image_result == ERROR_OUT_OF_MEMORY)
+				{
+					result = image_result;
+					break;
+				}
+				if (image_result != SUCCESS)
+				{
+					// a broken file is left out of the report, the others are still measured
+					fprintf(stderr, "%s: failed with %s%s\n", corpus.items[i].name, inflater_backend_name((enum inflate_backend)backend),
+							verify ? " and --verify" : "");
+					failed = image_result;
+					continue;
+				}
+				report(&corpus.items[i], &image, (enum inflate_backend)backend, verify, samples, runs, json, reported++ == 0);
+			}
+		}
+	}
+	if (json && started)
+	{
+		printf("\n]\n");
+	}
+
+	if (started)
+	{
+		remove(output_name);
+	}
+	free(samples);
+	corpus_free(&corpus);
+	for (int backend = INFLATE_AUTO; backend <= INFLATE_ISAL; backend++)
+	{
+		png_decoder_destroy(decoders[backend][0]);
+		png_decoder_destroy(decoders[backend][1]);
+	}
+	return result != SUCCESS ? result : failed;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "png_decoder.h"
+
+// --bench: converts a corpus held in memory with every inflate backend the build links, each with the crcs checked as
+// --verify does and without, and prints the time of every stage as CSV, or JSON with --json. The PNMs are written to a file in the temporary directory, so the write stage is that of a
+// real conversion. The corpus is a set of generated images plus the PNG files, directories and @lists in argv, which
+// starts after --bench
+int bench_main(int argc, char *argv[], const struct png_decode_options *options);
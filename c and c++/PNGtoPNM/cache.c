@@ -0,0 +1,365 @@
+#if !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include "cache.h"
+
+#include "return_codes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
+
+int cache_convert_file(struct cache *cache, struct png_decoder *decoder, const struct png_decode_options *options,
+					   const char *input_name, const char *output_name, int *hit)
+{
+	unsigned char fingerprint[PNG_FINGERPRINT_SIZE];
+	*hit = 0;
+	if (cache == NULL || strcmp(input_name, "-") == 0 || strcmp(output_name, "-") == 0)
+	{
+		return png_decoder_convert_file(decoder, input_name, output_name);
+	}
+	// an input the fingerprint cannot walk fails to decode the same way, the error is already reported
+	int result = png_fingerprint_file(input_name, options, fingerprint);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	if (cache_fetch(cache, fingerprint, output_name) == SUCCESS)
+	{
+		*hit = 1;
+		return SUCCESS;
+	}
+	if ((result = png_decoder_convert_file(decoder, input_name, output_name)) == SUCCESS)
+	{
+		cache_store(cache, fingerprint, output_name);
+	}
+	return result;
+}
+
+#if defined(HAVE_POSIX)
+#define CACHE_COPY_BUFFER (1 << 20)
+#define CACHE_STALE_SECONDS 3600	// temporary files this old were left behind by a process that did not finish
+
+struct cache
+{
+	char *directory;
+	size_t limit;
+	pthread_mutex_t lock;	 // over bytes, and held while evicting
+	size_t bytes;			 // of the entries at the last scan and those stored since
+	unsigned int temporaries;	 // numbers the temporary files of the process
+};
+
+// An entry that may be evicted
+struct cache_entry
+{
+	time_t used;
+	size_t size;
+	char *name;
+};
+
+static int entry_order(const void *a, const void *b)
+{
+	const struct cache_entry *first = a, *second = b;
+	return first->used < second->used ? -1 : first->used > second->used;
+}
+
+static int has_suffix(const char *name, const char *suffix)
+{
+	size_t length = strlen(name), suffix_length = strlen(suffix);
+	return length > suffix_length && strcmp(name + length - suffix_length, suffix) == 0;
+}
+
+// <directory>/<32 hex digits>.pnm
+static char *entry_path(const struct cache *cache, const unsigned char fingerprint[PNG_FINGERPRINT_SIZE])
+{
+	char *path = malloc(strlen(cache->directory) + 2 * PNG_FINGERPRINT_SIZE + 6);
+	if (path != NULL)
+	{
+		size_t length = (size_t)sprintf(path, "%s/", cache->directory);
+		for (int i = 0; i < PNG_FINGERPRINT_SIZE; i++)
+		{
+			length += (size_t)sprintf(path + length, "%02x", fingerprint[i]);
+		}
+		strcpy(path + length, ".pnm");
+	}
+	return path;
+}
+
+// A reflink where the file system has them, otherwise the bytes are copied
+static int copy_file(const char *from, const char *to)
+{
+	int input = open(from, O_RDONLY);
+	if (input < 0)
+	{
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	int output = open(to, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (output < 0)
+	{
+		close(input);
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+#if defined(FICLONE)
+	if (ioctl(output, FICLONE, input) == 0)
+	{
+		close(input);
+		return close(output) == 0 ? SUCCESS : ERROR_UNKNOWN;
+	}
+#endif
+	unsigned char *buffer = malloc(CACHE_COPY_BUFFER);
+	int result = buffer != NULL ? SUCCESS : ERROR_OUT_OF_MEMORY;
+	while (result == SUCCESS)
+	{
+		ssize_t length = read(input, buffer, CACHE_COPY_BUFFER);
+		if (length == 0)
+		{
+			break;
+		}
+		for (ssize_t written = 0, part; result == SUCCESS && written < length; written += part)
+		{
+			if ((part = write(output, buffer + written, (size_t)(length - written))) <= 0)
+			{
+				result = ERROR_UNKNOWN;
+			}
+		}
+		if (length < 0)
+		{
+			result = ERROR_UNKNOWN;
+		}
+	}
+	free(buffer);
+	close(input);
+	if (close(output) != 0 && result == SUCCESS)
+	{
+		result = ERROR_UNKNOWN;
+	}
+	return result;
+}
+
+// Makes to a copy of from without to ever being seen half done. A hard link would do without the copy, but then writing
+// into the output of one conversion would change the cached PNM that later hits are served from
+static int place(struct cache *cache, const char *from, const char *to)
+{
+	char *temporary = malloc(strlen(to) + 48);
+	if (temporary == NULL)
+	{
+		return ERROR_OUT_OF_MEMORY;
+	}
+	sprintf(temporary, "%s.%ld.%u.tmp", to, (long)getpid(), __atomic_fetch_add(&cache->temporaries, 1, __ATOMIC_RELAXED));
+	int result = copy_file(from, temporary);
+	if (result == SUCCESS && rename(temporary, to) != 0)
+	{
+		result = ERROR_CANNOT_OPEN_FILE;
+	}
+	if (result != SUCCESS)
+	{
+		unlink(temporary);
+	}
+	free(temporary);
+	return result;
+}
+
+// Counts the entries and, above the limit, removes the least recently used down to three quarters of it, so that the
+// directory is not scanned again on every store. The caller holds the lock
+static int scan(struct cache *cache)
+{
+	DIR *directory = opendir(cache->directory);
+	if (directory == NULL)
+	{
+		fprintf(stderr, "Cannot open directory %s\n", cache->directory);
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	struct cache_entry *entries = NULL;
+	size_t count = 0, capacity = 0, total = 0;
+	time_t now = time(NULL);
+	int result = SUCCESS;
+	struct dirent *item;
+	while (result == SUCCESS && (item = readdir(directory)) != NULL)
+	{
+		int entry = has_suffix(item->d_name, ".pnm"), temporary = has_suffix(item->d_name, ".tmp");
+		struct stat status;
+		char *path = entry || temporary ? malloc(strlen(cache->directory) + strlen(item->d_name) + 2) : NULL;
+		if (path == NULL)
+		{
+			result = entry || temporary ? ERROR_OUT_OF_MEMORY : SUCCESS;
+			continue;
+		}
+		sprintf(path, "%s/%s", cache->directory, item->d_name);
+		if (stat(path, &status) != 0 || !S_ISREG(status.st_mode) || (temporary && now - status.st_mtime < CACHE_STALE_SECONDS))
+		{
+			free(path);
+			continue;
+		}
+		if (temporary)
+		{
+			unlink(path);
+			free(path);
+			continue;
+		}
+		if (count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 256;
+			struct cache_entry *temp = realloc(entries, capacity * sizeof(struct cache_entry));
+			if (temp == NULL)
+			{
+				free(path);
+				result = ERROR_OUT_OF_MEMORY;
+				continue;
+			}
+			entries = temp;
+		}
+		entries[count].used = status.st_mtime;
+		entries[count].size = (size_t)status.st_size;
+		entries[count++].name = path;
+		total += (size_t)status.st_size;
+	}
+	closedir(directory);
+
+	if (result == SUCCESS && total > cache->limit)
+	{
+		qsort(entries, count, sizeof(struct cache_entry), entry_order);
+		for (size_t i = 0; i < count && total > cache->limit / 4 * 3; i++)
+		{
+			if (unlink(entries[i].name) == 0)
+			{
+				total -= entries[i].size;
+			}
+		}
+	}
+	if (result == SUCCESS)
+	{
+		cache->bytes = total;
+	}
+	else
+	{
+		fprintf(stderr, "out of memory\n");
+	}
+	for (size_t i = 0; i < count; i++)
+	{
+		free(entries[i].name);
+	}
+	free(entries);
+	return result;
+}
+
+int cache_open(struct cache **cache, const char *directory, size_t limit)
+{
+	struct stat status;
+	if (stat(directory, &status) != 0 && mkdir(directory, 0777) != 0)
+	{
+		fprintf(stderr, "Cannot create directory %s\n", directory);
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	if ((*cache = calloc(1, sizeof(struct cache))) == NULL || ((*cache)->directory = malloc(strlen(directory) + 1)) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		free(*cache);
+		return ERROR_OUT_OF_MEMORY;
+	}
+	strcpy((*cache)->directory, directory);
+	(*cache)->limit = limit;
+	pthread_mutex_init(&(*cache)->lock, NULL);
+	int result = scan(*cache);
+	if (result != SUCCESS)
+	{
+		cache_close(*cache);
+		*cache = NULL;
+	}
+	return result;
+}
+
+void cache_close(struct cache *cache)
+{
+	if (cache == NULL)
+	{
+		return;
+	}
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->directory);
+	free(cache);
+}
+
+int cache_fetch(struct cache *cache, const unsigned char fingerprint[PNG_FINGERPRINT_SIZE], const char *output_name)
+{
+	char *entry = entry_path(cache, fingerprint);
+	int result = entry != NULL ? place(cache, entry, output_name) : ERROR_OUT_OF_MEMORY;
+	if (result == SUCCESS)
+	{
+		// the most recently used entry from now on
+		utimes(entry, NULL);
+	}
+	free(entry);
+	return result;
+}
+
+void cache_store(struct cache *cache, const unsigned char fingerprint[PNG_FINGERPRINT_SIZE], const char *output_name)
+{
+	struct stat status;
+	char *entry = entry_path(cache, fingerprint);
+	// a PNM larger than the whole cache would only push everything else out
+	if (entry == NULL || stat(output_name, &status) != 0 || (size_t)status.st_size > cache->limit)
+	{
+		free(entry);
+		return;
+	}
+	if (place(cache, output_name, entry) != SUCCESS)
+	{
+		fprintf(stderr, "cannot add %s to the cache\n", output_name);
+		free(entry);
+		return;
+	}
+	free(entry);
+
+	pthread_mutex_lock(&cache->lock);
+	cache->bytes += (size_t)status.st_size;
+	if (cache->bytes > cache->limit)
+	{
+		scan(cache);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+#else
+int cache_open(struct cache **cache, const char *directory, size_t limit)
+{
+	(void)directory;
+	(void)limit;
+	*cache = NULL;
+	fprintf(stderr, "--cache needs a POSIX system\n");
+	return ERROR_UNSUPPORTED;
+}
+
+void cache_close(struct cache *cache)
+{
+	(void)cache;
+}
+
+int cache_fetch(struct cache *cache, const unsigned char fingerprint[PNG_FINGERPRINT_SIZE], const char *output_name)
+{
+	(void)cache;
+	(void)fingerprint;
+	(void)output_name;
+	return ERROR_UNSUPPORTED;
+}
+
+void cache_store(struct cache *cache, const unsigned char fingerprint[PNG_FINGERPRINT_SIZE], const char *output_name)
+{
+	(void)cache;
+	(void)fingerprint;
+	(void)output_name;
+}
+#endif
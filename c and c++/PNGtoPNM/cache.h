@@ -0,0 +1,32 @@
+#pragma once
+
+#include "png_decoder.h"
+
+#include <stddef.h>
+
+// Conversion cache: a directory of PNM files named after the png_fingerprint_file of the PNG they were converted from, so
+// an input that was converted before is copied to its output instead of being decoded again. Entries and outputs never
+// share their data, a copy is a reflink where the file system has them. Once the files add up to more than the size
+// limit, the least recently used ones are removed. Threads and processes may share a directory.
+// POSIX only, cache_open is ERROR_UNSUPPORTED elsewhere
+
+#define CACHE_DEFAULT_SIZE ((size_t)1 << 30)
+
+struct cache;
+
+// Creates directory when it does not exist yet and evicts down to limit bytes
+int cache_open(struct cache **cache, const char *directory, size_t limit);
+
+void cache_close(struct cache *cache);
+
+// Puts a copy of the PNM of fingerprint at output_name, SUCCESS on a hit. On a miss output_name is left alone
+int cache_fetch(struct cache *cache, const unsigned char fingerprint[PNG_FINGERPRINT_SIZE], const char *output_name);
+
+// Adds a copy of the PNM at output_name under fingerprint. A file that cannot be added is only reported, the conversion stands
+void cache_store(struct cache *cache, const unsigned char fingerprint[PNG_FINGERPRINT_SIZE], const char *output_name);
+
+// png_decoder_convert_file through the cache, options are those the decoder was created with. *hit tells whether the
+// output came from the cache, the decoder then has no stats of it. Without a cache, or with "-" on either side, it is
+// png_decoder_convert_file
+int cache_convert_file(struct cache *cache, struct png_decoder *decoder, const struct png_decode_options *options,
+					   const char *input_name, const char *output_name, int *hit);
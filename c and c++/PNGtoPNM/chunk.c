@@ -0,0 +1,41 @@
+#include "chunk.h"
+
+#include "crc32.h"
+#include "return_codes.h"
+
+#include <string.h>
+
+void chunk_put_u32(unsigned char *out, uint32_t value)
+{
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
+
+unsigned char *chunk_put(unsigned char *out, const char *name, const unsigned char *data, size_t length)
+{
+	chunk_put_u32(out, (uint32_t)length);
+	memcpy(out + 4, name, 4);
+	if (length > 0)
+	{
+		memcpy(out + 8, data, length);
+	}
+	chunk_put_u32(out + 8 + length, crc32_update(0, out + 4, length + 4));
+	return out + 12 + length;
+}
+
+int chunk_write(FILE *file, const char *name, const unsigned char *data, size_t length)
+{
+	unsigned char head[8], crc[4];
+	chunk_put_u32(head, (uint32_t)length);
+	memcpy(head + 4, name, 4);
+	chunk_put_u32(crc, crc32_update(crc32_update(0, head + 4, 4), data, length));
+	// IEND has no data, which may then be NULL
+	if (fwrite(head, 1, 8, file) != 8 || (length > 0 && fwrite(data, 1, length, file) != length) || fwrite(crc, 1, 4, file) != 4)
+	{
+		fprintf(stderr, "error while writing a file\n");
+		return ERROR_UNKNOWN;
+	}
+	return SUCCESS;
+}
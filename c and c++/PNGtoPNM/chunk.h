@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Writing PNG chunks, for the encoder and the images the benchmark generates. crc32_init has to have been called
+
+void chunk_put_u32(unsigned char *out, uint32_t value);
+
+// Puts length, name, data and crc at out, returns the end of the chunk
+unsigned char *chunk_put(unsigned char *out, const char *name, const unsigned char *data, size_t length);
+
+// Returns SUCCESS or ERROR_UNKNOWN when the file cannot be written
+int chunk_write(FILE *file, const char *name, const unsigned char *data, size_t length);
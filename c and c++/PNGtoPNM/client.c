@@ -0,0 +1,261 @@
+#if !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+// Client of png2pnm --daemon, built as a program of its own from client.c and protocol.c:
+//   client [--send] [--receive] [--repeat <count>] <socket_path> <input_file_name|-> <output_file_name|->
+//   client <socket_path> --stats
+// --send passes the PNG itself instead of its path, --receive gets the PNM back instead of having the daemon write it.
+// Paths the daemon opens are made absolute first. The exit code is the result of the last request
+
+#include "protocol.h"
+#include "return_codes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Reads a whole file, "-" is stdin
+static unsigned char *read_all(const char *path, size_t *size)
+{
+	FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+	if (file == NULL)
+	{
+		fprintf(stderr, "Cannot open file %s\n", path);
+		return NULL;
+	}
+	unsigned char *data = NULL;
+	size_t capacity = 0;
+	*size = 0;
+	for (;;)
+	{
+		if (*size == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 65536;
+			unsigned char *temp = realloc(data, capacity);
+			if (temp == NULL)
+			{
+				fprintf(stderr, "out of memory\n");
+				free(data);
+				data = NULL;
+				break;
+			}
+			data = temp;
+		}
+		size_t read = fread(data + *size, 1, capacity - *size, file);
+		*size += read;
+		if (read == 0)
+		{
+			break;
+		}
+	}
+	if (file != stdin)
+	{
+		fclose(file);
+	}
+	return data;
+}
+
+// The daemon has a working directory of its own
+static char *absolute_path(const char *path)
+{
+	char directory[PATH_MAX];
+	if (path[0] == '/' || getcwd(directory, sizeof(directory)) == NULL)
+	{
+		return strdup(path);
+	}
+	char *absolute = malloc(strlen(directory) + strlen(path) + 2);
+	if (absolute != NULL)
+	{
+		sprintf(absolute, "%s/%s", directory, path);
+	}
+	return absolute;
+}
+
+static int connect_to(const char *path)
+{
+	struct sockaddr_un address = { 0 };
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path))
+	{
+		fprintf(stderr, "socket path %s is too long\n", path);
+		return -1;
+	}
+	strcpy(address.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+	{
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0)
+	{
+		fprintf(stderr, "cannot connect to %s\n", path);
+	}
+	return fd;
+}
+
+// Sends one request and reads its response, *response holds what came back unless it was empty
+static int request(int fd, uint32_t type, uint32_t flags, const void *input, size_t input_length, const char *output,
+				   unsigned char **response, size_t *response_length)
+{
+	unsigned char head[12];
+	size_t output_length = strlen(output);
+	protocol_put(head, type);
+	protocol_put(head + 4, flags);
+	protocol_put(head + 8, (uint32_t)input_length);
+	if (protocol_write(fd, head, 12) != SUCCESS || protocol_write(fd, input, input_length) != SUCCESS)
+	{
+		fprintf(stderr, "the daemon closed the connection\n");
+		return ERROR_UNKNOWN;
+	}
+	protocol_put(head, (uint32_t)output_length);
+	if (protocol_write(fd, head, 4) != SUCCESS || protocol_write(fd, output, output_length) != SUCCESS ||
+		protocol_read(fd, head, 8) != 8)
+	{
+		fprintf(stderr, "the daemon closed the connection\n");
+		return ERROR_UNKNOWN;
+	}
+
+	int result = (int)protocol_get(head);
+	*response_length = protocol_get(head + 4);
+	if (*response_length != 0)
+	{
+		unsigned char *temp = realloc(*response, *response_length);
+		if (temp == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			return ERROR_OUT_OF_MEMORY;
+		}
+		*response = temp;
+		if (protocol_read(fd, *response, *response_length) != *response_length)
+		{
+			fprintf(stderr, "the daemon closed the connection\n");
+			return ERROR_UNKNOWN;
+		}
+	}
+	return result;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t flags = 0;
+	long repeat = 1;
+	int first = 1;
+	for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++)
+	{
+		if (strcmp(argv[first], "--send") == 0)
+		{
+			flags |= PROTOCOL_INLINE_INPUT;
+		}
+		else if (strcmp(argv[first], "--receive") == 0)
+		{
+			flags |= PROTOCOL_INLINE_OUTPUT;
+		}
+		else if (strcmp(argv[first], "--repeat") == 0 && first + 1 < argc && (repeat = strtol(argv[first + 1], NULL, 10)) > 0)
+		{
+			first++;
+		}
+		else
+		{
+			break;
+		}
+	}
+	int stats = argc - first == 2 && strcmp(argv[first + 1], "--stats") == 0;
+	if (argc - first != 3 && !stats)
+	{
+		fprintf(stderr, "Usage: %s [--send] [--receive] [--repeat <count>] <socket_path> <input_file_name|-> <output_file_name|->\n",
+				argv[0]);
+		fprintf(stderr, "       %s <socket_path> --stats\n", argv[0]);
+		return ERROR_PARAMETER_INVALID;
+	}
+
+	int fd = connect_to(argv[first]);
+	if (fd < 0)
+	{
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	unsigned char *response = NULL;
+	size_t response_length = 0;
+	int result;
+	if (stats)
+	{
+		result = request(fd, PROTOCOL_STATS, 0, "", 0, "", &response, &response_length);
+		if (result == SUCCESS)
+		{
+			fwrite(response, 1, response_length, stdout);
+		}
+		close(fd);
+		free(response);
+		return result;
+	}
+
+	const char *input_name = argv[first + 1], *output_name = argv[first + 2];
+	unsigned char *input = NULL;
+	char *output = NULL;
+	size_t input_length = 0;
+	if (flags & PROTOCOL_INLINE_INPUT)
+	{
+		input = read_all(input_name, &input_length);
+	}
+	else if ((input = (unsigned char *)absolute_path(input_name)) != NULL)
+	{
+		input_length = strlen((char *)input);
+	}
+	output = flags & PROTOCOL_INLINE_OUTPUT ? strdup("") : absolute_path(output_name);
+	if (input == NULL || output == NULL)
+	{
+		free(input);
+		free(output);
+		close(fd);
+		return input == NULL ? ERROR_CANNOT_OPEN_FILE : ERROR_OUT_OF_MEMORY;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	result = SUCCESS;
+	for (long i = 0; i < repeat && result == SUCCESS; i++)
+	{
+		result = request(fd, PROTOCOL_CONVERT, flags, input, input_length, output, &response, &response_length);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (repeat > 1)
+	{
+		double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+		fprintf(stderr, "requests=%ld mean_us=%.1f\n", repeat, seconds * 1e6 / repeat);
+	}
+
+	if (result == SUCCESS && (flags & PROTOCOL_INLINE_OUTPUT))
+	{
+		FILE *file = strcmp(output_name, "-") == 0 ? stdout : fopen(output_name, "wb");
+		int written = file != NULL && fwrite(response, 1, response_length, file) == response_length;
+		if (file != NULL && (file == stdout ? fflush(file) : fclose(file)) != 0)
+		{
+			written = 0;
+		}
+		if (!written)
+		{
+			fprintf(stderr, "error while writing a file\n");
+			result = ERROR_UNKNOWN;
+		}
+	}
+	close(fd);
+	free(input);
+	free(output);
+	free(response);
+	return result;
+}
+#else
+int main(void)
+{
+	fprintf(stderr, "the daemon needs UNIX domain sockets\n");
+	return ERROR_UNSUPPORTED;
+}
+#endif
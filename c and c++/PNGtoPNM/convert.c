@@ -0,0 +1,457 @@
+#include "convert.h"
+
+#include "cpu.h"
+#include "paeth.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONVERT_X86
+#include <immintrin.h>
+#endif
+
+#if defined(CONVERT_X86)
+static int has_sse2, has_ssse3, has_avx2;
+#endif
+
+// Gray and RGB scanlines, 16 bit ones included, already are PNM samples since both formats store them big-endian
+static unsigned char *convert_copy(unsigned char *pixels, unsigned char *output_row, int width, const unsigned char *table)
+{
+	(void)output_row;
+	(void)width;
+	(void)table;
+	return pixels;
+}
+
+// Sample j of a scanline with DEPTH bits per sample, the first sample is in the high bits of a byte
+#define PACKED_SAMPLE(PIXELS, J, DEPTH) ((PIXELS[(J) / (8 / DEPTH)] >> (8 - DEPTH - (J) % (8 / DEPTH) * DEPTH)) & ((1 << DEPTH) - 1))
+
+// Entry b of a palette table holds the samples of the 8 / DEPTH pixels whose indices byte b packs, CHANNELS bytes each,
+// padded to a power of two
+#define PALETTE_ENTRY(CHANNELS, DEPTH) (8 / (DEPTH) * (CHANNELS))
+#define PALETTE_STRIDE(CHANNELS, DEPTH)                                  \
+	(PALETTE_ENTRY(CHANNELS, DEPTH) <= 2	? PALETTE_ENTRY(CHANNELS, DEPTH) \
+	 : PALETTE_ENTRY(CHANNELS, DEPTH) <= 4	? 4                              \
+	 : PALETTE_ENTRY(CHANNELS, DEPTH) <= 8	? 8                              \
+	 : PALETTE_ENTRY(CHANNELS, DEPTH) <= 16 ? 16                             \
+											: 32)
+
+void convert_build_table(unsigned char *table, const unsigned char *palette, unsigned char bit_depth, int output_channels)
+{
+	int per_byte = 8 / bit_depth, stride = PALETTE_STRIDE(output_channels, bit_depth);
+
+	memset(table, 0, 256 * (size_t)stride);
+	for (int value = 0; value < 256; value++)
+	{
+		unsigned char *entry = table + value * stride;
+		for (int j = 0; j < per_byte; j++)
+		{
+			int index = (value >> (8 - bit_depth - j * bit_depth)) & ((1 << bit_depth) - 1);
+			memcpy(entry + j * output_channels, palette + index * 3, output_channels);
+		}
+	}
+}
+
+#if defined(CONVERT_X86)
+// 8 bit indices of None and Up scanlines do not depend on each other, so 8 of them at a time are unfiltered, looked up
+// with a gather and packed together with a shuffle. The stores reach up to 4 bytes past the 8 pixels, which the pixels
+// after them overwrite again. Returns the number of pixels done
+__attribute__((target("avx2"))) static size_t expand8_avx2(unsigned char *row, const unsigned char *previous_row, unsigned char *output,
+														   int width, const unsigned char *table, int channels, int up)
+{
+	const __m256i pack3 = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13,
+										   14, -1, -1, -1, -1);
+	const __m256i pack1 = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 4, 8, 12, -1, -1, -1, -1,
+										   -1, -1, -1, -1, -1, -1, -1, -1);
+	size_t j = 0;
+	for (; j + 10 <= (size_t)width; j += 8)
+	{
+		__m128i indices = _mm_loadl_epi64((const __m128i *)(row + j));
+		if (up)
+		{
+			indices = _mm_add_epi8(indices, _mm_loadl_epi64((const __m128i *)(previous_row + j)));
+			_mm_storel_epi64((__m128i *)(row + j), indices);
+		}
+		__m256i offsets = _mm256_cvtepu8_epi32(indices);
+		if (channels == 3)
+		{
+			__m256i colors = _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int *)table, offsets, 4), pack3);
+			_mm_storeu_si128((__m128i *)(output + j * 3), _mm256_castsi256_si128(colors));
+			_mm_storeu_si128((__m128i *)(output + j * 3 + 12), _mm256_extracti128_si256(colors, 1));
+		}
+		else
+		{
+			__m256i grays = _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int *)table, offsets, 1), pack1);
+			grays = _mm256_permutevar8x32_epi32(grays, _mm256_setr_epi32(0, 4, 1, 1, 1, 1, 1, 1));
+			_mm_storel_epi64((__m128i *)(output + j), _mm256_castsi256_si128(grays));
+		}
+	}
+	return j;
+}
+
+#define EXPAND8_AVX2(CHANNELS, DEPTH, UP)                                                                \
+	if (DEPTH == 8 && has_avx2)                                                            \
+	{                                                                                      \
+		start = expand8_avx2(row, previous_row, output_row, width, table, CHANNELS, UP);   \
+	}
+#else
+#define EXPAND8_AVX2(CHANNELS, DEPTH, UP)
+#endif
+
+// PREDICT is the filter prediction from left, the byte before in the same scanline, and previous_row; FAST may do a
+// first part of the row and move start past it. Every byte copies its whole padded table entry, which the next one
+// partly overwrites again; only the last whole byte and the partly used one after it stop at the end of the row
+#define DEFINE_UNFILTER_CONVERT(FILTER, CHANNELS, DEPTH, PREDICT, FAST)                                                      \
+	static void unfilter_convert_##FILTER##CHANNELS##_##DEPTH(unsigned char *row, const unsigned char *previous_row,          \
+															  unsigned char *output_row, int width, const unsigned char *table) \
+	{                                                                                                                        \
+		enum                                                                                                                 \
+		{                                                                                                                    \
+			ENTRY = PALETTE_ENTRY(CHANNELS, DEPTH),                                                                          \
+			STRIDE = PALETTE_STRIDE(CHANNELS, DEPTH)                                                                         \
+		};                                                                                                                   \
+		size_t length = ((size_t)width * DEPTH + 7) / 8, full = (size_t)width / (8 / DEPTH), start = 0;                      \
+		(void)previous_row;                                                                                                  \
+		FAST;                                                                                                                \
+		unsigned int left = start > 0 ? row[start - 1] : 0;                                                                  \
+		for (size_t i = start; i < length; i++)                                                                              \
+		{                                                                                                                    \
+			unsigned char value = (unsigned char)(row[i] + (PREDICT));                                                       \
+			row[i] = value;                                                                                                  \
+			left = value;                                                                                                    \
+			const unsigned char *entry = table + value * STRIDE;                                                             \
+			if (i + 1 < full)                                                                                                \
+			{                                                                                                                \
+				memcpy(output_row + i * ENTRY, entry, STRIDE);                                                               \
+			}                                                                                                                \
+			else                                                                                                             \
+			{                                                                                                                \
+				memcpy(output_row + i * ENTRY, entry, i < full ? ENTRY : (width - i * (8 / DEPTH)) * CHANNELS);              \
+			}                                                                                                                \
+		}                                                                                                                    \
+		(void)left;                                                                                                          \
+	}
+
+#define DEFINE_UNFILTER_CONVERT_FILTERS(CHANNELS, DEPTH)                                                                   \
+	DEFINE_UNFILTER_CONVERT(none, CHANNELS, DEPTH, 0, EXPAND8_AVX2(CHANNELS, DEPTH, 0))                                                  \
+	DEFINE_UNFILTER_CONVERT(sub, CHANNELS, DEPTH, left, )                                                                  \
+	DEFINE_UNFILTER_CONVERT(up, CHANNELS, DEPTH, previous_row[i], EXPAND8_AVX2(CHANNELS, DEPTH, 1))                                      \
+	DEFINE_UNFILTER_CONVERT(average, CHANNELS, DEPTH, (left + previous_row[i]) >> 1, )                                     \
+	DEFINE_UNFILTER_CONVERT(paeth, CHANNELS, DEPTH, paeth(left, previous_row[i], i > 0 ? previous_row[i - 1] : 0), )       \
+                                                                                                                           \
+	static unsigned char *convert_palette##CHANNELS##_##DEPTH(unsigned char *pixels, unsigned char *output_row, int width, \
+															  const unsigned char *table)                                  \
+	{                                                                                                                      \
+		unfilter_convert_none##CHANNELS##_##DEPTH(pixels, NULL, output_row, width, table);                                 \
+		return output_row;                                                                                                 \
+	}
+
+DEFINE_UNFILTER_CONVERT_FILTERS(1, 1)
+DEFINE_UNFILTER_CONVERT_FILTERS(1, 2)
+DEFINE_UNFILTER_CONVERT_FILTERS(1, 4)
+DEFINE_UNFILTER_CONVERT_FILTERS(1, 8)
+DEFINE_UNFILTER_CONVERT_FILTERS(3, 1)
+DEFINE_UNFILTER_CONVERT_FILTERS(3, 2)
+DEFINE_UNFILTER_CONVERT_FILTERS(3, 4)
+DEFINE_UNFILTER_CONVERT_FILTERS(3, 8)
+
+#if defined(CONVERT_X86)
+// Every 16 bytes of the scanline give 128 / DEPTH samples. The fields of a byte are shifted down in separate registers,
+// then interleaved so that they come out in scanline order
+
+__attribute__((target("sse2"))) static int unpack4_sse2(const unsigned char *pixels, unsigned char *output, int width)
+{
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	int j = 0;
+	for (; j + 32 <= width; j += 32, pixels += 16)
+	{
+		__m128i packed = _mm_loadu_si128((const __m128i *)pixels);
+		__m128i high = _mm_and_si128(_mm_srli_epi16(packed, 4), mask);
+		__m128i low = _mm_and_si128(packed, mask);
+		_mm_storeu_si128((__m128i *)(output + j), _mm_unpacklo_epi8(high, low));
+		_mm_storeu_si128((__m128i *)(output + j + 16), _mm_unpackhi_epi8(high, low));
+	}
+	return j;
+}
+
+__attribute__((target("sse2"))) static int unpack2_sse2(const unsigned char *pixels, unsigned char *output, int width)
+{
+	const __m128i mask = _mm_set1_epi8(0x03);
+	int j = 0;
+	for (; j + 64 <= width; j += 64, pixels += 16)
+	{
+		__m128i packed = _mm_loadu_si128((const __m128i *)pixels);
+		__m128i field0 = _mm_and_si128(_mm_srli_epi16(packed, 6), mask);
+		__m128i field1 = _mm_and_si128(_mm_srli_epi16(packed, 4), mask);
+		__m128i field2 = _mm_and_si128(_mm_srli_epi16(packed, 2), mask);
+		__m128i field3 = _mm_and_si128(packed, mask);
+
+		__m128i low01 = _mm_unpacklo_epi8(field0, field1), high01 = _mm_unpackhi_epi8(field0, field1);
+		__m128i low23 = _mm_unpacklo_epi8(field2, field3), high23 = _mm_unpackhi_epi8(field2, field3);
+		_mm_storeu_si128((__m128i *)(output + j), _mm_unpacklo_epi16(low01, low23));
+		_mm_storeu_si128((__m128i *)(output + j + 16), _mm_unpackhi_epi16(low01, low23));
+		_mm_storeu_si128((__m128i *)(output + j + 32), _mm_unpacklo_epi16(high01, high23));
+		_mm_storeu_si128((__m128i *)(output + j + 48), _mm_unpackhi_epi16(high01, high23));
+	}
+	return j;
+}
+
+__attribute__((target("sse2"))) static int unpack1_sse2(const unsigned char *pixels, unsigned char *output, int width)
+{
+	const __m128i mask = _mm_set1_epi8(0x01);
+	int j = 0;
+	for (; j + 128 <= width; j += 128, pixels += 16)
+	{
+		__m128i packed = _mm_loadu_si128((const __m128i *)pixels);
+		__m128i field[8], pairs[8], quads[8];
+		field[0] = _mm_and_si128(_mm_srli_epi16(packed, 7), mask);
+		field[1] = _mm_and_si128(_mm_srli_epi16(packed, 6), mask);
+		field[2] = _mm_and_si128(_mm_srli_epi16(packed, 5), mask);
+		field[3] = _mm_and_si128(_mm_srli_epi16(packed, 4), mask);
+		field[4] = _mm_and_si128(_mm_srli_epi16(packed, 3), mask);
+		field[5] = _mm_and_si128(_mm_srli_epi16(packed, 2), mask);
+		field[6] = _mm_and_si128(_mm_srli_epi16(packed, 1), mask);
+		field[7] = _mm_and_si128(packed, mask);
+
+		// pairs[2k] holds fields 2k and 2k+1 of bytes 0-7, pairs[2k+1] those of bytes 8-15
+		for (int k = 0; k < 4; k++)
+		{
+			pairs[2 * k] = _mm_unpacklo_epi8(field[2 * k], field[2 * k + 1]);
+			pairs[2 * k + 1] = _mm_unpackhi_epi8(field[2 * k], field[2 * k + 1]);
+		}
+		// quads[0-3] hold fields 0-3 of bytes 0-3, 4-7, 8-11 and 12-15, quads[4-7] fields 4-7 of the same bytes
+		for (int k = 0; k < 2; k++)
+		{
+			quads[2 * k] = _mm_unpacklo_epi16(pairs[k], pairs[k + 2]);
+			quads[2 * k + 1] = _mm_unpackhi_epi16(pairs[k], pairs[k + 2]);
+			quads[2 * k + 4] = _mm_unpacklo_epi16(pairs[k + 4], pairs[k + 6]);
+			quads[2 * k + 5] = _mm_unpackhi_epi16(pairs[k + 4], pairs[k + 6]);
+		}
+		for (int k = 0; k < 4; k++)
+		{
+			_mm_storeu_si128((__m128i *)(output + j + 32 * k), _mm_unpacklo_epi32(quads[k], quads[k + 4]));
+			_mm_storeu_si128((__m128i *)(output + j + 32 * k + 16), _mm_unpackhi_epi32(quads[k], quads[k + 4]));
+		}
+	}
+	return j;
+}
+#endif
+
+#if defined(CONVERT_X86)
+#define UNPACK_SSE2(DEPTH)                                   \
+	if (has_sse2)                                            \
+	{                                                        \
+		j = unpack##DEPTH##_sse2(pixels, output_row, width); \
+	}
+#else
+#define UNPACK_SSE2(DEPTH)
+#endif
+
+// Sub-byte gray samples get one byte each, their values stay as they are since maxval follows the bit depth
+#define DEFINE_CONVERT_UNPACK(DEPTH)                                                                         \
+	static unsigned char *convert_unpack##DEPTH(unsigned char *pixels, unsigned char *output_row, int width, \
+												const unsigned char *table)                                  \
+	{                                                                                                        \
+		(void)table;                                                                                         \
+		int j = 0;                                                                                           \
+		UNPACK_SSE2(DEPTH);                                                                                  \
+		for (; j < width; j++)                                                                               \
+		{                                                                                                    \
+			output_row[j] = PACKED_SAMPLE(pixels, j, DEPTH);                                                 \
+		}                                                                                                    \
+		return output_row;                                                                                   \
+	}
+
+DEFINE_CONVERT_UNPACK(1)
+DEFINE_CONVERT_UNPACK(2)
+DEFINE_CONVERT_UNPACK(4)
+
+#if defined(CONVERT_X86)
+// pshufb masks that keep the color samples of 16 bytes of pixels, the number of bytes kept is in the strip_kept table
+static const unsigned char strip_gray8[16] = { 0, 2, 4, 6, 8, 10, 12, 14, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 };
+static const unsigned char strip_gray16[16] = { 0, 1, 4, 5, 8, 9, 12, 13, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 };
+static const unsigned char strip_rgb8[16] = { 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 0x80, 0x80, 0x80, 0x80 };
+static const unsigned char strip_rgb16[16] = { 0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13, 0x80, 0x80, 0x80, 0x80 };
+
+// Returns the number of scanline bytes done, always whole pixels since every pixel size divides 16
+__attribute__((target("ssse3"))) static size_t strip_alpha_ssse3(const unsigned char *pixels, unsigned char *output, size_t length,
+																 const unsigned char *shuffle, int kept)
+{
+	const __m128i mask = _mm_loadu_si128((const __m128i *)shuffle);
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16, output += kept)
+	{
+		__m128i color = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(pixels + i)), mask);
+		_mm_storel_epi64((__m128i *)output, color);
+		if (kept == 12)
+		{
+			uint32_t rest = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(color, 8));
+			memcpy(output + 8, &rest, 4);
+		}
+	}
+	return i;
+}
+
+#define STRIP_ALPHA_SSSE3(SHUFFLE, KEPT)                                                  \
+	if (has_ssse3)                                                                        \
+	{                                                                                     \
+		done = strip_alpha_ssse3(pixels, output_row, length, SHUFFLE, KEPT) / PIXEL_SIZE; \
+	}
+#else
+#define STRIP_ALPHA_SSSE3(SHUFFLE, KEPT)
+#endif
+
+// Drops the last sample of every pixel for gray+alpha and RGBA written as P5 or P6
+#define DEFINE_CONVERT_STRIP_ALPHA(NAME, CHANNELS, SAMPLE_SIZE)                                                   \
+	static unsigned char *convert_strip_alpha_##NAME(unsigned char *pixels, unsigned char *output_row, int width, \
+													 const unsigned char *table)                                  \
+	{                                                                                                             \
+		enum                                                                                                      \
+		{                                                                                                         \
+			PIXEL_SIZE = CHANNELS * SAMPLE_SIZE,                                                                  \
+			KEPT = (CHANNELS - 1) * SAMPLE_SIZE                                                                   \
+		};                                                                                                        \
+		(void)table;                                                                                              \
+		size_t length = (size_t)width * PIXEL_SIZE, done = 0;                                                     \
+		(void)length;                                                                                             \
+		STRIP_ALPHA_SSSE3(strip_##NAME, KEPT * 16 / PIXEL_SIZE);                                                  \
+		for (size_t j = done; j < (size_t)width; j++)                                                             \
+		{                                                                                                         \
+			memcpy(output_row + j * KEPT, pixels + j * PIXEL_SIZE, KEPT);                                         \
+		}                                                                                                         \
+		return output_row;                                                                                        \
+	}
+
+DEFINE_CONVERT_STRIP_ALPHA(gray8, 2, 1)
+DEFINE_CONVERT_STRIP_ALPHA(gray16, 2, 2)
+DEFINE_CONVERT_STRIP_ALPHA(rgb8, 4, 1)
+DEFINE_CONVERT_STRIP_ALPHA(rgb16, 4, 2)
+
+#if defined(CONVERT_X86)
+// Returns the number of samples done, 16 bit samples are swapped from big-endian before they are widened
+__attribute__((target("sse2"))) static size_t accumulate_sse2(uint32_t *sums, const unsigned char *samples, size_t count, int sample_size)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i low, high;
+		if (sample_size == 1)
+		{
+			__m128i bytes = _mm_loadu_si128((const __m128i *)(samples + i));
+			low = _mm_unpacklo_epi8(bytes, zero);
+			high = _mm_unpackhi_epi8(bytes, zero);
+		}
+		else
+		{
+			low = _mm_loadu_si128((const __m128i *)(samples + 2 * i));
+			high = _mm_loadu_si128((const __m128i *)(samples + 2 * i + 16));
+			low = _mm_or_si128(_mm_slli_epi16(low, 8), _mm_srli_epi16(low, 8));
+			high = _mm_or_si128(_mm_slli_epi16(high, 8), _mm_srli_epi16(high, 8));
+		}
+		__m128i *sum = (__m128i *)(sums + i);
+		_mm_storeu_si128(sum, _mm_add_epi32(_mm_loadu_si128(sum), _mm_unpacklo_epi16(low, zero)));
+		_mm_storeu_si128(sum + 1, _mm_add_epi32(_mm_loadu_si128(sum + 1), _mm_unpackhi_epi16(low, zero)));
+		_mm_storeu_si128(sum + 2, _mm_add_epi32(_mm_loadu_si128(sum + 2), _mm_unpacklo_epi16(high, zero)));
+		_mm_storeu_si128(sum + 3, _mm_add_epi32(_mm_loadu_si128(sum + 3), _mm_unpackhi_epi16(high, zero)));
+	}
+	return i;
+}
+#endif
+
+void convert_accumulate(uint32_t *sums, const unsigned char *samples, size_t count, int sample_size)
+{
+	size_t i = 0;
+#if defined(CONVERT_X86)
+	if (has_sse2)
+	{
+		i = accumulate_sse2(sums, samples, count, sample_size);
+	}
+#endif
+	if (sample_size == 1)
+	{
+		for (; i < count; i++)
+		{
+			sums[i] += samples[i];
+		}
+	}
+	else
+	{
+		for (; i < count; i++)
+		{
+			sums[i] += (uint32_t)samples[2 * i] << 8 | samples[2 * i + 1];
+		}
+	}
+}
+
+void convert_init(void)
+{
+#if defined(CONVERT_X86)
+	unsigned int features = cpu_features();
+	has_sse2 = (features & CPU_SSE2) != 0;
+	has_ssse3 = (features & CPU_SSSE3) != 0;
+	has_avx2 = (features & CPU_AVX2) != 0;
+#endif
+}
+
+convert_function convert_select(unsigned char color_type, unsigned char bit_depth, int output_channels)
+{
+	static const convert_function palette[2][9] = {
+		{ NULL, convert_palette1_1, convert_palette1_2, NULL, convert_palette1_4, NULL, NULL, NULL, convert_palette1_8 },
+		{ NULL, convert_palette3_1, convert_palette3_2, NULL, convert_palette3_4, NULL, NULL, NULL, convert_palette3_8 },
+	};
+
+	switch (color_type)
+	{
+	case 0x00:
+		return bit_depth == 1 ? convert_unpack1 : bit_depth == 2 ? convert_unpack2 : bit_depth == 4 ? convert_unpack4 : convert_copy;
+	case 0x03:
+		return palette[output_channels == 3][bit_depth];
+	case 0x04:
+		if (output_channels == 1)
+		{
+			return bit_depth == 16 ? convert_strip_alpha_gray16 : convert_strip_alpha_gray8;
+		}
+		return convert_copy;
+	case 0x06:
+		if (output_channels == 3)
+		{
+			return bit_depth == 16 ? convert_strip_alpha_rgb16 : convert_strip_alpha_rgb8;
+		}
+		return convert_copy;
+	default:
+		return convert_copy;
+	}
+}
+
+#define UNFILTER_CONVERT_FUNCTIONS(CHANNELS, DEPTH)                                                                      \
+	{                                                                                                                    \
+		unfilter_convert_none##CHANNELS##_##DEPTH, unfilter_convert_sub##CHANNELS##_##DEPTH,                             \
+			unfilter_convert_up##CHANNELS##_##DEPTH, unfilter_convert_average##CHANNELS##_##DEPTH,                       \
+			unfilter_convert_paeth##CHANNELS##_##DEPTH                                                                   \
+	}
+
+int convert_select_fused(unfilter_convert_function functions[5], unsigned char color_type, unsigned char bit_depth, int output_channels)
+{
+	static const unfilter_convert_function palette[2][9][5] = {
+		{ [1] = UNFILTER_CONVERT_FUNCTIONS(1, 1), [2] = UNFILTER_CONVERT_FUNCTIONS(1, 2), [4] = UNFILTER_CONVERT_FUNCTIONS(1, 4),
+		  [8] = UNFILTER_CONVERT_FUNCTIONS(1, 8) },
+		{ [1] = UNFILTER_CONVERT_FUNCTIONS(3, 1), [2] = UNFILTER_CONVERT_FUNCTIONS(3, 2), [4] = UNFILTER_CONVERT_FUNCTIONS(3, 4),
+		  [8] = UNFILTER_CONVERT_FUNCTIONS(3, 8) },
+	};
+
+	if (color_type != 0x03)
+	{
+		return 0;
+	}
+	memcpy(functions, palette[output_channels == 3][bit_depth], 5 * sizeof(unfilter_convert_function));
+	return 1;
+}
+
+int convert_is_copy(convert_function convert)
+{
+	return convert == convert_copy;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Palette images are expanded a whole byte of indices at a time through a table that convert_build_table makes from
+// the palette of every image
+#define CONVERT_TABLE_SIZE (256 * 32)
+
+// Turns one unfiltered scanline (without the filter type byte) into PNM samples,
+// returns either pixels itself or output_row when the samples had to be rewritten. table is only used for palette images
+typedef unsigned char *(*convert_function)(unsigned char *pixels, unsigned char *output_row, int width, const unsigned char *table);
+
+// Reverses the filter of a palette scanline in place, row and previous_row past the filter type byte, and expands it
+// into output_row in the same pass while every byte is still in a register
+typedef void (*unfilter_convert_function)(unsigned char *row, const unsigned char *previous_row, unsigned char *output_row, int width,
+										  const unsigned char *table);
+
+// Detects the available instruction sets, must be called once before convert_select
+void convert_init(void);
+
+// output_channels is the number of samples per written pixel: 1 for a gray palette or gray+alpha with the alpha stripped,
+// 3 for RGB with the alpha stripped, otherwise the channels of the color type
+convert_function convert_select(unsigned char color_type, unsigned char bit_depth, int output_channels);
+
+// palette holds 256 RGB entries, the ones the PLTE chunk leaves out are zero
+void convert_build_table(unsigned char *table, const unsigned char *palette, unsigned char bit_depth, int output_channels);
+
+// Fills in one function per filter type for palette images and returns 1, returns 0 for every other color type
+int convert_select_fused(unfilter_convert_function functions[5], unsigned char color_type, unsigned char bit_depth, int output_channels);
+
+// Nonzero for the conversion that returns the scanline as it is, its rows can be written straight from where they were unfiltered
+int convert_is_copy(convert_function convert);
+
+// Adds count PNM samples of sample_size bytes to sums, --scale builds the boxes it averages out of these
+void convert_accumulate(uint32_t *sums, const unsigned char *samples, size_t count, int sample_size);
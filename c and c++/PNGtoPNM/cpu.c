@@ -0,0 +1,26 @@
+#include "cpu.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_X86
+#endif
+
+static unsigned int allowed = ~0u;
+
+unsigned int cpu_features(void)
+{
+	unsigned int features = 0;
+#if defined(CPU_X86)
+	__builtin_cpu_init();
+	features |= __builtin_cpu_supports("sse2") ? CPU_SSE2 : 0;
+	features |= __builtin_cpu_supports("ssse3") ? CPU_SSSE3 : 0;
+	features |= __builtin_cpu_supports("sse4.1") ? CPU_SSE41 : 0;
+	features |= __builtin_cpu_supports("pclmul") ? CPU_PCLMUL : 0;
+	features |= __builtin_cpu_supports("avx2") ? CPU_AVX2 : 0;
+#endif
+	return features & allowed;
+}
+
+void cpu_restrict(unsigned int mask)
+{
+	allowed = mask;
+}
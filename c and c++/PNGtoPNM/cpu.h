@@ -0,0 +1,15 @@
+#pragma once
+
+// Instruction sets the kernels of unfilter, convert, filter and crc32 are picked by
+#define CPU_SSE2 0x01u
+#define CPU_SSSE3 0x02u
+#define CPU_SSE41 0x04u
+#define CPU_PCLMUL 0x08u
+#define CPU_AVX2 0x10u
+
+// The CPU_ bits of the processor the program runs on, 0 off x86. The *_init functions of the modules with kernels call it
+unsigned int cpu_features(void);
+
+// Hides every feature outside mask from cpu_features, so that tests can run the narrower kernels on a wider processor.
+// Takes effect at the next *_init of a module
+void cpu_restrict(unsigned int mask);
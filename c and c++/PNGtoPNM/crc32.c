@@ -0,0 +1,137 @@
+#include "crc32.h"
+
+#include "cpu.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32_X86
+#include <immintrin.h>
+#endif
+
+// slice_tables[k][i] is the crc of byte i followed by k zero bytes
+static uint32_t slice_tables[8][256];
+
+static inline uint32_t load_le32(const unsigned char *data)
+{
+	return data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+// Slice-by-8, works on the inverted crc
+static uint32_t crc32_slice8(uint32_t crc, const unsigned char *data, size_t length)
+{
+	for (; length >= 8; data += 8, length -= 8)
+	{
+		uint32_t low = load_le32(data) ^ crc, high = load_le32(data + 4);
+		crc = slice_tables[7][low & 0xFF] ^ slice_tables[6][(low >> 8) & 0xFF] ^ slice_tables[5][(low >> 16) & 0xFF] ^
+			  slice_tables[4][low >> 24] ^ slice_tables[3][high & 0xFF] ^ slice_tables[2][(high >> 8) & 0xFF] ^
+			  slice_tables[1][(high >> 16) & 0xFF] ^ slice_tables[0][high >> 24];
+	}
+	for (; length > 0; data++, length--)
+	{
+		crc = slice_tables[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(CRC32_X86)
+static int has_pclmul;
+
+// Carry-less multiplication folding from Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ", works on
+// the inverted crc, length has to be a multiple of 16 and at least 64
+__attribute__((target("pclmul,sse4.1"))) static uint32_t crc32_pclmul(uint32_t crc, const unsigned char *data, size_t length)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01C6E41596, 0x0154442BD4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00CCAA009E, 0x01751997D0);
+	const __m128i k5 = _mm_set_epi64x(0, 0x0163CD6124);
+	const __m128i polynomial = _mm_set_epi64x(0x01F7011641, 0x01DB710641);
+	const __m128i low_mask = _mm_setr_epi32(~0, 0, ~0, 0);
+
+	__m128i x1 = _mm_loadu_si128((const __m128i *)data);
+	__m128i x2 = _mm_loadu_si128((const __m128i *)(data + 16));
+	__m128i x3 = _mm_loadu_si128((const __m128i *)(data + 32));
+	__m128i x4 = _mm_loadu_si128((const __m128i *)(data + 48));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+	data += 64;
+	length -= 64;
+
+	// four independent 128 bit lanes hide the latency of the multiplications
+	for (; length >= 64; data += 64, length -= 64)
+	{
+		__m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		__m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		__m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		__m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)data));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(data + 16)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(data + 32)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(data + 48)));
+	}
+
+	// fold the four lanes into one, then the remaining 16 byte blocks into it
+	__m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), x5);
+	for (; length >= 16; data += 16, length -= 16)
+	{
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)data));
+	}
+
+	// 128 bits down to 64, then a Barrett reduction down to 32
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, low_mask), k5, 0x00), x2);
+
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, low_mask), polynomial, 0x10);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, low_mask), polynomial, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+void crc32_init(void)
+{
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++)
+		{
+			crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+		}
+		slice_tables[0][i] = crc;
+	}
+	for (int k = 1; k < 8; k++)
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			slice_tables[k][i] = (slice_tables[k - 1][i] >> 8) ^ slice_tables[0][slice_tables[k - 1][i] & 0xFF];
+		}
+	}
+
+#if defined(CRC32_X86)
+	has_pclmul = (cpu_features() & (CPU_PCLMUL | CPU_SSE41)) == (CPU_PCLMUL | CPU_SSE41);
+#endif
+}
+
+uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t length)
+{
+	crc = ~crc;
+#if defined(CRC32_X86)
+	if (has_pclmul && length >= 64)
+	{
+		size_t blocks = length & ~(size_t)15;
+		crc = crc32_pclmul(crc, data, blocks);
+		data += blocks;
+		length -= blocks;
+	}
+#endif
+	return ~crc32_slice8(crc, data, length);
+}
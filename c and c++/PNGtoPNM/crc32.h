@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Builds the tables and detects the available instruction sets, must be called once before crc32_update
+void crc32_init(void);
+
+// Same contract as zlib's crc32: start from 0 and feed the bytes in order, the result is the finished CRC-32
+uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t length);
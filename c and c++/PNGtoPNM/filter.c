@@ -0,0 +1,207 @@
+#include "filter.h"
+
+#include "cpu.h"
+#include "paeth.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FILTER_X86
+#include <immintrin.h>
+#endif
+
+// Filters bytes begin to end of the row and adds their absolute values to costs, the left neighbours of the first pixel are zero
+static void filter_bytes(const unsigned char *row, const unsigned char *upper, size_t begin, size_t end, size_t bpp,
+						 unsigned char *candidates[5], uint64_t costs[5])
+{
+	for (size_t i = begin; i < end; i++)
+	{
+		int x = row[i], b = upper[i];
+		int a = i >= bpp ? row[i - bpp] : 0;
+		int c = i >= bpp ? upper[i - bpp] : 0;
+		unsigned char filtered[5] = { x, x - a, x - b, x - ((a + b) >> 1), x - paeth(a, b, c) };
+		for (int type = 0; type < 5; type++)
+		{
+			candidates[type][i + 1] = filtered[type];
+			costs[type] += filtered[type] < 128 ? filtered[type] : 256 - filtered[type];
+		}
+	}
+}
+
+// The first type of least cost, ties go to the simpler filter
+static int cheapest(unsigned char *candidates[5], const uint64_t costs[5])
+{
+	int best = 0;
+	for (int type = 0; type < 5; type++)
+	{
+		candidates[type][0] = type;
+		if (costs[type] < costs[best])
+		{
+			best = type;
+		}
+	}
+	return best;
+}
+
+static int filter_row_scalar(const unsigned char *row, const unsigned char *upper, size_t length, int bytes_per_pixel,
+							 unsigned char *candidates[5])
+{
+	uint64_t costs[5] = { 0 };
+	filter_bytes(row, upper, 0, length, bytes_per_pixel, candidates, costs);
+	return cheapest(candidates, costs);
+}
+
+#if defined(FILTER_X86)
+
+static int has_sse2, has_avx2;
+
+// Paeth predictor of eight 16 bit lanes: a if it is closest, then b, then c
+__attribute__((target("sse2"))) static inline __m128i paeth_sse2(__m128i a, __m128i b, __m128i c)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i b_c = _mm_sub_epi16(b, c), a_c = _mm_sub_epi16(a, c), a_b_2c = _mm_add_epi16(b_c, a_c);
+	__m128i pa = _mm_max_epi16(b_c, _mm_sub_epi16(zero, b_c));
+	__m128i pb = _mm_max_epi16(a_c, _mm_sub_epi16(zero, a_c));
+	__m128i pc = _mm_max_epi16(a_b_2c, _mm_sub_epi16(zero, a_b_2c));
+	__m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+	__m128i not_b = _mm_cmpgt_epi16(pb, pc);
+	__m128i b_or_c = _mm_or_si128(_mm_andnot_si128(not_b, b), _mm_and_si128(not_b, c));
+	return _mm_or_si128(_mm_andnot_si128(not_a, a), _mm_and_si128(not_a, b_or_c));
+}
+
+// Sum of the absolute values of the signed bytes, in the two 64 bit halves
+__attribute__((target("sse2"))) static inline __m128i cost_sse2(__m128i filtered)
+{
+	__m128i zero = _mm_setzero_si128();
+	return _mm_sad_epu8(_mm_min_epu8(filtered, _mm_sub_epi8(zero, filtered)), zero);
+}
+
+__attribute__((target("sse2"))) static int filter_row_sse2(const unsigned char *row, const unsigned char *upper, size_t length,
+														   int bytes_per_pixel, unsigned char *candidates[5])
+{
+	size_t bpp = bytes_per_pixel;
+	uint64_t costs[5] = { 0 };
+	filter_bytes(row, upper, 0, bpp < length ? bpp : length, bpp, candidates, costs);
+
+	const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+	__m128i sums[5] = { zero, zero, zero, zero, zero };
+	size_t i = bpp;
+	for (; i + 16 <= length; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)(row + i));
+		__m128i a = _mm_loadu_si128((const __m128i *)(row + i - bpp));
+		__m128i b = _mm_loadu_si128((const __m128i *)(upper + i));
+		__m128i c = _mm_loadu_si128((const __m128i *)(upper + i - bpp));
+		// pavgb rounds up, the PNG average rounds down
+		__m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+		__m128i predictor = _mm_packus_epi16(
+			paeth_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero)),
+			paeth_sse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero)));
+		__m128i filtered[5] = { x, _mm_sub_epi8(x, a), _mm_sub_epi8(x, b), _mm_sub_epi8(x, average), _mm_sub_epi8(x, predictor) };
+		for (int type = 0; type < 5; type++)
+		{
+			_mm_storeu_si128((__m128i *)(candidates[type] + i + 1), filtered[type]);
+			sums[type] = _mm_add_epi64(sums[type], cost_sse2(filtered[type]));
+		}
+	}
+	for (int type = 0; type < 5; type++)
+	{
+		uint64_t halves[2];
+		_mm_storeu_si128((__m128i *)halves, sums[type]);
+		costs[type] += halves[0] + halves[1];
+	}
+	filter_bytes(row, upper, i > bpp ? i : bpp, length, bpp, candidates, costs);
+	return cheapest(candidates, costs);
+}
+
+__attribute__((target("avx2"))) static inline __m256i paeth_avx2(__m256i a, __m256i b, __m256i c)
+{
+	__m256i b_c = _mm256_sub_epi16(b, c), a_c = _mm256_sub_epi16(a, c);
+	__m256i pa = _mm256_abs_epi16(b_c), pb = _mm256_abs_epi16(a_c), pc = _mm256_abs_epi16(_mm256_add_epi16(b_c, a_c));
+	__m256i not_a = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb), _mm256_cmpgt_epi16(pa, pc));
+	__m256i b_or_c = _mm256_blendv_epi8(b, c, _mm256_cmpgt_epi16(pb, pc));
+	return _mm256_blendv_epi8(a, b_or_c, not_a);
+}
+
+__attribute__((target("avx2"))) static int filter_row_avx2(const unsigned char *row, const unsigned char *upper, size_t length,
+														   int bytes_per_pixel, unsigned char *candidates[5])
+{
+	size_t bpp = bytes_per_pixel;
+	uint64_t costs[5] = { 0 };
+	filter_bytes(row, upper, 0, bpp < length ? bpp : length, bpp, candidates, costs);
+
+	const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi8(1);
+	__m256i sums[5] = { zero, zero, zero, zero, zero };
+	size_t i = bpp;
+	for (; i + 32 <= length; i += 32)
+	{
+		__m256i x = _mm256_loadu_si256((const __m256i *)(row + i));
+		__m256i a = _mm256_loadu_si256((const __m256i *)(row + i - bpp));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(upper + i));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(upper + i - bpp));
+		__m256i average = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one));
+		// the two halves widened separately, packus then works per 128 bit lane and the permute puts the quadwords back in order
+		__m256i low = paeth_avx2(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(a)), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(b)),
+								 _mm256_cvtepu8_epi16(_mm256_castsi256_si128(c)));
+		__m256i high = paeth_avx2(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(a, 1)), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(b, 1)),
+								  _mm256_cvtepu8_epi16(_mm256_extracti128_si256(c, 1)));
+		__m256i predictor = _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high), 0xD8);
+		__m256i filtered[5] = { x, _mm256_sub_epi8(x, a), _mm256_sub_epi8(x, b), _mm256_sub_epi8(x, average),
+								_mm256_sub_epi8(x, predictor) };
+		for (int type = 0; type < 5; type++)
+		{
+			_mm256_storeu_si256((__m256i *)(candidates[type] + i + 1), filtered[type]);
+			__m256i absolute = _mm256_min_epu8(filtered[type], _mm256_sub_epi8(zero, filtered[type]));
+			sums[type] = _mm256_add_epi64(sums[type], _mm256_sad_epu8(absolute, zero));
+		}
+	}
+	for (int type = 0; type < 5; type++)
+	{
+		uint64_t lanes[4];
+		_mm256_storeu_si256((__m256i *)lanes, sums[type]);
+		costs[type] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+	filter_bytes(row, upper, i > bpp ? i : bpp, length, bpp, candidates, costs);
+	return cheapest(candidates, costs);
+}
+
+#endif
+
+void filter_init(void)
+{
+#if defined(FILTER_X86)
+	unsigned int features = cpu_features();
+	has_sse2 = (features & CPU_SSE2) != 0;
+	has_avx2 = (features & CPU_AVX2) != 0;
+#endif
+}
+
+void filter_apply(unsigned char *out, const unsigned char *row, const unsigned char *upper, size_t length, int bytes_per_pixel, int type)
+{
+	out[0] = (unsigned char)type;
+	for (size_t i = 0; i < length; i++)
+	{
+		size_t bpp = bytes_per_pixel;
+		int a = i >= bpp ? row[i - bpp] : 0;
+		int b = upper[i];
+		int c = i >= bpp ? upper[i - bpp] : 0;
+		int predictor = type == 1 ? a : type == 2 ? b : type == 3 ? (a + b) >> 1 : type == 4 ? paeth(a, b, c) : 0;
+		out[i + 1] = (unsigned char)(row[i] - predictor);
+	}
+}
+
+filter_function filter_select(void)
+{
+#if defined(FILTER_X86)
+	if (has_avx2)
+	{
+		return filter_row_avx2;
+	}
+	if (has_sse2)
+	{
+		return filter_row_sse2;
+	}
+#endif
+	return filter_row_scalar;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+
+// Filters one scanline with every PNG filter type for the encoder: candidates[type] receives the filter type byte followed by
+// the filtered row. Returns the type whose bytes, taken as signed, have the least sum of absolute values, the heuristic the
+// PNG specification suggests. previous_row is all zero for the first row
+typedef int (*filter_function)(const unsigned char *row, const unsigned char *previous_row, size_t length, int bytes_per_pixel,
+							   unsigned char *candidates[5]);
+
+// Detects the available instruction sets, must be called once before filter_select
+void filter_init(void);
+
+filter_function filter_select(void);
+
+// Filters a row with the given type into out, the type byte first; for test images that are to use every filter type
+void filter_apply(unsigned char *out, const unsigned char *row, const unsigned char *upper, size_t length, int bytes_per_pixel, int type);
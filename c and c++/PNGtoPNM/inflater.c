@@ -0,0 +1,1107 @@
+#include "inflater.h"
+
+#include "return_codes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(ZLIB) && !defined(LIBDEFLATE) && !defined(ISAL)
+#error("wrong or not supported compression library")
+#endif
+#if defined(ZLIB)
+#include <zlib.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX
+#include <pthread.h>
+#endif
+#if defined(LIBDEFLATE)
+#include <libdeflate.h>
+#endif
+#if defined(ISAL)
+#include <include/igzip_lib.h>
+#endif
+
+// Auto mode inflates an image in one go when its data is already in memory and inflating dominates. libdeflate is 30-45%
+// faster than zlib on data that expands up to 16 times, about even at 16-64 times and 5-10% slower beyond that, where
+// the streaming backends win by unfiltering rows while they are still in cache. The output buffer bounds memory use
+#define AUTO_ONE_SHOT_RATIO 32
+#define AUTO_ONE_SHOT_OUTPUT (256 * 1024 * 1024)
+
+struct inflate_ops
+{
+	int (*reset)(struct inflater *inflater);
+	int (*input)(struct inflater *inflater, const unsigned char *data, size_t length, int persistent);
+	int (*run)(struct inflater *inflater, unsigned char *output, size_t length, size_t *produced);
+	int (*finish)(struct inflater *inflater);
+};
+
+struct inflater
+{
+	const struct inflate_ops *ops;	  // of the current image
+	int finished;
+	size_t output_size;
+	unsigned int allocations;
+#if defined(ZLIB)
+	z_stream stream;
+	int stream_ready;
+	struct parallel *parallel;	  // kept from one image to the next once an image had restart points
+#endif
+#if defined(LIBDEFLATE)
+	// libdeflate has no incremental interface, so the compressed stream is collected and inflated at once
+	struct libdeflate_decompressor *decompressor;
+	const unsigned char *borrowed;
+	size_t borrowed_length;
+	unsigned char *input;
+	size_t input_length, input_capacity;
+	unsigned char *output;
+	size_t output_capacity, output_length, output_position;
+#endif
+#if defined(ISAL)
+	struct inflate_state state;
+#endif
+};
+
+#if defined(ZLIB) || defined(ISAL)
+// Streaming backends have inflated everything by the time the input ends
+static int stream_finish(struct inflater *inflater)
+{
+	(void)inflater;
+	return SUCCESS;
+}
+#endif
+
+#if defined(ZLIB)
+static int zlib_reset(struct inflater *inflater)
+{
+	if (inflater->stream_ready)
+	{
+		inflateReset(&inflater->stream);
+		return SUCCESS;
+	}
+	if (inflateInit(&inflater->stream) != Z_OK)
+	{
+		fprintf(stderr, "failed to allocate decompressor\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	inflater->stream_ready = 1;
+	return SUCCESS;
+}
+
+static int zlib_input(struct inflater *inflater, const unsigned char *data, size_t length, int persistent)
+{
+	(void)persistent;
+	inflater->stream.next_in = (unsigned char *)data;
+	inflater->stream.avail_in = length;
+	return SUCCESS;
+}
+
+static int zlib_run(struct inflater *inflater, unsigned char *output, size_t length, size_t *produced)
+{
+	if (inflater->finished)
+	{
+		return SUCCESS;
+	}
+	inflater->stream.next_out = output;
+	inflater->stream.avail_out = length;
+	int ret = inflate(&inflater->stream, Z_NO_FLUSH);
+	if (ret == Z_STREAM_END)
+	{
+		inflater->finished = 1;
+	}
+	else if (ret != Z_OK && ret != Z_BUF_ERROR)
+	{
+		fprintf(stderr, "failed to decompress data\n");
+		return ERROR_DATA_INVALID;
+	}
+	*produced = length - inflater->stream.avail_out;
+	return SUCCESS;
+}
+
+static const struct inflate_ops zlib_ops = { zlib_reset, zlib_input, zlib_run, stream_finish };
+
+// A stream with restart points is cut into segments that start at them. Each segment is inflated on its own as raw deflate
+// data into a buffer of its own, and inflater_run copies the buffers out in order. A segment whose stream does not end on a
+// block boundary runs on into the next one, whose own inflate is then ignored; one that cannot be inflated without what
+// came before, because it followed a sync flush rather than a full flush, is inflated again with the last 32 KiB of output.
+// When even that fails the whole stream goes through the streaming inflater, skipping the bytes already handed out
+#define PARALLEL_HISTORY 32768
+#define PARALLEL_WINDOW 2	 // segments per thread that are inflated ahead of the one being handed out
+
+struct inflate_piece
+{
+	const unsigned char *data;
+	size_t length;
+};
+
+struct inflate_segment
+{
+	size_t piece, offset;	 // where its deflate data starts
+	size_t compressed;		 // bytes up to the next restart point
+	unsigned char *output;
+	size_t length, capacity;
+	uLong adler;
+	size_t end;	   // the segment that follows its output, more than one on when restart points turned out not to be
+	int result;
+	int done;
+	int retried;
+};
+
+struct parallel_worker
+{
+	struct parallel *parallel;
+	z_stream stream;
+	int stream_ready;
+#if defined(HAVE_POSIX)
+	pthread_t thread;
+#endif
+};
+
+struct parallel
+{
+	struct inflate_piece *pieces;
+	size_t piece_count, piece_capacity;
+	struct inflate_segment *segments;
+	size_t segment_count, segment_capacity;
+	size_t compressed_size, output_size;
+	int threads;
+	struct parallel_worker *workers;
+	int started;	// worker threads running, the thread calling inflater_run inflates segments as well
+	struct parallel_worker own;
+	size_t next;	   // the segment to be inflated next
+	size_t current;	   // the segment being handed out, no segment is taken more than window segments ahead of it
+	size_t position;   // in the output of the current segment
+	size_t window;
+	int running;	// between inflater_finish and the end of the stream or the next image
+	int stopped;
+	unsigned int consumed;	  // segments handed out
+	size_t handed;			  // bytes handed out
+	int sequential;			  // set once a segment failed and the streaming inflater took over
+	size_t skip;			  // bytes the streaming inflater still drops
+	size_t fed;				  // pieces given to the streaming inflater
+	uLong adler;
+	unsigned char history[PARALLEL_HISTORY];
+	size_t history_length;
+#if defined(HAVE_POSIX)
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+#endif
+};
+
+static void parallel_lock(struct parallel *parallel)
+{
+#if defined(HAVE_POSIX)
+	pthread_mutex_lock(&parallel->lock);
+#else
+	(void)parallel;
+#endif
+}
+
+static void parallel_unlock(struct parallel *parallel)
+{
+#if defined(HAVE_POSIX)
+	pthread_mutex_unlock(&parallel->lock);
+#else
+	(void)parallel;
+#endif
+}
+
+static void parallel_wait(struct parallel *parallel)
+{
+#if defined(HAVE_POSIX)
+	pthread_cond_wait(&parallel->changed, &parallel->lock);
+#else
+	(void)parallel;
+#endif
+}
+
+static void parallel_broadcast(struct parallel *parallel)
+{
+#if defined(HAVE_POSIX)
+	pthread_cond_broadcast(&parallel->changed);
+#else
+	(void)parallel;
+#endif
+}
+
+static uLong adler_of(const unsigned char *data, size_t length)
+{
+	uLong adler = adler32(0, Z_NULL, 0);
+	for (size_t chunk; length > 0; data += chunk, length -= chunk)
+	{
+		chunk = length < (1u << 30) ? length : (1u << 30);
+		adler = adler32(adler, data, (uInt)chunk);
+	}
+	return adler;
+}
+
+static int worker_stream(struct parallel_worker *worker)
+{
+	if (!worker->stream_ready)
+	{
+		if (inflateInit2(&worker->stream, -15) != Z_OK)
+		{
+			return ERROR_OUT_OF_MEMORY;
+		}
+		worker->stream_ready = 1;
+		return SUCCESS;
+	}
+	return inflateReset(&worker->stream) == Z_OK ? SUCCESS : ERROR_UNKNOWN;
+}
+
+// Inflates segment index from its start up to a restart point where the stream is at a block boundary, or to the end of
+// the stream. Quiet, a failure is only an error once inflater_run has retried the segment with the history
+static int inflate_segment(struct parallel_worker *worker, size_t index, const unsigned char *dictionary, size_t dictionary_length)
+{
+	struct parallel *parallel = worker->parallel;
+	struct inflate_segment *segment = &parallel->segments[index];
+	z_stream *stream = &worker->stream;
+	int result = worker_stream(worker);
+	if (result != SUCCESS || (dictionary_length > 0 && inflateSetDictionary(stream, dictionary, (uInt)dictionary_length) != Z_OK))
+	{
+		return result != SUCCESS ? result : ERROR_UNKNOWN;
+	}
+	if (segment->capacity == 0)
+	{
+		// as much as the segment's share of the compressed data promises, grown when it turns out to be more
+		double share = parallel->compressed_size ? (double)segment->compressed / parallel->compressed_size : 1;
+		size_t capacity = (size_t)(share * parallel->output_size) + 65536;
+		segment->capacity = capacity < parallel->output_size ? capacity : parallel->output_size;
+		if ((segment->output = malloc(segment->capacity)) == NULL)
+		{
+			segment->capacity = 0;
+			return ERROR_OUT_OF_MEMORY;
+		}
+	}
+
+	segment->length = 0;
+	segment->end = index + 1;
+	size_t piece = segment->piece, offset = segment->offset;
+	int status = Z_OK;
+	for (;;)
+	{
+		size_t limit = segment->end < parallel->segment_count ? parallel->segments[segment->end].piece : parallel->piece_count;
+		for (; piece < limit && status != Z_STREAM_END; piece++, offset = 0)
+		{
+			stream->next_in = (unsigned char *)parallel->pieces[piece].data + offset;
+			stream->avail_in = (uInt)(parallel->pieces[piece].length - offset);
+			do
+			{
+				if (segment->length == segment->capacity && segment->capacity < parallel->output_size)
+				{
+					size_t capacity = segment->capacity * 2 < parallel->output_size ? segment->capacity * 2 : parallel->output_size;
+					unsigned char *temp = realloc(segment->output, capacity);
+					if (temp == NULL)
+					{
+						// the sequential path needs no segment buffers
+						return ERROR_OUT_OF_MEMORY;
+					}
+					segment->output = temp;
+					segment->capacity = capacity;
+				}
+				// with the whole image inflated, empty blocks and the end of the stream may still follow
+				unsigned char scratch[64];
+				size_t room = segment->capacity - segment->length;
+				stream->next_out = room > 0 ? segment->output + segment->length : scratch;
+				stream->avail_out = room == 0 ? (uInt)sizeof(scratch) : room < UINT_MAX ? (uInt)room : UINT_MAX;
+				uInt avail_out = stream->avail_out;
+				status = inflate(stream, Z_NO_FLUSH);
+				if (room == 0 && stream->avail_out != avail_out)
+				{
+					return ERROR_DATA_INVALID;
+				}
+				segment->length += room > 0 ? avail_out - stream->avail_out : 0;
+				if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+				{
+					return ERROR_DATA_INVALID;
+				}
+			} while (status != Z_STREAM_END && (stream->avail_in > 0 || stream->avail_out == 0));
+		}
+
+		if (status == Z_STREAM_END)
+		{
+			// only the adler-32 of the zlib trailer may follow
+			size_t rest = stream->avail_in;
+			for (; piece < parallel->piece_count; piece++)
+			{
+				rest += parallel->pieces[piece].length;
+			}
+			if (rest != 4)
+			{
+				return ERROR_DATA_INVALID;
+			}
+			segment->end = parallel->segment_count;
+			break;
+		}
+		if (segment->end == parallel->segment_count)
+		{
+			return ERROR_DATA_INVALID;
+		}
+		// between two blocks with no bits left over and not in the last block: the next segment starts clean
+		if (stream->data_type == 128)
+		{
+			break;
+		}
+		segment->end++;
+	}
+	segment->adler = adler_of(segment->output, segment->length);
+	return SUCCESS;
+}
+
+// Called with the lock held
+static int parallel_can_take(const struct parallel *parallel)
+{
+	return !parallel->stopped && parallel->next < parallel->segment_count && parallel->next < parallel->current + parallel->window;
+}
+
+static void parallel_done(struct parallel *parallel, size_t index, int result)
+{
+	parallel_lock(parallel);
+	parallel->segments[index].result = result;
+	parallel->segments[index].done = 1;
+	parallel_broadcast(parallel);
+	parallel_unlock(parallel);
+}
+
+static void *parallel_worker_run(void *argument)
+{
+	struct parallel_worker *worker = argument;
+	struct parallel *parallel = worker->parallel;
+	for (;;)
+	{
+		parallel_lock(parallel);
+		while (!parallel->stopped && parallel->next < parallel->segment_count && !parallel_can_take(parallel))
+		{
+			parallel_wait(parallel);
+		}
+		int taken = parallel_can_take(parallel);
+		size_t index = parallel->next;
+		parallel->next += taken;
+		parallel_unlock(parallel);
+		if (!taken)
+		{
+			return NULL;
+		}
+		parallel_done(parallel, index, inflate_segment(worker, index, NULL, 0));
+	}
+}
+
+// Waits for a segment and inflates later ones meanwhile, without threads it inflates the segment itself
+static int parallel_wait_for(struct parallel *parallel, size_t index)
+{
+	parallel_lock(parallel);
+	while (!parallel->segments[index].done)
+	{
+		if (parallel_can_take(parallel))
+		{
+			size_t taken = parallel->next++;
+			parallel_unlock(parallel);
+			int result = inflate_segment(&parallel->own, taken, NULL, 0);
+			parallel_done(parallel, taken, result);
+			parallel_lock(parallel);
+		}
+		else
+		{
+			parallel_wait(parallel);
+		}
+	}
+	parallel_unlock(parallel);
+	return parallel->segments[index].result;
+}
+
+// Stops and joins the workers and frees the output of every segment
+static void parallel_stop(struct parallel *parallel)
+{
+	if (!parallel->running)
+	{
+		return;
+	}
+	parallel_lock(parallel);
+	parallel->stopped = 1;
+	parallel_broadcast(parallel);
+	parallel_unlock(parallel);
+#if defined(HAVE_POSIX)
+	for (int i = 0; i < parallel->started; i++)
+	{
+		pthread_join(parallel->workers[i].thread, NULL);
+	}
+#endif
+	for (int i = 0; i < parallel->threads - 1; i++)
+	{
+		if (parallel->workers[i].stream_ready)
+		{
+			inflateEnd(&parallel->workers[i].stream);
+		}
+	}
+	free(parallel->workers);
+	parallel->workers = NULL;
+	parallel->started = 0;
+	for (size_t i = 0; i < parallel->segment_count; i++)
+	{
+		free(parallel->segments[i].output);
+	}
+	parallel->running = 0;
+}
+
+static void parallel_destroy(struct parallel *parallel)
+{
+	if (parallel == NULL)
+	{
+		return;
+	}
+	parallel_stop(parallel);
+	if (parallel->own.stream_ready)
+	{
+		inflateEnd(&parallel->own.stream);
+	}
+#if defined(HAVE_POSIX)
+	pthread_mutex_destroy(&parallel->lock);
+	pthread_cond_destroy(&parallel->changed);
+#endif
+	free(parallel->pieces);
+	free(parallel->segments);
+	free(parallel);
+}
+
+static int parallel_reset(struct inflater *inflater)
+{
+	struct parallel *parallel = inflater->parallel;
+	parallel_stop(parallel);
+	parallel->piece_count = 0;
+	parallel->segment_count = 0;
+	parallel->compressed_size = 0;
+	parallel->output_size = inflater->output_size;
+	parallel->consumed = 0;
+	parallel->handed = 0;
+	parallel->sequential = 0;
+	return SUCCESS;
+}
+
+static int parallel_add(struct parallel *parallel, size_t piece, size_t offset)
+{
+	if (parallel->segment_count == parallel->segment_capacity)
+	{
+		size_t capacity = parallel->segment_capacity ? parallel->segment_capacity * 2 : 16;
+		struct inflate_segment *temp = realloc(parallel->segments, capacity * sizeof(struct inflate_segment));
+		if (temp == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			return ERROR_OUT_OF_MEMORY;
+		}
+		parallel->segments = temp;
+		parallel->segment_capacity = capacity;
+	}
+	struct inflate_segment *segment = &parallel->segments[parallel->segment_count++];
+	memset(segment, 0, sizeof(*segment));
+	segment->piece = piece;
+	segment->offset = offset;
+	return SUCCESS;
+}
+
+// Every piece has to stay valid until the end of the image; a restart point is recognized as the piece is added
+static int parallel_input(struct inflater *inflater, const unsigned char *data, size_t length, int persistent)
+{
+	struct parallel *parallel = inflater->parallel;
+	(void)persistent;
+	if (parallel->piece_count == parallel->piece_capacity)
+	{
+		size_t capacity = parallel->piece_capacity ? parallel->piece_capacity * 2 : 64;
+		struct inflate_piece *temp = realloc(parallel->pieces, capacity * sizeof(struct inflate_piece));
+		if (temp == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			return ERROR_OUT_OF_MEMORY;
+		}
+		parallel->pieces = temp;
+		parallel->piece_capacity = capacity;
+	}
+	size_t count = parallel->piece_count;
+	if (count > 0 && inflater_restart_point(parallel->pieces[count - 1].data, parallel->pieces[count - 1].length))
+	{
+		int result = parallel_add(parallel, count, 0);
+		if (result != SUCCESS)
+		{
+			return result;
+		}
+	}
+	parallel->pieces[count].data = data;
+	parallel->pieces[count].length = length;
+	parallel->piece_count++;
+	parallel->compressed_size += length;
+	return SUCCESS;
+}
+
+// Inflates the pieces in order with the streaming inflater, the first skip bytes of output are dropped
+static int parallel_sequential(struct inflater *inflater, unsigned char *output, size_t length, size_t *produced)
+{
+	struct parallel *parallel = inflater->parallel;
+	z_stream *stream = &inflater->stream;
+	unsigned char scratch[4096];
+	while (!inflater->finished && length > 0)
+	{
+		if (stream->avail_in == 0)
+		{
+			if (parallel->fed == parallel->piece_count)
+			{
+				break;
+			}
+			stream->next_in = (unsigned char *)parallel->pieces[parallel->fed].data;
+			stream->avail_in = (uInt)parallel->pieces[parallel->fed].length;
+			parallel->fed++;
+		}
+		size_t room = parallel->skip == 0 ? length : parallel->skip < sizeof(scratch) ? parallel->skip : sizeof(scratch);
+		stream->next_out = parallel->skip == 0 ? output : scratch;
+		stream->avail_out = room < UINT_MAX ? (uInt)room : UINT_MAX;
+		uInt avail_out = stream->avail_out;
+		int ret = inflate(stream, Z_NO_FLUSH);
+		size_t bytes = avail_out - stream->avail_out;
+		if (parallel->skip > 0)
+		{
+			parallel->skip -= bytes;
+		}
+		else
+		{
+			output += bytes;
+			length -= bytes;
+			*produced += bytes;
+		}
+		if (ret == Z_STREAM_END)
+		{
+			inflater->finished = 1;
+		}
+		else if (ret != Z_OK && ret != Z_BUF_ERROR)
+		{
+			fprintf(stderr, "failed to decompress data\n");
+			return ERROR_DATA_INVALID;
+		}
+	}
+	return SUCCESS;
+}
+
+// Drops the segments and starts the stream over with the streaming inflater
+static int parallel_fall_back(struct inflater *inflater)
+{
+	struct parallel *parallel = inflater->parallel;
+	parallel_stop(parallel);
+	int result = zlib_reset(inflater);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	inflater->stream.avail_in = 0;
+	parallel->sequential = 1;
+	parallel->skip = parallel->handed;
+	parallel->fed = 0;
+	return SUCCESS;
+}
+
+// Nothing comes out before all the pieces are in
+static int parallel_run(struct inflater *inflater, unsigned char *output, size_t length, size_t *produced)
+{
+	struct parallel *parallel = inflater->parallel;
+	if (parallel->sequential)
+	{
+		return parallel_sequential(inflater, output, length, produced);
+	}
+	if (!parallel->running)
+	{
+		return SUCCESS;
+	}
+	while (length > 0 && parallel->current < parallel->segment_count)
+	{
+		size_t index = parallel->current;
+		struct inflate_segment *segment = &parallel->segments[index];
+		int result = parallel_wait_for(parallel, index);
+		if (result != SUCCESS && !segment->retried)
+		{
+			segment->retried = 1;
+			segment->result = result = inflate_segment(&parallel->own, index, parallel->history, parallel->history_length);
+		}
+		if (result != SUCCESS)
+		{
+			if ((result = parallel_fall_back(inflater)) != SUCCESS)
+			{
+				return result;
+			}
+			return parallel_sequential(inflater, output, length, produced);
+		}
+
+		size_t bytes = segment->length - parallel->position < length ? segment->length - parallel->position : length;
+		memcpy(output, segment->output + parallel->position, bytes);
+		output += bytes;
+		length -= bytes;
+		*produced += bytes;
+		parallel->position += bytes;
+		parallel->handed += bytes;
+		if (parallel->position < segment->length)
+		{
+			break;
+		}
+
+		// the last 32 KiB handed out are the dictionary of a segment that has to be inflated again
+		if (segment->length >= PARALLEL_HISTORY)
+		{
+			memcpy(parallel->history, segment->output + segment->length - PARALLEL_HISTORY, PARALLEL_HISTORY);
+			parallel->history_length = PARALLEL_HISTORY;
+		}
+		else
+		{
+			size_t keep = parallel->history_length + segment->length > PARALLEL_HISTORY ? PARALLEL_HISTORY - segment->length
+																						: parallel->history_length;
+			memmove(parallel->history, parallel->history + parallel->history_length - keep, keep);
+			memcpy(parallel->history + keep, segment->output, segment->length);
+			parallel->history_length = keep + segment->length;
+		}
+		parallel->adler = adler32_combine(parallel->adler, segment->adler, (z_off_t)segment->length);
+		parallel->consumed++;
+		parallel->position = 0;
+		free(segment->output);
+		segment->output = NULL;
+		parallel_lock(parallel);
+		parallel->current = segment->end;
+		if (parallel->next < parallel->current)
+		{
+			parallel->next = parallel->current;
+		}
+		parallel_broadcast(parallel);
+		parallel_unlock(parallel);
+	}
+
+	if (parallel->current == parallel->segment_count && !inflater->finished)
+	{
+		// the trailer is the last four bytes, which may be spread over several pieces
+		unsigned char trailer[4];
+		size_t missing = 4;
+		for (size_t piece = parallel->piece_count; missing > 0 && piece-- > 0;)
+		{
+			for (size_t i = parallel->pieces[piece].length; missing > 0 && i-- > 0;)
+			{
+				trailer[--missing] = parallel->pieces[piece].data[i];
+			}
+		}
+		parallel_stop(parallel);
+		if (((uLong)trailer[0] << 24 | (uLong)trailer[1] << 16 | (uLong)trailer[2] << 8 | trailer[3]) != parallel->adler)
+		{
+			fprintf(stderr, "failed to decompress data\n");
+			return ERROR_DATA_INVALID;
+		}
+		inflater->finished = 1;
+	}
+	return SUCCESS;
+}
+
+// Checks the zlib header, cuts the stream at the restart points and starts the workers
+static int parallel_finish(struct inflater *inflater)
+{
+	struct parallel *parallel = inflater->parallel;
+	unsigned char header[2];
+	size_t piece = 0, offset = 0;
+	for (int i = 0; i < 2; i++)
+	{
+		while (piece < parallel->piece_count && offset == parallel->pieces[piece].length)
+		{
+			piece++;
+			offset = 0;
+		}
+		if (piece == parallel->piece_count)
+		{
+			fprintf(stderr, "failed to decompress data\n");
+			return ERROR_DATA_INVALID;
+		}
+		header[i] = parallel->pieces[piece].data[offset++];
+	}
+	if ((header[0] & 0x0F) != 8 || (header[0] >> 4) > 7 || (header[1] & 0x20) || (header[0] << 8 | header[1]) % 31 != 0)
+	{
+		fprintf(stderr, "failed to decompress data\n");
+		return ERROR_DATA_INVALID;
+	}
+
+	// segment 0 starts past the header, the others were added as their pieces came in
+	struct inflate_segment first = { 0 };
+	first.piece = piece;
+	first.offset = offset;
+	int result = parallel_add(parallel, 0, 0);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	memmove(parallel->segments + 1, parallel->segments, (parallel->segment_count - 1) * sizeof(struct inflate_segment));
+	parallel->segments[0] = first;
+	for (size_t i = 0; i < parallel->segment_count; i++)
+	{
+		size_t end = i + 1 < parallel->segment_count ? parallel->segments[i + 1].piece : parallel->piece_count;
+		for (size_t p = parallel->segments[i].piece; p < end; p++)
+		{
+			parallel->segments[i].compressed += parallel->pieces[p].length;
+		}
+		parallel->segments[i].compressed -= parallel->segments[i].offset;
+	}
+
+	parallel->next = parallel->current = parallel->position = 0;
+	parallel->window = PARALLEL_WINDOW * (size_t)parallel->threads;
+	parallel->stopped = 0;
+	parallel->adler = adler32(0, Z_NULL, 0);
+	parallel->history_length = 0;
+	parallel->running = 1;
+	int workers = parallel->threads - 1;
+	if ((size_t)workers > parallel->segment_count - 1)
+	{
+		workers = (int)(parallel->segment_count - 1);
+	}
+	if (workers > 0 && (parallel->workers = calloc(workers, sizeof(struct parallel_worker))) == NULL)
+	{
+		workers = 0;
+	}
+	parallel->threads = workers + 1;
+#if defined(HAVE_POSIX)
+	// a worker that cannot be started only costs parallelism
+	while (parallel->started < workers)
+	{
+		struct parallel_worker *worker = &parallel->workers[parallel->started];
+		worker->parallel = parallel;
+		if (pthread_create(&worker->thread, NULL, parallel_worker_run, worker) != 0)
+		{
+			break;
+		}
+		parallel->started++;
+	}
+#endif
+	return SUCCESS;
+}
+
+static const struct inflate_ops parallel_ops = { parallel_reset, parallel_input, parallel_run, parallel_finish };
+#endif
+
+#if defined(LIBDEFLATE)
+static int libdeflate_reset(struct inflater *inflater)
+{
+	if (inflater->decompressor == NULL && (inflater->decompressor = libdeflate_alloc_decompressor()) == NULL)
+	{
+		fprintf(stderr, "failed to allocate decompressor\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	inflater->borrowed = NULL;
+	inflater->input_length = 0;
+	inflater->output_length = 0;
+	inflater->output_position = 0;
+	return SUCCESS;
+}
+
+static int libdeflate_append(struct inflater *inflater, const unsigned char *data, size_t length)
+{
+	if (inflater->input_length + length > inflater->input_capacity)
+	{
+		size_t capacity = inflater->input_capacity ? inflater->input_capacity : length;
+		while (capacity < inflater->input_length + length)
+		{
+			capacity *= 2;
+		}
+		unsigned char *temp = realloc(inflater->input, capacity);
+		if (temp == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			return ERROR_OUT_OF_MEMORY;
+		}
+		inflater->input = temp;
+		inflater->input_capacity = capacity;
+		inflater->allocations++;
+	}
+	memcpy(inflater->input + inflater->input_length, data, length);
+	inflater->input_length += length;
+	return SUCCESS;
+}
+
+static int libdeflate_input(struct inflater *inflater, const unsigned char *data, size_t length, int persistent)
+{
+	if (persistent && inflater->borrowed == NULL && inflater->input_length == 0)
+	{
+		inflater->borrowed = data;
+		inflater->borrowed_length = length;
+		return SUCCESS;
+	}
+	if (inflater->borrowed != NULL)
+	{
+		int result = libdeflate_append(inflater, inflater->borrowed, inflater->borrowed_length);
+		inflater->borrowed = NULL;
+		if (result != SUCCESS)
+		{
+			return result;
+		}
+	}
+	return libdeflate_append(inflater, data, length);
+}
+
+static int libdeflate_run(struct inflater *inflater, unsigned char *output, size_t length, size_t *produced)
+{
+	if (inflater->finished)
+	{
+		*produced = inflater->output_length - inflater->output_position;
+		if (*produced > length)
+		{
+			*produced = length;
+		}
+		memcpy(output, inflater->output + inflater->output_position, *produced);
+		inflater->output_position += *produced;
+	}
+	return SUCCESS;
+}
+
+static int libdeflate_finish(struct inflater *inflater)
+{
+	if (inflater->output_capacity < inflater->output_size)
+	{
+		free(inflater->output);
+		inflater->output_capacity = 0;
+		if ((inflater->output = malloc(inflater->output_size)) == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			return ERROR_OUT_OF_MEMORY;
+		}
+		inflater->output_capacity = inflater->output_size;
+		inflater->allocations++;
+	}
+	const unsigned char *input = inflater->borrowed != NULL ? inflater->borrowed : inflater->input;
+	size_t input_length = inflater->borrowed != NULL ? inflater->borrowed_length : inflater->input_length;
+	if (libdeflate_zlib_decompress(inflater->decompressor, input, input_length, inflater->output, inflater->output_size,
+								   &inflater->output_length) != LIBDEFLATE_SUCCESS)
+	{
+		fprintf(stderr, "failed to decompress data\n");
+		return ERROR_DATA_INVALID;
+	}
+	inflater->finished = 1;
+	return SUCCESS;
+}
+
+static const struct inflate_ops libdeflate_ops = { libdeflate_reset, libdeflate_input, libdeflate_run, libdeflate_finish };
+#endif
+
+#if defined(ISAL)
+static int isal_reset(struct inflater *inflater)
+{
+	isal_inflate_init(&inflater->state);
+	inflater->state.crc_flag = IGZIP_ZLIB;
+	return SUCCESS;
+}
+
+static int isal_input(struct inflater *inflater, const unsigned char *data, size_t length, int persistent)
+{
+	(void)persistent;
+	inflater->state.next_in = (unsigned char *)data;
+	inflater->state.avail_in = length;
+	return SUCCESS;
+}
+
+static int isal_run(struct inflater *inflater, unsigned char *output, size_t length, size_t *produced)
+{
+	if (inflater->finished)
+	{
+		return SUCCESS;
+	}
+	inflater->state.next_out = output;
+	inflater->state.avail_out = length;
+	if (isal_inflate(&inflater->state) != ISAL_DECOMP_OK)
+	{
+		fprintf(stderr, "failed to decompress data\n");
+		return ERROR_DATA_INVALID;
+	}
+	inflater->finished = inflater->state.block_state == ISAL_BLOCK_FINISH;
+	*produced = length - inflater->state.avail_out;
+	return SUCCESS;
+}
+
+static const struct inflate_ops isal_ops = { isal_reset, isal_input, isal_run, stream_finish };
+#endif
+
+// NULL for a backend this build does not link
+static const struct inflate_ops *backend_ops(enum inflate_backend backend)
+{
+	switch (backend)
+	{
+#if defined(ZLIB)
+	case INFLATE_ZLIB:
+		return &zlib_ops;
+#endif
+#if defined(LIBDEFLATE)
+	case INFLATE_LIBDEFLATE:
+		return &libdeflate_ops;
+#endif
+#if defined(ISAL)
+	case INFLATE_ISAL:
+		return &isal_ops;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+// Every library picks its fastest code for the CPU by itself, so only the sizes matter here
+static enum inflate_backend auto_backend(size_t compressed_size, size_t output_size)
+{
+	if (backend_ops(INFLATE_LIBDEFLATE) != NULL && compressed_size != 0 && output_size / compressed_size <= AUTO_ONE_SHOT_RATIO &&
+		output_size <= AUTO_ONE_SHOT_OUTPUT)
+	{
+		return INFLATE_LIBDEFLATE;
+	}
+	if (backend_ops(INFLATE_ISAL) != NULL)
+	{
+		return INFLATE_ISAL;
+	}
+	if (backend_ops(INFLATE_ZLIB) != NULL)
+	{
+		return INFLATE_ZLIB;
+	}
+	return INFLATE_LIBDEFLATE;
+}
+
+int inflater_create(struct inflater **inflater)
+{
+	if ((*inflater = calloc(1, sizeof(struct inflater))) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	return SUCCESS;
+}
+
+void inflater_destroy(struct inflater *inflater)
+{
+	if (inflater == NULL)
+	{
+		return;
+	}
+#if defined(ZLIB)
+	if (inflater->stream_ready)
+	{
+		inflateEnd(&inflater->stream);
+	}
+	parallel_destroy(inflater->parallel);
+#endif
+#if defined(LIBDEFLATE)
+	libdeflate_free_decompressor(inflater->decompressor);
+	free(inflater->input);
+	free(inflater->output);
+#endif
+	free(inflater);
+}
+
+static const char *backend_names[] = { "auto", "zlib", "libdeflate", "isal" };
+
+int inflater_available(enum inflate_backend backend)
+{
+	return backend == INFLATE_AUTO || backend_ops(backend) != NULL;
+}
+
+int inflater_parse_backend(const char *name, enum inflate_backend *backend)
+{
+	for (int i = 0; i < (int)(sizeof(backend_names) / sizeof(backend_names[0])); i++)
+	{
+		if (strcmp(name, backend_names[i]) == 0)
+		{
+			if (!inflater_available((enum inflate_backend)i))
+			{
+				fprintf(stderr, "%s is not built in\n", name);
+				return ERROR_UNSUPPORTED;
+			}
+			*backend = (enum inflate_backend)i;
+			return SUCCESS;
+		}
+	}
+	fprintf(stderr, "unknown inflate backend %s\n", name);
+	return ERROR_PARAMETER_INVALID;
+}
+
+const char *inflater_backend_name(enum inflate_backend backend)
+{
+	return backend >= INFLATE_AUTO && backend <= INFLATE_ISAL ? backend_names[backend] : "unknown";
+}
+
+int inflater_reset(struct inflater *inflater, enum inflate_backend backend, size_t compressed_size, size_t output_size)
+{
+	if (backend == INFLATE_AUTO)
+	{
+		backend = auto_backend(compressed_size, output_size);
+	}
+	if ((inflater->ops = backend_ops(backend)) == NULL)
+	{
+		fprintf(stderr, "%s is not built in\n", inflater_backend_name(backend));
+		return ERROR_UNSUPPORTED;
+	}
+	inflater->finished = 0;
+	inflater->output_size = output_size;
+	return inflater->ops->reset(inflater);
+}
+
+int inflater_reset_parallel(struct inflater *inflater, size_t output_size, int threads)
+{
+#if defined(ZLIB)
+	if (inflater->parallel == NULL)
+	{
+		if ((inflater->parallel = calloc(1, sizeof(struct parallel))) == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			return ERROR_OUT_OF_MEMORY;
+		}
+		inflater->parallel->own.parallel = inflater->parallel;
+#if defined(HAVE_POSIX)
+		pthread_mutex_init(&inflater->parallel->lock, NULL);
+		pthread_cond_init(&inflater->parallel->changed, NULL);
+#endif
+	}
+	inflater->ops = &parallel_ops;
+	inflater->finished = 0;
+	inflater->output_size = output_size;
+	inflater->parallel->threads = threads < 1 ? 1 : threads;
+	return parallel_reset(inflater);
+#else
+	(void)inflater;
+	(void)output_size;
+	(void)threads;
+	fprintf(stderr, "zlib is not built in\n");
+	return ERROR_UNSUPPORTED;
+#endif
+}
+
+int inflater_restart_point(const unsigned char *data, size_t length)
+{
+	return length >= 4 && data[length - 4] == 0x00 && data[length - 3] == 0x00 && data[length - 2] == 0xFF && data[length - 1] == 0xFF;
+}
+
+unsigned int inflater_segments(const struct inflater *inflater)
+{
+#if defined(ZLIB)
+	return inflater->ops == &parallel_ops ? inflater->parallel->consumed : 0;
+#else
+	(void)inflater;
+	return 0;
+#endif
+}
+
+int inflater_input(struct inflater *inflater, const unsigned char *data, size_t length, int persistent)
+{
+	return inflater->ops->input(inflater, data, length, persistent);
+}
+
+int inflater_run(struct inflater *inflater, unsigned char *output, size_t length, size_t *produced)
+{
+	*produced = 0;
+	return inflater->ops->run(inflater, output, length, produced);
+}
+
+int inflater_finish(struct inflater *inflater)
+{
+	return inflater->ops->finish(inflater);
+}
+
+int inflater_finished(const struct inflater *inflater)
+{
+	return inflater->finished;
+}
+
+void inflater_memory(const struct inflater *inflater, size_t *bytes, unsigned int *allocations)
+{
+	*bytes = 0;
+#if defined(LIBDEFLATE)
+	*bytes = inflater->input_capacity + inflater->output_capacity;
+#endif
+	*allocations = inflater->allocations;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+
+// Streaming zlib decompression through any of the libraries the build links: -DZLIB, -DLIBDEFLATE and -DISAL can be
+// combined, at least one is required. Every function returns one of the return_codes.h values
+
+enum inflate_backend
+{
+	INFLATE_AUTO,	 // picked for every image from its sizes
+	INFLATE_ZLIB,
+	INFLATE_LIBDEFLATE,
+	INFLATE_ISAL
+};
+
+struct inflater;
+
+// Backends are only set up the first time an image uses them
+int inflater_create(struct inflater **inflater);
+
+void inflater_destroy(struct inflater *inflater);
+
+// Nonzero when the build links the backend, INFLATE_AUTO always is
+int inflater_available(enum inflate_backend backend);
+
+// Accepts "auto", "zlib", "libdeflate" and "isal"; ERROR_UNSUPPORTED for a backend this build does not link
+int inflater_parse_backend(const char *name, enum inflate_backend *backend);
+
+const char *inflater_backend_name(enum inflate_backend backend);
+
+// Prepares for the next image. compressed_size is the length of all the IDAT data, 0 when it is not known up front or the
+// rows are wanted while the input still arrives; output_size is the exact decompressed length
+int inflater_reset(struct inflater *inflater, enum inflate_backend backend, size_t compressed_size, size_t output_size);
+
+// Prepares for an image whose zlib stream has restart points: IDAT chunks that end on a full flush, where the deflate data
+// after them does not refer back. The pieces between them are inflated on up to threads threads at once into buffers of
+// their own and come out of inflater_run in order, nothing before inflater_finish. Every input has to be persistent.
+// A restart point that turns out to be a sync flush only costs a sequential retry of the piece after it. Needs zlib
+int inflater_reset_parallel(struct inflater *inflater, size_t output_size, int threads);
+
+// Nonzero when an IDAT chunk ends like a zlib full or sync flush, with the empty stored block 00 00 FF FF
+int inflater_restart_point(const unsigned char *data, size_t length);
+
+// Pieces the last image was inflated in by inflater_reset_parallel, 0 after inflater_reset
+unsigned int inflater_segments(const struct inflater *inflater);
+
+// Persistent data stays valid until inflater_finish, which lets a one-shot backend inflate a single mapped IDAT chunk in place
+int inflater_input(struct inflater *inflater, const unsigned char *data, size_t length, int persistent);
+
+// Inflates pending input into output until either of them runs out
+int inflater_run(struct inflater *inflater, unsigned char *output, size_t length, size_t *produced);
+
+// Called after the last IDAT chunk has been passed to inflater_input
+int inflater_finish(struct inflater *inflater);
+
+// Nonzero once the end of the zlib stream has been reached
+int inflater_finished(const struct inflater *inflater);
+
+// Bytes of the buffers a one-shot backend keeps from one image to the next, and how often they were allocated or grown
+void inflater_memory(const struct inflater *inflater, size_t *bytes, unsigned int *allocations);
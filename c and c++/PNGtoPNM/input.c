@@ -0,0 +1,196 @@
+#if !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include "input.h"
+
+#include "crc32.h"
+#include "return_codes.h"
+
+#include <limits.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define INPUT_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+int input_open_stream(struct png_input *input, const char *path)
+{
+	memset(input, 0, sizeof(*input));
+	if (strcmp(path, "-") == 0)
+	{
+#if defined(_WIN32)
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		input->file = stdin;
+	}
+	else if ((input->file = fopen(path, "rb")) == NULL)
+	{
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+
+#if defined(INPUT_MMAP)
+	struct stat status;
+	input->seekable = fstat(fileno(input->file), &status) == 0 && S_ISREG(status.st_mode);
+#else
+	input->seekable = input->file != stdin;
+#endif
+	return SUCCESS;
+}
+
+int input_open(struct png_input *input, const char *path)
+{
+	if (input_open_stream(input, path) != SUCCESS)
+	{
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+
+#if defined(INPUT_MMAP)
+	struct stat status;
+	if (fstat(fileno(input->file), &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0)
+	{
+		void *map = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fileno(input->file), 0);
+		if (map != MAP_FAILED)
+		{
+			posix_madvise(map, status.st_size, POSIX_MADV_SEQUENTIAL);
+			input->map = map;
+			input->size = status.st_size;
+		}
+	}
+#endif
+	return SUCCESS;
+}
+
+void input_memory(struct png_input *input, const unsigned char *data, size_t size)
+{
+	memset(input, 0, sizeof(*input));
+	input->map = data;
+	input->size = size;
+}
+
+void input_close(struct png_input *input)
+{
+#if defined(INPUT_MMAP)
+	if (input->map != NULL)
+	{
+		munmap((void *)input->map, input->size);
+	}
+#endif
+	if (input->file != stdin)
+	{
+		fclose(input->file);
+	}
+}
+
+size_t input_read(struct png_input *input, unsigned char *buffer, size_t length)
+{
+	if (input->map == NULL)
+	{
+		length = fread(buffer, 1, length, input->file);
+		input->position += length;
+	}
+	else
+	{
+		if (length > input->size - input->position)
+		{
+			length = input->size - input->position;
+		}
+		memcpy(buffer, input->map + input->position, length);
+		input->position += length;
+	}
+	if (input->verify)
+	{
+		input->crc = crc32_update(input->crc, buffer, length);
+	}
+	return length;
+}
+
+void input_chunk_start(struct png_input *input)
+{
+	input->crc = 0;
+}
+
+int input_chunk_end(struct png_input *input)
+{
+	uint32_t crc = input->crc;
+	int verify = input->verify;
+	unsigned char stored[4];
+
+	input->verify = 0;
+	size_t read = input_read(input, stored, 4);
+	input->verify = verify;
+	if (read != 4)
+	{
+		fprintf(stderr, "error while reading a file\n");
+		return ERROR_DATA_INVALID;
+	}
+	if (verify && crc != ((uint32_t)stored[0] << 24 | (uint32_t)stored[1] << 16 | (uint32_t)stored[2] << 8 | stored[3]))
+	{
+		fprintf(stderr, "chunk crc mismatch\n");
+		return ERROR_DATA_INVALID;
+	}
+	return SUCCESS;
+}
+
+const unsigned char *input_span(struct png_input *input, size_t length)
+{
+	if (input->map == NULL || length > input->size - input->position)
+	{
+		return NULL;
+	}
+	const unsigned char *span = input->map + input->position;
+	input->position += length;
+	return span;
+}
+
+int input_skip(struct png_input *input, size_t length)
+{
+	if (input->map != NULL)
+	{
+		if (length > input->size - input->position)
+		{
+			fprintf(stderr, "error while reading a file\n");
+			return ERROR_DATA_INVALID;
+		}
+		if (input->verify)
+		{
+			input->crc = crc32_update(input->crc, input->map + input->position, length);
+		}
+		input->position += length;
+		return SUCCESS;
+	}
+
+	// a seek past the end goes unnoticed until the next read, which fails the same way a short skip would
+	if (!input->verify && input->seekable && length <= LONG_MAX && fseek(input->file, (long)length, SEEK_CUR) == 0)
+	{
+		input->position += length;
+		return SUCCESS;
+	}
+	unsigned char buffer[4096];
+	while (length > 0)
+	{
+		size_t bytes_to_read = length < sizeof(buffer) ? length : sizeof(buffer);
+		if (input_read(input, buffer, bytes_to_read) != bytes_to_read)
+		{
+			fprintf(stderr, "error while reading a file\n");
+			return ERROR_DATA_INVALID;
+		}
+		length -= bytes_to_read;
+	}
+	return SUCCESS;
+}
+
+int input_at_end(struct png_input *input)
+{
+	if (input->map != NULL)
+	{
+		return input->position == input->size;
+	}
+	return fgetc(input->file) == EOF;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct png_input
+{
+	FILE *file;
+	const unsigned char *map;	 // the whole file when it could be memory-mapped or is in memory, NULL for pipes and the like
+	size_t size, position;	  // position counts the bytes consumed so far, also without a map
+	int seekable;	 // a regular file, pipes are only ever read front to back
+	int verify;		 // check the crc of every chunk
+	uint32_t crc;	 // of the current chunk so far
+};
+
+// Maps regular files and falls back to stdio for everything else, "-" is stdin. Returns SUCCESS or ERROR_CANNOT_OPEN_FILE
+int input_open(struct png_input *input, const char *path);
+
+// Reads through stdio only, for a few scattered bytes of a file where mapping it and reading ahead would cost more. "-" is stdin
+int input_open_stream(struct png_input *input, const char *path);
+
+// Reads from a buffer the caller keeps alive, input_close does not need to be called
+void input_memory(struct png_input *input, const unsigned char *data, size_t size);
+
+void input_close(struct png_input *input);
+
+// Same contract as fread, with verification on the bytes also go into the crc of the current chunk
+size_t input_read(struct png_input *input, unsigned char *buffer, size_t length);
+
+// Starts the crc of a chunk, to be called between reading its length and its name
+void input_chunk_start(struct png_input *input);
+
+// Reads the crc that ends a chunk and compares it with the one of the bytes read since input_chunk_start,
+// returns SUCCESS or ERROR_DATA_INVALID
+int input_chunk_end(struct png_input *input);
+
+// Returns the next length bytes of a mapped input and moves past them, NULL if the input is not mapped or too short.
+// The bytes do not go into the crc, the caller checks them where they are used
+const unsigned char *input_span(struct png_input *input, size_t length);
+
+// Moves past length bytes without copying them: offset arithmetic on a mapped input, a seek on a seekable file unless the
+// bytes go into the crc, reads otherwise. Returns SUCCESS or ERROR_DATA_INVALID when the input is too short
+int input_skip(struct png_input *input, size_t length);
+
+int input_at_end(struct png_input *input);
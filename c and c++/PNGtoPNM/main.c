@@ -1,578 +1,856 @@
+#include "async_io.h"
+#include "bench.h"
+#include "cache.h"
+#include "inflater.h"
+#include "paths.h"
+#include "png_decoder.h"
+#include "png_encoder.h"
 #include "return_codes.h"
+#include "server.h"
 
-#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#if defined(ZLIB)
-#include <zlib.h>
-#elif defined(LIBDEFLATE)
-#include <libdeflate.h>
-#elif defined(ISAL)
-#include <include/igzip_lib.h>
-#else
-#error("wrong or not supported compression library")
+#include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
-#define MAX_PALETTE_LENGTH (256 * 3)
-#define CHUNK_BUFF_LENGTH 128
-
-unsigned char skip[CHUNK_BUFF_LENGTH];
-unsigned char IHDR_name[4] = { 0x49, 0x48, 0x44, 0x52 };
-unsigned char length_req[4] = { 0x00, 0x00, 0x00, 0x0D };
-unsigned char IDAT_name[4] = { 0x49, 0x44, 0x41, 0x54 };
-unsigned char PLTE_name[4] = { 0x50, 0x4C, 0x54, 0x45 };
-unsigned char IEND_name[4] = { 0x49, 0x45, 0x4E, 0x44 };
-
-void paeth(unsigned char *decompressed_data, int current_pixel, int left_pixel, int upper_pixel, int upper_left_pixel, int channel)
+// --stats: one line per image on stderr, key=value pairs or a JSON object. The line is put together first so that the
+// lines of batch workers do not mix
+void print_stats(const char *name, const struct png_decode_stats *stats, int json)
 {
-	int predicted = decompressed_data[left_pixel + channel] + decompressed_data[upper_pixel + channel] -
-					decompressed_data[upper_left_pixel + channel];
-	int diff_left = abs(predicted - decompressed_data[left_pixel + channel]);
-	int diff_upper = abs(predicted - decompressed_data[upper_pixel + channel]);
-	int diff_upper_left = abs(predicted - decompressed_data[upper_left_pixel + channel]);
+	char line[2048];
+	size_t length = 0;
+	const char *format = json ? "{\"file\": \"%s\", \"total\": {\"wall_s\": %.6f, \"cpu_s\": %.6f}, \"stages\": {"
+							  : "stats file=%s total_wall_s=%.6f total_cpu_s=%.6f";
+	length += snprintf(line + length, sizeof(line) - length, format, name, stats->total_seconds, stats->total_cpu_seconds);
+	for (int stage = 0; stage < PNG_STAGE_COUNT && length < sizeof(line); stage++)
+	{
+		format = json ? "%s\"%s\": {\"wall_s\": %.6f, \"cpu_s\": %.6f}" : "%s%s_wall_s=%.6f %s_cpu_s=%.6f";
+		const char *stage_name = png_decoder_stage_name((enum png_stage)stage);
+		if (json)
+		{
+			length += snprintf(line + length, sizeof(line) - length, format, stage ? ", " : "", stage_name, stats->seconds[stage],
+							   stats->cpu_seconds[stage]);
+		}
+		else
+		{
+			length += snprintf(line + length, sizeof(line) - length, format, " ", stage_name, stats->seconds[stage], stage_name,
+							   stats->cpu_seconds[stage]);
+		}
+	}
+	format = json ? "}, \"bytes_read\": %llu, \"bytes_inflated\": %llu, \"bytes_written\": %llu, \"idat_chunks\": %u, "
+					"\"inflate_segments\": %u, \"peak_heap\": %zu, \"reallocs\": %u}\n"
+				  : " bytes_read=%llu bytes_inflated=%llu bytes_written=%llu idat_chunks=%u inflate_segments=%u peak_heap=%zu reallocs=%u\n";
+	if (length < sizeof(line))
+	{
+		snprintf(line + length, sizeof(line) - length, format, stats->bytes_read, stats->bytes_inflated, stats->bytes_written,
+				 stats->IDAT_chunks, stats->inflate_segments, stats->peak_heap, stats->reallocs);
+	}
+	fputs(line, stderr);
+}
 
-	if (diff_left <= diff_upper && diff_left <= diff_upper_left)
+// --scale 1/2, 1/4, 1/8 or <width>x<height>
+int parse_scale(const char *text, struct png_decode_options *options)
+{
+	int width, height;
+	char end;
+	if (strcmp(text, "1/2") == 0 || strcmp(text, "1/4") == 0 || strcmp(text, "1/8") == 0)
 	{
-		decompressed_data[current_pixel + channel] += decompressed_data[left_pixel + channel];
+		options->scale = text[2] - '0';
+		return SUCCESS;
 	}
-	else if (diff_upper <= diff_upper_left)
+	if (sscanf(text, "%dx%d%c", &width, &height, &end) == 2 && width > 0 && height > 0)
+	{
+		options->scale_width = width;
+		options->scale_height = height;
+		return SUCCESS;
+	}
+	fprintf(stderr, "--scale takes 1/2, 1/4, 1/8 or <width>x<height>, not %s\n", text);
+	return ERROR_PARAMETER_INVALID;
+}
+
+// A number of bytes with an optional K, M or G suffix, for --memory-limit and --block-size
+int parse_bytes(const char *option, const char *text, size_t *bytes)
+{
+	char *end;
+	unsigned long long value = strtoull(text, &end, 10);
+	int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+	if (end == text || *text == '-' || (shift != 0 && *++end != '\0') || *end != '\0' || value == 0 ||
+		value > (SIZE_MAX >> shift))
 	{
-		decompressed_data[current_pixel + channel] += decompressed_data[upper_pixel + channel];
+		fprintf(stderr, "%s takes a number of bytes with an optional K, M or G suffix, not %s\n", option, text);
+		return ERROR_PARAMETER_INVALID;
 	}
-	else
+	*bytes = (size_t)value << shift;
+	return SUCCESS;
+}
+
+// <output_directory>/<input name without .png>.pnm
+char *batch_output_name(const char *output_directory, const char *input_name)
+{
+	const char *base = strrchr(input_name, '/');
+	base = base ? base + 1 : input_name;
+	size_t base_length = strlen(base) - (has_png_extension(base) ? 4 : 0);
+
+	char *name = malloc(strlen(output_directory) + base_length + 6);
+	if (name != NULL)
 	{
-		decompressed_data[current_pixel + channel] += decompressed_data[upper_left_pixel + channel];
+		sprintf(name, "%s/%.*s.pnm", output_directory, (int)base_length, base);
 	}
+	return name;
 }
 
-void png_filters(unsigned char *decompressed_data, int width, int height, int bytes_per_pixel)
+// An output name and the input it comes from
+struct batch_output
 {
-	int bytes_per_row = width * bytes_per_pixel + 1;
+	char *name;
+	size_t input;
+};
 
-	for (int row = 0; row < height; row++)
+static int batch_output_order(const void *a, const void *b)
+{
+	return strcmp(((const struct batch_output *)a)->name, ((const struct batch_output *)b)->name);
+}
+
+// Inputs with the same name in different directories would be written to the same output, one overwriting the other
+// or both writing it at once; ERROR_PARAMETER_INVALID names the first such pair
+int batch_check_outputs(const char *output_directory, const struct path_list *inputs)
+{
+	struct batch_output *outputs = calloc(inputs->count, sizeof(struct batch_output));
+	int result = outputs != NULL ? SUCCESS : ERROR_OUT_OF_MEMORY;
+	for (size_t i = 0; result == SUCCESS && i < inputs->count; i++)
 	{
-		unsigned char filter_type = decompressed_data[row * bytes_per_row];
-		for (int col = 0; col < width; col++)
+		outputs[i].input = i;
+		if ((outputs[i].name = batch_output_name(output_directory, inputs->items[i])) == NULL)
 		{
-			int current_pixel = row * bytes_per_row + col * bytes_per_pixel + 1;
-			int left_pixel = (col == 0) ? 0 : current_pixel - bytes_per_pixel;
-			int upper_pixel = (row == 0) ? 0 : current_pixel - bytes_per_row;
-			int upper_left_pixel = (col == 0 || row == 0) ? 0 : current_pixel - bytes_per_row - bytes_per_pixel;
-
-			for (int channel = 0; channel < bytes_per_pixel; channel++)
+			result = ERROR_OUT_OF_MEMORY;
+		}
+	}
+	if (result == SUCCESS)
+	{
+		qsort(outputs, inputs->count, sizeof(struct batch_output), batch_output_order);
+		for (size_t i = 1; result == SUCCESS && i < inputs->count; i++)
+		{
+			if (strcmp(outputs[i - 1].name, outputs[i].name) == 0)
 			{
-				if (filter_type == 1 && col != 0)
-				{
-					decompressed_data[current_pixel + channel] += decompressed_data[left_pixel + channel];
-				}
-				else if (filter_type == 2 && row != 0)
-				{
-					decompressed_data[current_pixel + channel] += decompressed_data[upper_pixel + channel];
-				}
-				else if (filter_type == 3)
-				{
-					int avg_left = (col != 0) ? decompressed_data[left_pixel + channel] : 0;
-					int avg_upper = (row != 0) ? decompressed_data[upper_pixel + channel] : 0;
-					decompressed_data[current_pixel + channel] += (avg_left + avg_upper) / 2;
-				}
-				else if (filter_type == 4)
-				{
-					paeth(decompressed_data, current_pixel, left_pixel, upper_pixel, upper_left_pixel, channel);
-				}
+				fprintf(stderr, "%s and %s would both be converted to %s\n", inputs->items[outputs[i - 1].input],
+						inputs->items[outputs[i].input], outputs[i].name);
+				result = ERROR_PARAMETER_INVALID;
 			}
 		}
 	}
+	else if (result == ERROR_OUT_OF_MEMORY)
+	{
+		fprintf(stderr, "out of memory\n");
+	}
+	for (size_t i = 0; outputs != NULL && i < inputs->count; i++)
+	{
+		free(outputs[i].name);
+	}
+	free(outputs);
+	return result;
 }
-int read_to_buff(FILE *input, unsigned char *buffer, unsigned int length)
+
+// Each worker owns a contiguous range of tasks; it takes from the tail of its own range and steals from the head of the others'
+struct batch_queue
+{
+#if defined(HAVE_POSIX)
+	pthread_mutex_t lock;
+#endif
+	size_t head, tail;
+};
+
+struct batch
 {
-	unsigned long read = fread(buffer, 1, length, input);
-	if (read != length)
+	const char *output_directory;
+	struct path_list *inputs;
+	int *results;
+	struct batch_queue *queues;
+	int workers;
+	struct png_decode_options options;
+	int stats_json;
+	enum async_io_backend io_backend;
+	struct cache *cache;	// NULL without --cache
+	size_t io_reserved;		// bytes of the inputs read ahead and the outputs written behind by all workers
+};
+
+struct batch_worker
+{
+	struct batch *batch;
+	int index;
+#if defined(HAVE_POSIX)
+	pthread_t thread;
+#endif
+};
+
+int batch_take(struct batch_queue *queue, int steal, size_t *task)
+{
+	int taken = 0;
+#if defined(HAVE_POSIX)
+	pthread_mutex_lock(&queue->lock);
+#endif
+	if (queue->head < queue->tail)
 	{
-		fprintf(stderr, "error while reading a file\n");
-		return ERROR_DATA_INVALID;
+		*task = steal ? queue->head++ : --queue->tail;
+		taken = 1;
 	}
-
-	return SUCCESS;
+#if defined(HAVE_POSIX)
+	pthread_mutex_unlock(&queue->lock);
+#endif
+	return taken;
 }
 
-int check_name(unsigned char *name, unsigned char *check_name, int length)
+// Takes the next task of the worker, stealing one when its own range is used up
+int batch_next(struct batch *batch, int index, size_t *task)
 {
-	for (int i = 0; i < length; i++)
+	// no task is added once the workers are running, so finding every queue empty means the batch is done
+	int taken = batch_take(&batch->queues[index], 0, task);
+	for (int k = 1; !taken && k < batch->workers; k++)
 	{
-		if (name[i] != check_name[i])
-		{
-			return ERROR_DATA_INVALID;
-		}
+		taken = batch_take(&batch->queues[(index + k) % batch->workers], 1, task);
 	}
+	return taken;
+}
 
-	return SUCCESS;
+#define BATCH_READ_AHEAD 2						 // inputs being read while the one before them is decoded
+#define BATCH_WRITE_BEHIND 2					 // finished images that may still be on their way to disk
+#define BATCH_WRITE_LIMIT ((size_t)64 << 20)	 // larger images go out row by row while they are decoded, as before
+#define BATCH_IO_BUDGET ((size_t)256 << 20)	   // the buffers of all workers together, however many there are
+
+#if defined(HAVE_POSIX)
+static pthread_mutex_t batch_io_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Takes bytes out of the budget, or returns 0 when they do not fit. A worker never waits for the budget, since the bytes
+// it holds itself may be what is missing: an input that does not fit is streamed through the decoder and an output
+// written row by row, neither of which needs a buffer of the whole file
+int batch_reserve(struct batch *batch, size_t bytes)
+{
+#if defined(HAVE_POSIX)
+	pthread_mutex_lock(&batch_io_lock);
+#endif
+	int reserved = bytes <= BATCH_IO_BUDGET && batch->io_reserved <= BATCH_IO_BUDGET - bytes;
+	batch->io_reserved += reserved ? bytes : 0;
+#if defined(HAVE_POSIX)
+	pthread_mutex_unlock(&batch_io_lock);
+#endif
+	return reserved;
 }
 
-int from_ch_arr(unsigned char *arr, int start, int length)
+void batch_release(struct batch *batch, size_t bytes)
 {
-	int result = arr[start] << (length - 1) * 8;
-	for (int i = length - 2; i >= 0; i--)
-	{
-		result = result | (arr[start + length - i - 1] << i * 8);
-	}
-	return result;
+#if defined(HAVE_POSIX)
+	pthread_mutex_lock(&batch_io_lock);
+#endif
+	batch->io_reserved -= bytes;
+#if defined(HAVE_POSIX)
+	pthread_mutex_unlock(&batch_io_lock);
+#endif
 }
 
-int check_IHDR_data(unsigned char bit_depth, unsigned char color_type, unsigned char compression_method, unsigned char filter_method, unsigned char interlace_method)
+// An input of the worker, read ahead unless file is NULL
+struct batch_input
+{
+	size_t task;
+	struct async_file *file;
+	int opened;	   // the result of async_io_read, ERROR_UNSUPPORTED when the decoder has to read the file itself
+	size_t reserved;	// bytes of the budget it holds
+};
+
+// How batch_convert got the output there
+enum batch_outcome
+{
+	BATCH_DECODED,	  // or failed to, as the result tells
+	BATCH_WRITING,	  // decoded and still being written, it goes into the cache once the write is done
+	BATCH_CACHED
+};
+
+// An output being written behind, it holds bytes of the budget and, with a cache, its fingerprint goes there once it is
+// on disk
+struct batch_store
 {
-	if (bit_depth != 0x08)
+	size_t task;
+	size_t reserved;
+	char *output_name;	  // NULL without a cache
+	unsigned char fingerprint[PNG_FINGERPRINT_SIZE];
+};
+
+// Decodes an input read through io into memory and has the PNM written behind while the next input is decoded.
+// *result gets the result of the decoding, or later that of the write. With a cache, fingerprint receives the key.
+// *reserved receives the bytes of the budget the write holds
+enum batch_outcome batch_convert(struct batch *batch, struct png_decoder *decoder, struct async_io *io, struct async_file *file,
+								 const char *output_name, int *result, unsigned char fingerprint[PNG_FINGERPRINT_SIZE], size_t *reserved)
+{
+	const unsigned char *data;
+	size_t size;
+	struct png_image image;
+	if ((*result = async_io_wait(io, file, &data, &size)) != SUCCESS)
 	{
-		fprintf(stderr, "Unsupported bit depth %x ! bit depth should be 8\n", bit_depth);
-		return ERROR_UNSUPPORTED;
+		return BATCH_DECODED;
 	}
-	if (color_type != 0x00 && color_type != 0x02 && color_type != 0x03)
+	if (batch->cache != NULL)
 	{
-		fprintf(stderr, "Unsupported color type %x ! color type should be 0, 2 or 3\n", color_type);
-		return ERROR_UNSUPPORTED;
+		if ((*result = png_fingerprint_memory(data, size, &batch->options, fingerprint)) != SUCCESS)
+		{
+			return BATCH_DECODED;
+		}
+		if (cache_fetch(batch->cache, fingerprint, output_name) == SUCCESS)
+		{
+			return BATCH_CACHED;
+		}
 	}
-
-	if (compression_method != 0x00)
+	if ((*result = png_decoder_read_info(decoder, data, size, &image)) != SUCCESS)
 	{
-		fprintf(stderr, "Invalid compression method %x ! compression method should be 0\n", compression_method);
-		return ERROR_DATA_INVALID;
+		return BATCH_DECODED;
 	}
-	if (filter_method != 0x00)
+	size_t rows = (size_t)image.height > SIZE_MAX / image.row_length ? SIZE_MAX : image.row_length * image.height;
+	char header[PNG_PNM_HEADER_SIZE];
+	size_t header_length = (size_t)png_decoder_pnm_header(&image, header, sizeof(header));
+	if (rows > BATCH_WRITE_LIMIT || !batch_reserve(batch, header_length + rows))
 	{
-		fprintf(stderr, "Invalid filter method %x ! filter method should be 0\n", filter_method);
-		return ERROR_DATA_INVALID;
+		if ((*result = png_decoder_convert_memory(decoder, data, size, output_name)) == SUCCESS && batch->cache != NULL)
+		{
+			cache_store(batch->cache, fingerprint, output_name);
+		}
+		return BATCH_DECODED;
 	}
-	if (interlace_method != 0x00 && interlace_method != 0x01)
+
+	unsigned char *pnm = malloc(header_length + rows);
+	if (pnm == NULL)
 	{
-		fprintf(stderr, "Invalid interlace method %x ! interlace method should be 0 or 1\n", interlace_method);
-		return ERROR_DATA_INVALID;
+		fprintf(stderr, "out of memory\n");
+		batch_release(batch, header_length + rows);
+		*result = ERROR_OUT_OF_MEMORY;
+		return BATCH_DECODED;
 	}
-	return SUCCESS;
+	memcpy(pnm, header, header_length);
+	if ((*result = png_decoder_decode_memory(decoder, data, size, pnm + header_length, image.row_length, rows, NULL)) != SUCCESS)
+	{
+		free(pnm);
+		batch_release(batch, header_length + rows);
+		return BATCH_DECODED;
+	}
+	async_io_settle(io, BATCH_WRITE_BEHIND - 1);
+	async_io_write(io, output_name, pnm, header_length + rows, result);
+	*reserved = header_length + rows;
+	return BATCH_WRITING;
 }
 
-int search_for_chunk(FILE *inputFile, unsigned char *name, unsigned char *buff, unsigned int *chunk_length)
+// Gives the budget of the outputs whose write is done back and hands them to the cache, returns how many are still
+// being written
+int batch_store_written(struct batch *batch, struct batch_store *stores, int count)
 {
-	unsigned int len = *chunk_length + 4;
-	if (check_name(name, IEND_name, 4) != SUCCESS)
+	int kept = 0;
+	for (int i = 0; i < count; i++)
 	{
-		if (read_to_buff(inputFile, buff, 4) != SUCCESS)
+		if (batch->results[stores[i].task] == ASYNC_IO_PENDING)
 		{
-			return ERROR_DATA_INVALID;
+			stores[kept++] = stores[i];
+			continue;
 		}
-
-		len = from_ch_arr(buff, 0, 4) + 4;
-
-		if (read_to_buff(inputFile, buff, 4) != SUCCESS)
+		batch_release(batch, stores[i].reserved);
+		if (batch->results[stores[i].task] == SUCCESS && stores[i].output_name != NULL)
 		{
-			return ERROR_DATA_INVALID;
+			cache_store(batch->cache, stores[i].fingerprint, stores[i].output_name);
 		}
+		free(stores[i].output_name);
 	}
+	return kept;
+}
 
-	while (check_name(buff, name, 4) != SUCCESS)
-	{
-		if (check_name(buff, PLTE_name, 4) == SUCCESS)
+void *batch_worker_run(void *argument)
+{
+	struct batch_worker *worker = argument;
+	struct batch *batch = worker->batch;
+	struct png_decoder *decoder;
+	int ready = png_decoder_create(&decoder, &batch->options);
+	// without an async_io every file is streamed through the decoder. The buffers of the inputs read ahead and of the
+	// outputs written behind are not the decoder's, so a --memory-limit could not hold with them
+	struct async_io *io = NULL;
+	if (batch->io_backend != ASYNC_IO_OFF && batch->options.memory_limit == 0 && async_io_create(&io, batch->io_backend) != SUCCESS)
+	{
+		io = NULL;
+	}
+	struct batch_input inputs[BATCH_READ_AHEAD + 1];
+	int count = 0;
+	// settling before every write keeps no more than BATCH_WRITE_BEHIND in flight
+	struct batch_store stores[BATCH_WRITE_BEHIND];
+	int stored = 0;
+
+	for (;;)
+	{
+		while (count < (io != NULL ? BATCH_READ_AHEAD + 1 : 1) && batch_next(batch, worker->index, &inputs[count].task))
+		{
+			struct batch_input *input = &inputs[count++];
+			input->file = NULL;
+			input->opened = ERROR_UNSUPPORTED;
+			input->reserved = 0;
+#if defined(HAVE_POSIX)
+			const char *path = batch->inputs->items[input->task];
+			struct stat status;
+			if (io != NULL && stat(path, &status) == 0 && batch_reserve(batch, (size_t)status.st_size))
+			{
+				input->reserved = (size_t)status.st_size;
+				input->opened = async_io_read(io, path, &input->file);
+			}
+#endif
+		}
+		if (count == 0)
 		{
-			fprintf(stderr, "unexpected PLTE chunk\n");
-			return ERROR_DATA_INVALID;
+			break;
 		}
-		if (check_name(buff, IDAT_name, 4) == SUCCESS)
+		struct batch_input input = inputs[0];
+		memmove(inputs, inputs + 1, --count * sizeof(struct batch_input));
+		size_t task = input.task;
+		int *result = &batch->results[task];
+		enum batch_outcome outcome = BATCH_DECODED;
+		unsigned char fingerprint[PNG_FINGERPRINT_SIZE];
+		size_t reserved = 0;
+
+		char *output_name = batch_output_name(batch->output_directory, batch->inputs->items[task]);
+		if (output_name == NULL)
 		{
-			fprintf(stderr, "unexpected IDAT chunk\n");
-			return ERROR_DATA_INVALID;
+			*result = ERROR_OUT_OF_MEMORY;
 		}
-
-		while (len > 0)
+		else if (ready != SUCCESS || (input.opened != SUCCESS && input.opened != ERROR_UNSUPPORTED))
 		{
-			unsigned int bytes_to_read = len < 128 ? len : 128;
-
-			if (read_to_buff(inputFile, skip, bytes_to_read) != SUCCESS)
-			{
-				return ERROR_DATA_INVALID;
-			}
-
-			len -= bytes_to_read;
+			*result = ready != SUCCESS ? ready : input.opened;
 		}
-		if (fread(buff, 1, 4, inputFile) != 4)
+		else if (input.file == NULL)
 		{
-			return ERROR_DATA_INVALID;
+			int hit;
+			*result = cache_convert_file(batch->cache, decoder, &batch->options, batch->inputs->items[task], output_name, &hit);
+			outcome = hit ? BATCH_CACHED : BATCH_DECODED;
+		}
+		else
+		{
+			outcome = batch_convert(batch, decoder, io, input.file, output_name, result, fingerprint, &reserved);
+		}
+		if (input.file != NULL)
+		{
+			async_io_close(io, input.file);
+		}
+		batch_release(batch, input.reserved);
+		if ((*result == SUCCESS || *result == ASYNC_IO_PENDING) && outcome != BATCH_CACHED && batch->options.stats != PNG_STATS_OFF)
+		{
+			struct png_decode_stats stats;
+			png_decoder_stats(decoder, &stats);
+			print_stats(batch->inputs->items[task], &stats, batch->stats_json);
 		}
 
-		len = from_ch_arr(buff, 0, 4) + 4;
-
-		if (fread(buff, 1, 4, inputFile) != 4)
+		stored = batch_store_written(batch, stores, stored);
+		if (outcome == BATCH_WRITING)
 		{
-			return ERROR_DATA_INVALID;
+			stores[stored].task = task;
+			stores[stored].reserved = reserved;
+			stores[stored].output_name = NULL;
+			if (batch->cache != NULL)
+			{
+				stores[stored].output_name = output_name;
+				memcpy(stores[stored].fingerprint, fingerprint, PNG_FINGERPRINT_SIZE);
+			}
+			stored++;
+		}
+		if (outcome != BATCH_WRITING || batch->cache == NULL)
+		{
+			free(output_name);
 		}
 	}
-	*chunk_length = len - 4;
-	return SUCCESS;
+
+	// the results of the last writes are in once it returns
+	async_io_destroy(io);
+	batch_store_written(batch, stores, stored);
+	png_decoder_destroy(decoder);
+	return NULL;
 }
 
-int main(int argc, char *argv[])
+// -j <threads> <output_directory> <input>...
+// argv starts at -j
+int batch_main(int argc, char *argv[], struct png_decode_options *options, int stats_json, enum async_io_backend io_backend,
+			   struct cache *cache)
 {
-	FILE *inputFile, *outputFile;
-	unsigned char png_name[8] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
-
-	unsigned char png_code[8];
-	unsigned char buff[4];
-	unsigned char readingIHDR[13];
-	int width, length;
-	unsigned char bit_depth, color_type, compression_method, filter_method, interlace_method;
-
-	if (argc != 3)
+	char *end;
+	long threads = strtol(argv[1], &end, 10);
+	if (*end != '\0' || threads <= 0 || threads > 1024)
 	{
-		fprintf(stderr, "Invalid format! expected two arguments - input file name and output file name.\n");
-		fprintf(stderr, "Usage: %s <input_file_name> <output_file_name>\n", argv[0]);
+		fprintf(stderr, "Invalid number of threads %s\n", argv[1]);
 		return ERROR_PARAMETER_INVALID;
 	}
-
-	if ((inputFile = fopen(argv[1], "rb")) == NULL)
+	const char *output_directory = argv[2];
+#if defined(HAVE_POSIX)
+	struct stat status;
+	if (stat(output_directory, &status) != 0 && mkdir(output_directory, 0777) != 0)
 	{
-		fprintf(stderr, "Cannot open file %s\n", argv[1]);
+		fprintf(stderr, "Cannot create directory %s\n", output_directory);
 		return ERROR_CANNOT_OPEN_FILE;
 	}
+#else
+	threads = 1;
+#endif
 
-	if (read_to_buff(inputFile, png_code, 8) != SUCCESS)
+	struct path_list inputs = { 0 };
+	int result = SUCCESS;
+	for (int i = 3; result == SUCCESS && i < argc; i++)
 	{
-		fclose(inputFile);
-		return ERROR_DATA_INVALID;
+		result = collect_inputs(&inputs, argv[i]);
 	}
-
-	if (check_name(png_code, png_name, 8) != SUCCESS)
+	if (result == SUCCESS && inputs.count > 0)
 	{
-		fprintf(stderr, "Is not a png (incorrect signature).\n");
-		fclose(inputFile);
-		return ERROR_PARAMETER_INVALID;
+		result = batch_check_outputs(output_directory, &inputs);
 	}
-
-	if (read_to_buff(inputFile, buff, 4) != SUCCESS)
+	if (result != SUCCESS || inputs.count == 0)
 	{
-		fclose(inputFile);
-		return ERROR_DATA_INVALID;
+		path_list_free(&inputs);
+		return result != SUCCESS ? result : ERROR_PARAMETER_INVALID;
 	}
 
-	if (check_name(buff, length_req, 4) != SUCCESS)
+	int workers = threads < (long)inputs.count ? (int)threads : (int)inputs.count;
+	struct batch batch = { output_directory, &inputs, calloc(inputs.count, sizeof(int)), calloc(workers, sizeof(struct batch_queue)), workers,
+						   *options, stats_json, io_backend, cache, 0 };
+	struct batch_worker *worker = calloc(workers, sizeof(struct batch_worker));
+	if (batch.results == NULL || batch.queues == NULL || worker == NULL)
 	{
-		fprintf(stderr, "Incorrect IHDR len\n");
-		fclose(inputFile);
-		return ERROR_DATA_INVALID;
+		fprintf(stderr, "out of memory\n");
+		free(batch.results);
+		free(batch.queues);
+		free(worker);
+		path_list_free(&inputs);
+		return ERROR_OUT_OF_MEMORY;
 	}
 
-	if (read_to_buff(inputFile, buff, 4) != SUCCESS)
+	for (int i = 0; i < workers; i++)
 	{
-		fclose(inputFile);
-		return ERROR_DATA_INVALID;
+		batch.queues[i].head = inputs.count * i / workers;
+		batch.queues[i].tail = inputs.count * (i + 1) / workers;
+		worker[i].batch = &batch;
+		worker[i].index = i;
+#if defined(HAVE_POSIX)
+		pthread_mutex_init(&batch.queues[i].lock, NULL);
+#endif
 	}
 
-	if (check_name(buff, IHDR_name, 4) != SUCCESS)
+	// the calling thread is worker 0, so the batch completes even if no thread can be started
+#if defined(HAVE_POSIX)
+	int started = 1;
+	while (started < workers && pthread_create(&worker[started].thread, NULL, batch_worker_run, &worker[started]) == 0)
 	{
-		fprintf(stderr, "expected IHDR \n");
-		fclose(inputFile);
-		return ERROR_DATA_INVALID;
+		started++;
 	}
-
-	if (read_to_buff(inputFile, readingIHDR, 13) != SUCCESS)
+	batch_worker_run(&worker[0]);
+	for (int i = 1; i < started; i++)
 	{
-		fclose(inputFile);
-		return ERROR_DATA_INVALID;
+		pthread_join(worker[i].thread, NULL);
 	}
-
-	width = from_ch_arr(readingIHDR, 0, 4);
-	length = from_ch_arr(readingIHDR, 4, 4);
-
-	if (width <= 0 || length <= 0)
+	for (int i = 0; i < workers; i++)
 	{
-		fclose(inputFile);
-		return ERROR_DATA_INVALID;
+		pthread_mutex_destroy(&batch.queues[i].lock);
 	}
+#else
+	batch_worker_run(&worker[0]);
+#endif
 
-	bit_depth = readingIHDR[8];
-	color_type = readingIHDR[9];
-	compression_method = readingIHDR[10];
-	filter_method = readingIHDR[11];
-	interlace_method = readingIHDR[12];
+	for (size_t i = 0; i < inputs.count; i++)
+	{
+		printf("%d %s\n", batch.results[i], inputs.items[i]);
+		if (result == SUCCESS)
+		{
+			result = batch.results[i];
+		}
+	}
 
-	int correct_data = check_IHDR_data(bit_depth, color_type, compression_method, filter_method, interlace_method);
+	free(batch.results);
+	free(batch.queues);
+	free(worker);
+	path_list_free(&inputs);
+	return result;
+}
 
-	if (correct_data != SUCCESS)
+// --probe <input>...: one line per file on stdout with what its chunk headers tell, the first error is the result
+int probe_main(int argc, char *argv[])
+{
+	struct path_list inputs = { 0 };
+	int result = SUCCESS;
+	for (int i = 0; result == SUCCESS && i < argc; i++)
+	{
+		result = collect_inputs(&inputs, argv[i]);
+	}
+	if (result != SUCCESS || inputs.count == 0)
 	{
-		fclose(inputFile);
-		return correct_data;
+		path_list_free(&inputs);
+		return result != SUCCESS ? result : ERROR_PARAMETER_INVALID;
 	}
 
-	if (read_to_buff(inputFile, buff, 4) != SUCCESS)
+	for (size_t i = 0; i < inputs.count; i++)
 	{
-		fclose(inputFile);
-		return ERROR_DATA_INVALID;
+		struct png_probe probe;
+		int probed = png_probe_file(inputs.items[i], &probe);
+		if (probed == SUCCESS)
+		{
+			printf("file=%s width=%d height=%d bit_depth=%d color_type=%d interlaced=%d idat_offset=%llu idat_bytes=%llu "
+				   "idat_chunks=%u\n",
+				   inputs.items[i], probe.width, probe.height, probe.bit_depth, probe.color_type, probe.interlaced, probe.IDAT_offset,
+				   probe.IDAT_bytes, probe.IDAT_chunks);
+		}
+		else
+		{
+			printf("file=%s error=%d\n", inputs.items[i], probed);
+			result = result == SUCCESS ? probed : result;
+		}
 	}
+	path_list_free(&inputs);
+	return result;
+}
 
-	unsigned char palette[MAX_PALETTE_LENGTH];
-	unsigned int palette_length;
-	if (color_type == 3)
+// --frames <input_file_name|-> <output_pattern|output_file_name|->, argv starts after --frames
+int frames_main(int argc, char *argv[], const struct png_decode_options *options, int stats_json)
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "--frames takes an input file name and an output file name or a pattern like frame%%03d.pnm\n");
+		return ERROR_PARAMETER_INVALID;
+	}
+	struct png_decoder *decoder;
+	unsigned int frames;
+	int result = png_decoder_create(&decoder, options);
+	if (result == SUCCESS)
+	{
+		result = png_decoder_convert_frames(decoder, argv[0], argv[1], &frames);
+	}
+	if (result == SUCCESS && options->stats != PNG_STATS_OFF)
 	{
-		if (search_for_chunk(inputFile, PLTE_name, buff, &palette_length) != SUCCESS)
+		struct png_decode_stats stats;
+		png_decoder_stats(decoder, &stats);
+		print_stats(argv[0], &stats, stats_json);
+	}
+	png_decoder_destroy(decoder);
+	return result;
+}
+
+// --encode [--threads <count>] [--level <1-9>] [--block-size <bytes>[K|M]] <input_file_name|-> <output_file_name|->
+// argv starts after --encode
+int encode_main(int argc, char *argv[])
+{
+	struct png_encode_options options = { 0 };
+	int first = 0;
+	for (; first + 1 < argc && strncmp(argv[first], "--", 2) == 0; first += 2)
+	{
+		char *end;
+		long value = strtol(argv[first + 1], &end, 10);
+		int valid = *end == '\0';
+		if (strcmp(argv[first], "--threads") == 0 && valid && value > 0 && value <= 1024)
 		{
-			fprintf(stderr, "couldn't find a pallet for color type 3 image.\n");
-			fclose(inputFile);
-			return ERROR_DATA_INVALID;
+			options.threads = (int)value;
 		}
-		if (palette_length > 256 * 3 || palette_length % 3 != 0)
+		else if (strcmp(argv[first], "--level") == 0 && valid && value >= 1 && value <= 9)
 		{
-			fprintf(stderr, "pallet size is not correct\n");
-			return ERROR_DATA_INVALID;
+			options.level = (int)value;
 		}
-		if (read_to_buff(inputFile, palette, palette_length) != SUCCESS)
+		else if (strcmp(argv[first], "--block-size") == 0)
 		{
-			fclose(inputFile);
-			return ERROR_DATA_INVALID;
+			// zlib counts the bytes of a block in unsigned ints
+			if (parse_bytes("--block-size", argv[first + 1], &options.block_size) != SUCCESS || options.block_size > (256u << 20))
+			{
+				fprintf(stderr, "--block-size takes at most 256M\n");
+				return ERROR_PARAMETER_INVALID;
+			}
 		}
-		if (read_to_buff(inputFile, buff, 4) != SUCCESS)
+		else
 		{
-			fclose(inputFile);
-			return ERROR_DATA_INVALID;
+			fprintf(stderr, "Invalid option %s %s\n", argv[first], argv[first + 1]);
+			return ERROR_PARAMETER_INVALID;
 		}
 	}
-
-	unsigned int chunk_length;
-	if (search_for_chunk(inputFile, IDAT_name, buff, &chunk_length) != SUCCESS)
+	if (argc - first != 2)
 	{
-		fprintf(stderr, "couldnt find a IDAT chunk.\n");
-		fclose(inputFile);
-		return ERROR_DATA_INVALID;
+		fprintf(stderr, "--encode expects two arguments - input file name and output file name.\n");
+		return ERROR_PARAMETER_INVALID;
 	}
+	return png_encode_file(argv[first], argv[first + 1], &options);
+}
 
-	unsigned char *IDAT_data = NULL;
-	unsigned int IDAT_data_length = 0;
-
-	while (check_name(buff, IDAT_name, 4) == SUCCESS)
-	{
-		unsigned char *temp = realloc(IDAT_data, IDAT_data_length + chunk_length);
-		if (temp == NULL)
+int main(int argc, char *argv[])
+{
+	struct png_decode_options options = { 0 };
+	int stats_json = 0;
+	int inflate_threads = 0;
+	enum async_io_backend io_backend = ASYNC_IO_AUTO;
+	const char *cache_directory = NULL;
+	size_t cache_size = CACHE_DEFAULT_SIZE;
+	int first = 1;
+	for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++)
+	{
+		if (strcmp(argv[first], "--progressive") == 0 && first + 1 < argc)
 		{
-			fclose(inputFile);
-			free(IDAT_data);
-			return ERROR_OUT_OF_MEMORY;
+			options.preview_name = argv[++first];
 		}
-		IDAT_data = temp;
-
-		if (read_to_buff(inputFile, IDAT_data + IDAT_data_length, chunk_length) != SUCCESS)
+		else if (strcmp(argv[first], "--verify") == 0)
 		{
-			fclose(inputFile);
-			free(IDAT_data);
-			return ERROR_DATA_INVALID;
+			options.verify = 1;
 		}
-
-		IDAT_data_length += chunk_length;
-		if (read_to_buff(inputFile, buff, 4) != SUCCESS)	// crc
+		else if (strcmp(argv[first], "--strip-alpha") == 0)
 		{
-			fclose(inputFile);
-			free(IDAT_data);
-			return ERROR_DATA_INVALID;
+			options.strip_alpha = 1;
 		}
-
-		if (read_to_buff(inputFile, buff, 4) != SUCCESS)
+		else if (strcmp(argv[first], "--stats") == 0 || strcmp(argv[first], "--stats=json") == 0)
 		{
-			fclose(inputFile);
-			free(IDAT_data);
-			return ERROR_DATA_INVALID;
+			options.stats = PNG_STATS_CPU;
+			stats_json = argv[first][7] == '=';
 		}
-
-		chunk_length = from_ch_arr(buff, 0, 4);
-
-		if (read_to_buff(inputFile, buff, 4) != SUCCESS)
+		else if (strcmp(argv[first], "--scale") == 0 && first + 1 < argc)
+		{
+			int result = parse_scale(argv[++first], &options);
+			if (result != SUCCESS)
+			{
+				return result;
+			}
+		}
+		else if (strcmp(argv[first], "--memory-limit") == 0 && first + 1 < argc)
 		{
-			fclose(inputFile);
-			free(IDAT_data);
-			return ERROR_DATA_INVALID;
+			int result = parse_bytes("--memory-limit", argv[++first], &options.memory_limit);
+			if (result != SUCCESS)
+			{
+				return result;
+			}
 		}
-	}
-
-	if (check_name(buff, IEND_name, 4) != SUCCESS)
-	{
-		if (search_for_chunk(inputFile, IEND_name, buff, &chunk_length) != SUCCESS)
+		else if (strcmp(argv[first], "--inflate-threads") == 0 && first + 1 < argc)
 		{
-			fprintf(stderr, "couldnt find a IEND chunk.\n");
-			fclose(inputFile);
-			free(IDAT_data);
-			return ERROR_DATA_INVALID;
+			char *end;
+			long value = strtol(argv[++first], &end, 10);
+			if (*end != '\0' || value < 1 || value > 1024)
+			{
+				fprintf(stderr, "--inflate-threads takes a count from 1 to 1024, not %s\n", argv[first]);
+				return ERROR_PARAMETER_INVALID;
+			}
+			inflate_threads = (int)value;
+		}
+		else if (strcmp(argv[first], "--batch-io") == 0 && first + 1 < argc)
+		{
+			int result = async_io_parse_backend(argv[++first], &io_backend);
+			if (result != SUCCESS)
+			{
+				return result;
+			}
+		}
+		else if (strcmp(argv[first], "--cache") == 0 && first + 1 < argc)
+		{
+			cache_directory = argv[++first];
+		}
+		else if (strcmp(argv[first], "--cache-size") == 0 && first + 1 < argc)
+		{
+			int result = parse_bytes("--cache-size", argv[++first], &cache_size);
+			if (result != SUCCESS)
+			{
+				return result;
+			}
+		}
+		else if (strcmp(argv[first], "--inflate") == 0 && first + 1 < argc)
+		{
+			int result = inflater_parse_backend(argv[++first], &options.backend);
+			if (result != SUCCESS)
+			{
+				return result;
+			}
+		}
+#if defined(HAVE_POSIX)
+		else if (strcmp(argv[first], "--pipeline") == 0)
+		{
+			options.pipelined = 1;
+		}
+#endif
+		else
+		{
+			break;
 		}
 	}
 
-	if (chunk_length != 0)
+	if (first < argc && strcmp(argv[first], "--probe") == 0)
 	{
-		fprintf(stderr, "IEND chunk length is not 0.\n");
-		fclose(inputFile);
-		free(IDAT_data);
-		return ERROR_DATA_INVALID;
+		return probe_main(argc - first - 1, argv + first + 1);
 	}
-
-	if (read_to_buff(inputFile, buff, 4) != SUCCESS)	// crc
+	if (first < argc && strcmp(argv[first], "--encode") == 0)
 	{
-		fclose(inputFile);
-		free(IDAT_data);
-		return ERROR_DATA_INVALID;
+		return encode_main(argc - first - 1, argv + first + 1);
 	}
-
-	if (fread(buff, 1, 1 + chunk_length, inputFile) == 1 + chunk_length)
+	// batch jobs and daemon requests already keep every processor busy, so only a single image is inflated by
+	// several threads unless asked otherwise
+	options.inflate_threads = inflate_threads;
+	if (first < argc && strcmp(argv[first], "--daemon") == 0)
 	{
-		fprintf(stderr, "there is more data after IEND chunk\n");
-		fclose(inputFile);
-		free(IDAT_data);
-		return ERROR_DATA_INVALID;
+		return server_main(argc - first - 1, argv + first + 1, &options);
 	}
-
-	fclose(inputFile);
-
-	int bytes_per_pixel = (color_type == 0x02 ? 3 : 1);
-	int bytes_per_row = (width * bytes_per_pixel) + 1;
-	unsigned long decompressed_data_size = length * bytes_per_row;
-
-	unsigned char *decompressed_data = malloc(decompressed_data_size);
-
-	if (decompressed_data == NULL)
+	if (first < argc && strcmp(argv[first], "--bench") == 0)
 	{
-		fprintf(stderr, "out of memory\n");
-		free(IDAT_data);
-		return ERROR_OUT_OF_MEMORY;
+		return bench_main(argc - first - 1, argv + first + 1, &options);
 	}
-
-#if defined(ZLIB)
-	uLongf destLen = decompressed_data_size;
-	if (uncompress(decompressed_data, &destLen, IDAT_data, IDAT_data_length) != Z_OK)
+	if (first < argc && strcmp(argv[first], "--frames") == 0)
 	{
-		fprintf(stderr, "failed to decompress data\n");
-		free(decompressed_data);
-		free(IDAT_data);
-		return ERROR_DATA_INVALID;
+		return frames_main(argc - first - 1, argv + first + 1, &options, stats_json);
 	}
-#elif defined(LIBDEFLATE)
-	struct libdeflate_decompressor *decompressor = libdeflate_alloc_decompressor();
-	if (decompressor == NULL)
+	// conversions of single files and batches go through the cache, the others do not write one PNM per PNG
+	struct cache *cache = NULL;
+	if (cache_directory != NULL && options.preview_name == NULL)
 	{
-		fprintf(stderr, "failed to allocate decompressor\n");
-		free(decompressed_data);
-		free(IDAT_data);
-		return ERROR_OUT_OF_MEMORY;
+		int result = cache_open(&cache, cache_directory, cache_size);
+		if (result != SUCCESS)
+		{
+			return result;
+		}
 	}
-	size_t decompressed_data_actual_size;
-	if (libdeflate_zlib_decompress(decompressor, IDAT_data, IDAT_data_length, decompressed_data, decompressed_data_size, &decompressed_data_actual_size) !=
-		LIBDEFLATE_SUCCESS)
-	{
-		fprintf(stderr, "failed to decompress data\n");
-		libdeflate_free_decompressor(decompressor);
-		free(decompressed_data);
-		free(IDAT_data);
-		return ERROR_DATA_INVALID;
-	}
-	libdeflate_free_decompressor(decompressor);
-
-#elif defined(ISAL)
-	struct inflate_state state;
-	isal_inflate_init(&state);
-	state.avail_in = IDAT_data_length;
-	state.next_in = IDAT_data;
-	state.avail_out = decompressed_data_size;
-	state.next_out = decompressed_data;
-	state.crc_flag = IGZIP_ZLIB;
-	if (isal_inflate(&state) != ISAL_DECOMP_OK)
-	{
-		fprintf(stderr, "failed to decompress data\n");
-		free(decompressed_data);
-		free(IDAT_data);
-		return ERROR_DATA_INVALID;
+	if (argc - first >= 4 && strcmp(argv[first], "-j") == 0 && options.preview_name == NULL)
+	{
+		int result = batch_main(argc - first, argv + first, &options, stats_json, io_backend, cache);
+		cache_close(cache);
+		return result;
 	}
-#endif
-	free(IDAT_data);
 
-	png_filters(decompressed_data, width, length, bytes_per_pixel);
-	if ((outputFile = fopen(argv[2], "wb")) == NULL)
+	if (argc - first != 2)
 	{
-		fprintf(stderr, "cannot open file %s\n", argv[2]);
-		free(decompressed_data);
-		return ERROR_CANNOT_OPEN_FILE;
+		fprintf(stderr, "Invalid format! expected two arguments - input file name and output file name.\n");
+		fprintf(stderr, "Usage: %s [options] <input_file_name|-> <output_file_name|->\n", argv[0]);
+		fprintf(stderr, "       %s [options] -j <threads> <output_directory> <input_file|input_directory|@list_file>...\n", argv[0]);
+		fprintf(stderr, "       %s --probe <input_file|input_directory|@list_file>...\n", argv[0]);
+		fprintf(stderr, "       %s --encode [--threads <count>] [--level <1-9>] [--block-size <bytes>[K|M]] <input_file_name|-> "
+						"<output_file_name|->\n",
+				argv[0]);
+		fprintf(stderr, "       %s [options] --frames <input_file_name|-> <output_pattern|output_file_name|->\n", argv[0]);
+		fprintf(stderr, "       %s [options] --daemon <socket_path> [<workers>]\n", argv[0]);
+		fprintf(stderr, "       %s [options] --bench [--runs <count>] [--json] [<input_file|input_directory|@list_file>...]\n", argv[0]);
+		fprintf(stderr, "Options: --verify --strip-alpha --pipeline --inflate auto|zlib|libdeflate|isal --stats[=json]\n");
+		fprintf(stderr, "         --scale 1/2|1/4|1/8|<width>x<height> --memory-limit <bytes>[K|M|G]\n");
+		fprintf(stderr, "         --inflate-threads <count> --progressive <preview_file_name> (not with -j)\n");
+		fprintf(stderr, "         --batch-io auto|io_uring|pread|off (with -j)\n");
+		fprintf(stderr, "         --cache <directory> --cache-size <bytes>[K|M|G] (single files and -j, not with --progressive)\n");
+		cache_close(cache);
+		return ERROR_PARAMETER_INVALID;
 	}
 
-	int p5 = color_type == 0x00;
-	if (color_type == 0x03)
+#if defined(HAVE_POSIX)
+	if (inflate_threads == 0)
 	{
-		p5 = 1;
-		for (int i = 0; i < palette_length; i += 3)
-		{
-			if (palette[i] != palette[i + 1] || palette[i] != palette[i + 2])
-			{
-				p5 = 0;
-				break;
-			}
-		}
+		long processors = sysconf(_SC_NPROCESSORS_ONLN);
+		options.inflate_threads = processors > 1 ? (int)(processors < 1024 ? processors : 1024) : 1;
 	}
-	unsigned char *row;
+#endif
 
-	if (p5)
+	struct png_decoder *decoder;
+	int hit = 0;
+	int result = png_decoder_create(&decoder, &options);
+	if (result == SUCCESS)
 	{
-		row = malloc(width);
-		if (row == NULL)
-		{
-			fprintf(stderr, "out of memory\n");
-			free(decompressed_data);
-			fclose(outputFile);
-			return ERROR_OUT_OF_MEMORY;
-		}
-		fprintf(outputFile, "P5\n%d %d\n%d\n", width, length, (1 << bit_depth) - 1);
-
-		for (int i = 0; i < length; i++)
-		{
-			for (int j = 0; j < width; j++)
-			{
-				int index = (i * bytes_per_row) + j * bytes_per_pixel + 1;
-				if (color_type == 0x00)
-				{
-					row[j] = decompressed_data[index];
-				}
-				else if (color_type == 0x03)
-				{
-					unsigned char palette_index = decompressed_data[index];
-					row[j] = palette[palette_index * 3];
-				}
-			}
-			fwrite(row, 1, width, outputFile);
-		}
+		result = cache_convert_file(cache, decoder, &options, argv[first], argv[first + 1], &hit);
 	}
-	else
+	if (result == SUCCESS && !hit && options.stats != PNG_STATS_OFF)
 	{
-		fprintf(outputFile, "P6\n%d %d\n%d\n", width, length, (1 << bit_depth) - 1);
-		row = malloc(width * 3);
-		if (row == NULL)
-		{
-			fprintf(stderr, "out of memory\n");
-			free(decompressed_data);
-			fclose(outputFile);
-			return ERROR_OUT_OF_MEMORY;
-		}
-		for (int i = 0; i < length; i++)
-		{
-			for (int j = 0; j < width; j++)
-			{
-				int index = (i * bytes_per_row) + j * bytes_per_pixel + 1;
-				if (color_type == 0x02)
-				{
-					for (int k = 0; k < 3; ++k)
-					{
-						row[j * 3 + k] = decompressed_data[index + k];
-					}
-				}
-				else if (color_type == 0x03)
-				{
-					unsigned char palette_index = decompressed_data[index];
-					for (int k = 0; k < 3; ++k)
-					{
-						row[j * 3 + k] = palette[palette_index * 3 + k];
-					}
-				}
-			}
-			fwrite(row, 1, width * 3, outputFile);
-		}
+		struct png_decode_stats stats;
+		png_decoder_stats(decoder, &stats);
+		print_stats(argv[first], &stats, stats_json);
 	}
-	free(row);
-	free(decompressed_data);
-	fclose(outputFile);
-	return SUCCESS;
+	png_decoder_destroy(decoder);
+	cache_close(cache);
+	return result;
 }
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdlib.h>
+
+// The Paeth predictor of the PNG specification for the encoder's filters and the decoder's unfilters. Written with the
+// differences instead of the predicted value so that the compiler can turn the choice into conditional moves
+static inline unsigned char paeth(int left, int upper, int upper_left)
+{
+	int diff_left = abs(upper - upper_left);
+	int diff_upper = abs(left - upper_left);
+	int diff_upper_left = abs(left + upper - 2 * upper_left);
+
+	if (diff_left <= diff_upper && diff_left <= diff_upper_left)
+	{
+		return left;
+	}
+	return diff_upper <= diff_upper_left ? upper : upper_left;
+}
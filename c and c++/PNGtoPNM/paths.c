@@ -0,0 +1,126 @@
+#include "paths.h"
+
+#include "return_codes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+int path_list_add(struct path_list *list, const char *directory, const char *name)
+{
+	if (list->count == list->capacity)
+	{
+		size_t capacity = list->capacity ? list->capacity * 2 : 64;
+		char **temp = realloc(list->items, capacity * sizeof(char *));
+		if (temp == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			return ERROR_OUT_OF_MEMORY;
+		}
+		list->items = temp;
+		list->capacity = capacity;
+	}
+
+	size_t directory_length = directory ? strlen(directory) + 1 : 0;
+	char *path = malloc(directory_length + strlen(name) + 1);
+	if (path == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	if (directory)
+	{
+		strcpy(path, directory);
+		path[directory_length - 1] = '/';
+	}
+	strcpy(path + directory_length, name);
+	list->items[list->count++] = path;
+	return SUCCESS;
+}
+
+void path_list_free(struct path_list *list)
+{
+	for (size_t i = 0; i < list->count; i++)
+	{
+		free(list->items[i]);
+	}
+	free(list->items);
+}
+
+int has_png_extension(const char *name)
+{
+	size_t length = strlen(name);
+	if (length < 4 || name[length - 4] != '.')
+	{
+		return 0;
+	}
+	for (int i = 0; i < 3; i++)
+	{
+		if ((name[length - 3 + i] | 0x20) != "png"[i])
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int compare_paths(const void *first, const void *second)
+{
+	return strcmp(*(char *const *)first, *(char *const *)second);
+}
+
+int collect_inputs(struct path_list *inputs, const char *argument)
+{
+	int result = SUCCESS;
+	if (argument[0] == '@')
+	{
+		FILE *list = fopen(argument + 1, "r");
+		if (list == NULL)
+		{
+			fprintf(stderr, "Cannot open file %s\n", argument + 1);
+			return ERROR_CANNOT_OPEN_FILE;
+		}
+		char line[4096];
+		while (result == SUCCESS && fgets(line, sizeof(line), list) != NULL)
+		{
+			line[strcspn(line, "\r\n")] = '\0';
+			if (line[0] != '\0')
+			{
+				result = path_list_add(inputs, NULL, line);
+			}
+		}
+		fclose(list);
+		return result;
+	}
+
+#if defined(HAVE_POSIX)
+	struct stat status;
+	if (stat(argument, &status) == 0 && S_ISDIR(status.st_mode))
+	{
+		DIR *directory = opendir(argument);
+		if (directory == NULL)
+		{
+			fprintf(stderr, "Cannot open directory %s\n", argument);
+			return ERROR_CANNOT_OPEN_FILE;
+		}
+		size_t first = inputs->count;
+		struct dirent *entry;
+		while (result == SUCCESS && (entry = readdir(directory)) != NULL)
+		{
+			if (has_png_extension(entry->d_name))
+			{
+				result = path_list_add(inputs, argument, entry->d_name);
+			}
+		}
+		closedir(directory);
+		qsort(inputs->items + first, inputs->count - first, sizeof(char *), compare_paths);
+		return result;
+	}
+#endif
+	return path_list_add(inputs, NULL, argument);
+}
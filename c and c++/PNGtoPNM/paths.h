@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+// Input files collected from the command line
+struct path_list
+{
+	char **items;
+	size_t count, capacity;
+};
+
+// Appends directory/name, or name alone when directory is NULL
+int path_list_add(struct path_list *list, const char *directory, const char *name);
+
+void path_list_free(struct path_list *list);
+
+int has_png_extension(const char *name);
+
+// An argument is a PNG file, a directory whose *.png files are taken in name order, or @list with one path per line
+int collect_inputs(struct path_list *inputs, const char *argument);
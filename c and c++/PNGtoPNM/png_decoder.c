@@ -0,0 +1,2841 @@
+#if !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include "png_decoder.h"
+
+#include "arena.h"
+#include "convert.h"
+#include "crc32.h"
+#include "inflater.h"
+#include "input.h"
+#include "return_codes.h"
+#include "unfilter.h"
+#include "xxh64.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else
+// stand-in for writev, the queued rows are written one by one with fwrite
+struct iovec
+{
+	void *iov_base;
+	size_t iov_len;
+};
+#endif
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#define MAX_PALETTE_LENGTH (256 * 3)
+#define IDAT_BUFF_LENGTH (64 * 1024)
+// rows written to a file are queued and go out with one writev per batch, which stays below IOV_MAX (1024 on Linux and macOS)
+#define OUTPUT_BATCH_BYTES (256 * 1024)
+#define OUTPUT_BATCH_ROWS 512
+
+static unsigned char IHDR_name[4] = { 0x49, 0x48, 0x44, 0x52 };
+static unsigned char length_req[4] = { 0x00, 0x00, 0x00, 0x0D };
+static unsigned char IDAT_name[4] = { 0x49, 0x44, 0x41, 0x54 };
+static unsigned char PLTE_name[4] = { 0x50, 0x4C, 0x54, 0x45 };
+static unsigned char IEND_name[4] = { 0x49, 0x45, 0x4E, 0x44 };
+static unsigned char acTL_name[4] = { 0x61, 0x63, 0x54, 0x4C };
+static unsigned char fcTL_name[4] = { 0x66, 0x63, 0x54, 0x4C };
+static unsigned char fdAT_name[4] = { 0x66, 0x64, 0x41, 0x54 };
+
+struct image_info
+{
+	int width, height;
+	unsigned char bit_depth, color_type;
+	int bits_per_pixel;
+	int bytes_per_pixel;	// rounded up to 1 for sub-byte pixels, which is what unfiltering works with
+	size_t bytes_per_row;
+	unsigned char palette[MAX_PALETTE_LENGTH];
+	unsigned int palette_length;
+	unsigned char palette_table[CONVERT_TABLE_SIZE];	// convert_build_table of the palette
+	int output_channels;	 // 1 for P5, 3 for P6, 2 and 4 for PAM with alpha
+	int output_pixel_size;
+	size_t output_row_length;
+	int scaled_width, scaled_height;	// of the written image, smaller than the image itself with --scale
+	size_t scaled_row_length;
+	int scale;	  // the box size of --scale 1/n, 0 for a box filter to a given size
+	int interlaced;
+};
+
+// A decoder with stats adds up the time of every stage on the thread that runs it
+struct stage_timer
+{
+	struct png_decode_stats *stats;
+	int cpu;	// also read the CPU clock of the thread, which is a system call rather than a vDSO read
+};
+
+struct stage_time
+{
+	double wall, cpu;
+};
+
+static struct stage_time stage_now(const struct stage_timer *timer)
+{
+	struct stage_time now = { 0, 0 };
+	struct timespec time;
+#if defined(HAVE_POSIX)
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	now.wall = (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+	if (timer->cpu)
+	{
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+		now.cpu = (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+	}
+#else
+	timespec_get(&time, TIME_UTC);
+	now.wall = (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+	if (timer->cpu)
+	{
+		now.cpu = (double)clock() / CLOCKS_PER_SEC;
+	}
+#endif
+	return now;
+}
+
+// timer is NULL for a decoder without stats, so a plain decode only pays for the test
+static struct stage_time stage_begin(const struct stage_timer *timer)
+{
+	struct stage_time none = { 0, 0 };
+	return timer != NULL ? stage_now(timer) : none;
+}
+
+// Adds the time since start to the stage and returns the start of whatever comes next
+static struct stage_time stage_lap(const struct stage_timer *timer, enum png_stage stage, struct stage_time start)
+{
+	if (timer == NULL)
+	{
+		return start;
+	}
+	struct stage_time now = stage_now(timer);
+	timer->stats->seconds[stage] += now.wall - start.wall;
+	timer->stats->cpu_seconds[stage] += now.cpu - start.cpu;
+	return now;
+}
+
+struct scaler;
+
+// Where the decoded rows go, either a PNM file or rows of a caller's buffer
+struct png_output
+{
+	FILE *file;
+	unsigned char *buffer;
+	size_t stride;
+	int row;	// the next one to be written
+	// A file gets its rows without stdio: they are queued where they lie and written together once batch_rows are queued.
+	// Rows that had to be converted are put into block, the others stay in the decode buffer until they are written
+	int fd;
+	struct iovec *queue;
+	int queued, batch_rows;
+	unsigned char *block;
+	struct scaler *scaler;	  // takes the rows first when the image is scaled down
+	// APNG frames blended over the canvas: the samples of a pixel, the last of which is alpha, and their size. Rows of the
+	// caller's buffer are then blended into rather than overwritten
+	int blend_channels, blend_sample_size;
+};
+
+// Row of the caller's buffer or of the batch block that the next row goes to, NULL when the row is written where it is
+static unsigned char *output_target(struct png_output *output, size_t length)
+{
+	if (output->file == NULL)
+	{
+		return output->blend_channels == 0 ? output->buffer + (size_t)output->row * output->stride : NULL;
+	}
+	return output->block != NULL ? output->block + (size_t)output->queued * length : NULL;
+}
+
+// Writes the queued rows, writev can stop anywhere in them
+static int output_flush(struct png_output *output)
+{
+	struct iovec *vector = output->queue;
+	int count = output->queued;
+	output->queued = 0;
+#if defined(HAVE_POSIX)
+	while (count > 0)
+	{
+		ssize_t written = writev(output->fd, vector, count);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			fprintf(stderr, "error while writing a file\n");
+			return ERROR_UNKNOWN;
+		}
+		for (; count > 0 && (size_t)written >= vector->iov_len; vector++, count--)
+		{
+			written -= vector->iov_len;
+		}
+		if (count > 0)
+		{
+			vector->iov_base = (unsigned char *)vector->iov_base + written;
+			vector->iov_len -= written;
+		}
+	}
+#else
+	for (int i = 0; i < count; i++)
+	{
+		if (fwrite(vector[i].iov_base, 1, vector[i].iov_len, output->file) != vector[i].iov_len)
+		{
+			fprintf(stderr, "error while writing a file\n");
+			return ERROR_UNKNOWN;
+		}
+	}
+#endif
+	return SUCCESS;
+}
+
+// APNG_BLEND_OP_OVER: the pixels are composed over the target with the formula of the APNG specification, which keeps
+// an opaque pixel and leaves the target alone under a fully transparent one
+static void blend_over(unsigned char *target, const unsigned char *pixels, size_t length, int channels, int sample_size)
+{
+	if (sample_size == 1)
+	{
+		for (size_t i = 0; i < length; i += channels)
+		{
+			unsigned int alpha = pixels[i + channels - 1];
+			if (alpha == 255)
+			{
+				memcpy(target + i, pixels + i, channels);
+			}
+			else if (alpha != 0)
+			{
+				// both weights are scaled by 255
+				unsigned int u = alpha * 255, v = (255 - alpha) * target[i + channels - 1], sum = u + v;
+				for (int c = 0; c < channels - 1; c++)
+				{
+					target[i + c] = (unsigned char)((pixels[i + c] * u + target[i + c] * v + sum / 2) / sum);
+				}
+				target[i + channels - 1] = (unsigned char)((sum + 127) / 255);
+			}
+		}
+		return;
+	}
+	size_t pixel_size = (size_t)channels * 2;
+	for (size_t i = 0; i < length; i += pixel_size)
+	{
+		const unsigned char *source = pixels + i;
+		unsigned char *destination = target + i;
+		uint64_t alpha = (uint64_t)source[pixel_size - 2] << 8 | source[pixel_size - 1];
+		if (alpha == 65535)
+		{
+			memcpy(destination, source, pixel_size);
+		}
+		else if (alpha != 0)
+		{
+			uint64_t target_alpha = (uint64_t)destination[pixel_size - 2] << 8 | destination[pixel_size - 1];
+			uint64_t u = alpha * 65535, v = (65535 - alpha) * target_alpha, sum = u + v;
+			for (size_t c = 0; c < pixel_size - 2; c += 2)
+			{
+				uint64_t value = (((uint64_t)source[c] << 8 | source[c + 1]) * u +
+								  ((uint64_t)destination[c] << 8 | destination[c + 1]) * v + sum / 2) / sum;
+				destination[c] = (unsigned char)(value >> 8);
+				destination[c + 1] = (unsigned char)value;
+			}
+			uint64_t value = (sum + 32767) / 65535;
+			destination[pixel_size - 2] = (unsigned char)(value >> 8);
+			destination[pixel_size - 1] = (unsigned char)value;
+		}
+	}
+}
+
+// pixels may already be the target row, then there is nothing left to copy. A file row must stay where it is until
+// output_flush, which happens by itself once a batch is full
+static int output_emit(struct png_output *output, const unsigned char *pixels, size_t length)
+{
+	if (output->file == NULL)
+	{
+		unsigned char *target = output->buffer + (size_t)output->row * output->stride;
+		if (output->blend_channels != 0)
+		{
+			blend_over(target, pixels, length, output->blend_channels, output->blend_sample_size);
+		}
+		else if (pixels != target)
+		{
+			memcpy(target, pixels, length);
+		}
+		output->row++;
+		return SUCCESS;
+	}
+	output->queue[output->queued].iov_base = (void *)pixels;
+	output->queue[output->queued].iov_len = length;
+	return ++output->queued == output->batch_rows ? output_flush(output) : SUCCESS;
+}
+
+// --scale: a box filter. Converted rows are added up column by column into a row of 32 bit sums, which are folded into the
+// output pixels at the end of every box. Only the scaled rows are ever stored
+struct scaler
+{
+	const struct image_info *image;
+	void (*fold)(struct scaler *scaler, unsigned char *target);
+	uint32_t *rows;	   // the samples of the rows added since the last fold, column by column
+	uint64_t *sums;
+	double *weights;	// 1 / the width of every output column
+	int *columns;	 // output column x averages the image columns columns[x] to columns[x + 1]
+	int row, box_start, box_end;	// the next image row and the rows of the current box
+	int scaled_row;
+	int pending;	// rows added since the last fold
+};
+
+// Rows added before they are folded, 65536 16 bit samples still fit into 32 bits
+#define SCALER_FOLD_ROWS 65536
+
+// First image column or row that output column or row index covers: boxes of scale pixels for --scale 1/n, the image
+// divided evenly for a given size
+static int box_start(int index, int scaled_size, int size, int scale)
+{
+	long long start = scale > 0 ? (long long)index * scale : (long long)index * size / scaled_size;
+	return start < size ? (int)start : size;
+}
+
+// Rounded average of a box through a reciprocal instead of a division. Adding half keeps the exact quotient at least
+// 0.5 / count away from an integer, far more than the rounding error of the product for boxes below 2^24 pixels
+static inline unsigned int box_average(uint64_t sum, uint64_t count, double weight)
+{
+	return count < (1u << 24) ? (unsigned int)(((double)(int64_t)(sum + count / 2) + 0.5) * weight) : (unsigned int)((sum + count / 2) / count);
+}
+
+// Folds the row sums into the sums of the output pixels, at the end of a box target receives their averages instead.
+// The channels are a compile time constant so that the loop over them unrolls
+#define DEFINE_SCALER_FOLD(CHANNELS)                                                                   \
+	static void scaler_fold_##CHANNELS(struct scaler *scaler, unsigned char *target)                   \
+	{                                                                                                  \
+		const struct image_info *image = scaler->image;                                                \
+		int rows = scaler->box_end - scaler->box_start;                                                \
+		double row_weight = 1.0 / rows;                                                                \
+		uint64_t *sum = scaler->sums;                                                                  \
+		const uint32_t *sample = scaler->rows;                                                         \
+		for (int x = 0; x < image->scaled_width; x++, sum += CHANNELS)                                 \
+		{                                                                                              \
+			uint64_t box[CHANNELS] = { 0 };                                                            \
+			for (int column = scaler->columns[x]; column < scaler->columns[x + 1]; column++)           \
+			{                                                                                          \
+				for (int c = 0; c < CHANNELS; c++)                                                     \
+				{                                                                                      \
+					box[c] += sample[c];                                                               \
+				}                                                                                      \
+				sample += CHANNELS;                                                                    \
+			}                                                                                          \
+			if (target == NULL)                                                                        \
+			{                                                                                          \
+				for (int c = 0; c < CHANNELS; c++)                                                     \
+				{                                                                                      \
+					sum[c] += box[c];                                                                  \
+				}                                                                                      \
+				continue;                                                                              \
+			}                                                                                          \
+			uint64_t count = (uint64_t)(scaler->columns[x + 1] - scaler->columns[x]) * rows;           \
+			double weight = scaler->weights[x] * row_weight;                                           \
+			for (int c = 0; c < CHANNELS; c++)                                                         \
+			{                                                                                          \
+				unsigned int value = box_average(sum[c] + box[c], count, weight);                      \
+				sum[c] = 0;                                                                            \
+				if (image->bit_depth == 16)                                                            \
+				{                                                                                      \
+					target[((size_t)x * CHANNELS + c) * 2] = (unsigned char)(value >> 8);              \
+					target[((size_t)x * CHANNELS + c) * 2 + 1] = (unsigned char)value;                 \
+				}                                                                                      \
+				else                                                                                   \
+				{                                                                                      \
+					target[(size_t)x * CHANNELS + c] = (unsigned char)value;                           \
+				}                                                                                      \
+			}                                                                                          \
+		}                                                                                              \
+		memset(scaler->rows, 0, (size_t)image->width * CHANNELS * sizeof(uint32_t));                   \
+		scaler->pending = 0;                                                                           \
+	}
+
+DEFINE_SCALER_FOLD(1)
+DEFINE_SCALER_FOLD(2)
+DEFINE_SCALER_FOLD(3)
+DEFINE_SCALER_FOLD(4)
+
+typedef void (*scaler_fold_function)(struct scaler *scaler, unsigned char *target);
+
+// Takes the place of output_emit while the image is scaled
+static int output_row(struct png_output *output, const unsigned char *pixels, size_t length)
+{
+	struct scaler *scaler = output->scaler;
+	if (scaler == NULL)
+	{
+		return output_emit(output, pixels, length);
+	}
+
+	const struct image_info *image = scaler->image;
+	convert_accumulate(scaler->rows, pixels, (size_t)image->width * image->output_channels, image->bit_depth == 16 ? 2 : 1);
+	scaler->pending++;
+	if (++scaler->row < scaler->box_end)
+	{
+		if (scaler->pending == SCALER_FOLD_ROWS)
+		{
+			scaler->fold(scaler, NULL);
+		}
+		return SUCCESS;
+	}
+
+	unsigned char *target = output_target(output, image->scaled_row_length);
+	scaler->fold(scaler, target);
+	scaler->scaled_row++;
+	scaler->box_start = scaler->box_end;
+	scaler->box_end = box_start(scaler->scaled_row + 1, image->scaled_height, image->height, image->scale);
+	return output_emit(output, target, image->scaled_row_length);
+}
+
+// Palette scanlines are unfiltered and expanded in one pass, all others are unfiltered and then converted
+struct row_kernels
+{
+	struct unfilter_kernels unfilter;
+	convert_function convert;
+	unfilter_convert_function fused[5];
+	int has_fused;
+};
+
+static void row_kernels_select(struct row_kernels *kernels, struct image_info *image)
+{
+	unfilter_select(&kernels->unfilter, image->bytes_per_pixel);
+	kernels->convert = convert_select(image->color_type, image->bit_depth, image->output_channels);
+	kernels->has_fused = convert_select_fused(kernels->fused, image->color_type, image->bit_depth, image->output_channels);
+}
+
+// row and previous_row start with the filter type byte, previous_row is all zeros for the first row. Returns the
+// converted pixels, which are either row + 1 itself or output_row, or NULL for an unknown filter type
+static unsigned char *decode_row(struct row_kernels *kernels, struct image_info *image, unsigned char *row, unsigned char *previous_row,
+								 size_t row_length, int width, unsigned char *output_row, struct stage_timer *timer)
+{
+	unsigned char filter_type = row[0];
+	if (filter_type > 4)
+	{
+		fprintf(stderr, "unknown filter type %x\n", filter_type);
+		return NULL;
+	}
+	struct stage_time start = stage_begin(timer);
+	if (kernels->has_fused)
+	{
+		kernels->fused[filter_type](row + 1, previous_row + 1, output_row, width, image->palette_table);
+		stage_lap(timer, PNG_STAGE_CONVERT, start);
+		return output_row;
+	}
+	kernels->unfilter.functions[filter_type](row + 1, previous_row + 1, row_length - 1, image->bytes_per_pixel);
+	start = stage_lap(timer, PNG_STAGE_UNFILTER, start);
+	unsigned char *pixels = kernels->convert(row + 1, output_row, width, image->palette_table);
+	stage_lap(timer, PNG_STAGE_CONVERT, start);
+	return pixels;
+}
+
+static int read_to_buff(struct png_input *input, unsigned char *buffer, unsigned int length)
+{
+	unsigned long read = input_read(input, buffer, length);
+	if (read != length)
+	{
+		fprintf(stderr, "error while reading a file\n");
+		return ERROR_DATA_INVALID;
+	}
+
+	return SUCCESS;
+}
+
+static int check_name(unsigned char *name, unsigned char *check_name, int length)
+{
+	for (int i = 0; i < length; i++)
+	{
+		if (name[i] != check_name[i])
+		{
+			return ERROR_DATA_INVALID;
+		}
+	}
+
+	return SUCCESS;
+}
+
+static uint32_t big_endian_32(const unsigned char *bytes)
+{
+	return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+static int check_IHDR_data(unsigned char bit_depth, unsigned char color_type, unsigned char compression_method, unsigned char filter_method, unsigned char interlace_method)
+{
+	int valid_depth;
+	switch (color_type)
+	{
+	case 0x00:
+		valid_depth = bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8 || bit_depth == 16;
+		break;
+	case 0x03:
+		valid_depth = bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8;
+		break;
+	case 0x02:
+	case 0x04:
+	case 0x06:
+		valid_depth = bit_depth == 8 || bit_depth == 16;
+		break;
+	default:
+		fprintf(stderr, "Invalid color type %x ! color type should be 0, 2, 3, 4 or 6\n", color_type);
+		return ERROR_DATA_INVALID;
+	}
+	if (!valid_depth)
+	{
+		fprintf(stderr, "Invalid bit depth %x for color type %x\n", bit_depth, color_type);
+		return ERROR_DATA_INVALID;
+	}
+
+	if (compression_method != 0x00)
+	{
+		fprintf(stderr, "Invalid compression method %x ! compression method should be 0\n", compression_method);
+		return ERROR_DATA_INVALID;
+	}
+	if (filter_method != 0x00)
+	{
+		fprintf(stderr, "Invalid filter method %x ! filter method should be 0\n", filter_method);
+		return ERROR_DATA_INVALID;
+	}
+	if (interlace_method != 0x00 && interlace_method != 0x01)
+	{
+		fprintf(stderr, "Invalid interlace method %x ! interlace method should be 0 or 1\n", interlace_method);
+		return ERROR_DATA_INVALID;
+	}
+	return SUCCESS;
+}
+
+static void describe_image(struct image_info *info, struct png_image *image)
+{
+	image->width = info->scaled_width;
+	image->height = info->scaled_height;
+	image->channels = info->output_channels;
+	image->sample_size = info->bit_depth == 16 ? 2 : 1;
+	image->maxval = info->color_type == 0x03 ? 255 : (1 << info->bit_depth) - 1;	  // palette colors are 8 bit whatever the indices
+	image->row_length = info->scaled_row_length;
+}
+
+// Returns the length of the header like fprintf
+static int write_header(FILE *output, struct image_info *info, int width, int height)
+{
+	struct png_image image;
+	char header[PNG_PNM_HEADER_SIZE];
+	describe_image(info, &image);
+	image.width = width;
+	image.height = height;
+	int length = png_decoder_pnm_header(&image, header, sizeof(header));
+	return fwrite(header, 1, length, output) == (size_t)length ? length : -1;
+}
+
+// Skips chunks until the one with the given name, on return buff holds its name and the crc of the chunk has been started
+static int search_for_chunk(struct png_input *input, unsigned char *name, unsigned char *buff, unsigned int *chunk_length)
+{
+	unsigned int len = *chunk_length;
+	if (check_name(name, IEND_name, 4) != SUCCESS)
+	{
+		if (read_to_buff(input, buff, 4) != SUCCESS)
+		{
+			return ERROR_DATA_INVALID;
+		}
+
+		len = big_endian_32(buff);
+
+		input_chunk_start(input);
+		if (read_to_buff(input, buff, 4) != SUCCESS)
+		{
+			return ERROR_DATA_INVALID;
+		}
+	}
+
+	while (check_name(buff, name, 4) != SUCCESS)
+	{
+		if (check_name(buff, PLTE_name, 4) == SUCCESS)
+		{
+			fprintf(stderr, "unexpected PLTE chunk\n");
+			return ERROR_DATA_INVALID;
+		}
+		if (check_name(buff, IDAT_name, 4) == SUCCESS)
+		{
+			fprintf(stderr, "unexpected IDAT chunk\n");
+			return ERROR_DATA_INVALID;
+		}
+
+		if (input_skip(input, len) != SUCCESS || input_chunk_end(input) != SUCCESS)
+		{
+			return ERROR_DATA_INVALID;
+		}
+		if (input_read(input, buff, 4) != 4)
+		{
+			return ERROR_DATA_INVALID;
+		}
+
+		len = big_endian_32(buff);
+
+		input_chunk_start(input);
+		if (input_read(input, buff, 4) != 4)
+		{
+			return ERROR_DATA_INVALID;
+		}
+	}
+	*chunk_length = len;
+	return SUCCESS;
+}
+
+struct scanlines;
+
+// Called for every complete scanline, must leave rows->current pointing at the buffer for the next one
+typedef int (*row_handler)(struct scanlines *rows, struct image_info *image, struct png_output *output);
+
+struct scanlines
+{
+	unsigned char *current, *previous, *output_row;
+	unsigned char *ring;	// ring_slots scanlines, current is slot number slot of them
+	int ring_slots, slot;
+	size_t row_length;	  // length of the current scanline with its filter type byte
+	size_t filled;
+	int row_index, row_count;
+	struct row_kernels kernels;
+	row_handler complete;
+	void *sink;	   // state of the row handler
+	struct stage_timer *timer;
+};
+
+// Default row handler, unfilters the row against the previous one and writes it out. The row is converted straight into
+// the caller's buffer or the batch block when there is one
+static int unfilter_row(struct scanlines *rows, struct image_info *image, struct png_output *output)
+{
+	unsigned char *target = output->scaler == NULL ? output_target(output, image->output_row_length) : NULL;
+	unsigned char *pixels = decode_row(&rows->kernels, image, rows->current, rows->previous, image->bytes_per_row, image->width,
+									   target != NULL ? target : rows->output_row, rows->timer);
+	if (pixels == NULL)
+	{
+		return ERROR_DATA_INVALID;
+	}
+	struct stage_time start = stage_begin(rows->timer);
+	int result = output_row(output, pixels, image->output_row_length);
+	stage_lap(rows->timer, PNG_STAGE_WRITE, start);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+
+	// the row may be queued for writing as it is, the next one goes to the following slot of the ring
+	rows->previous = rows->current;
+	rows->slot = rows->slot + 1 == rows->ring_slots ? 0 : rows->slot + 1;
+	rows->current = rows->ring + rows->slot * image->bytes_per_row;
+	return SUCCESS;
+}
+
+// Takes every complete scanline out of the inflater and hands it to the row handler
+static int drain_rows(struct inflater *inflater, struct png_output *output, struct image_info *image, struct scanlines *rows)
+{
+	size_t produced;
+	for (;;)
+	{
+		struct stage_time start = stage_begin(rows->timer);
+		if (rows->row_index == rows->row_count)
+		{
+			unsigned char extra;
+			if (inflater_run(inflater, &extra, 1, &produced) != SUCCESS)
+			{
+				return ERROR_DATA_INVALID;
+			}
+			stage_lap(rows->timer, PNG_STAGE_INFLATE, start);
+			if (produced != 0)
+			{
+				fprintf(stderr, "too much image data\n");
+				return ERROR_DATA_INVALID;
+			}
+			return SUCCESS;
+		}
+
+		if (inflater_run(inflater, rows->current + rows->filled, rows->row_length - rows->filled, &produced) != SUCCESS)
+		{
+			return ERROR_DATA_INVALID;
+		}
+		stage_lap(rows->timer, PNG_STAGE_INFLATE, start);
+		if (rows->timer != NULL)
+		{
+			rows->timer->stats->bytes_inflated += produced;
+		}
+		rows->filled += produced;
+		if (rows->filled < rows->row_length)
+		{
+			return SUCCESS;
+		}
+
+		rows->filled = 0;
+		rows->row_index++;
+		int result = rows->complete(rows, image, output);
+		if (result != SUCCESS)
+		{
+			return result;
+		}
+	}
+}
+
+// Adam7 passes: first column and row, then the distance between the columns and rows of each pass
+static const int adam7_x0[7] = { 0, 4, 0, 2, 0, 1, 0 };
+static const int adam7_y0[7] = { 0, 0, 4, 0, 2, 0, 1 };
+static const int adam7_dx[7] = { 8, 8, 4, 4, 2, 2, 1 };
+static const int adam7_dy[7] = { 8, 8, 8, 4, 4, 2, 2 };
+
+// Number of scanlines in a pass, passes without columns have no scanlines at all
+static int adam7_pass_height(struct image_info *image, int pass)
+{
+	if (image->width <= adam7_x0[pass] || image->height <= adam7_y0[pass])
+	{
+		return 0;
+	}
+	return (image->height - adam7_y0[pass] + adam7_dy[pass] - 1) / adam7_dy[pass];
+}
+
+static int adam7_pass_width(struct image_info *image, int pass)
+{
+	return (image->width - adam7_x0[pass] + adam7_dx[pass] - 1) / adam7_dx[pass];
+}
+
+struct adam7
+{
+	unsigned char *pixels;	  // the whole converted image, a file can only be written once the last pass is done
+	size_t stride;
+	int pass, pass_row, pass_width, pass_height;
+	const char *preview_name;
+};
+
+// Writes every 4th pixel of every 4th row, which is exactly what passes 1 to 3 have filled in
+static int adam7_preview(struct adam7 *adam7, struct image_info *image, unsigned char *row)
+{
+	FILE *preview = fopen(adam7->preview_name, "wb");
+	if (preview == NULL)
+	{
+		fprintf(stderr, "cannot open file %s\n", adam7->preview_name);
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+
+	int pixel_size = image->output_pixel_size;
+	int width = (image->width + 3) / 4, height = (image->height + 3) / 4;
+	write_header(preview, image, width, height);
+	for (int y = 0; y < image->height; y += 4)
+	{
+		const unsigned char *source = adam7->pixels + y * adam7->stride;
+		for (int x = 0; x < width; x++)
+		{
+			memcpy(row + x * pixel_size, source + 4 * x * pixel_size, pixel_size);
+		}
+		fwrite(row, 1, (size_t)width * pixel_size, preview);
+	}
+	int failed = ferror(preview);
+	if (fclose(preview) != 0 || failed)
+	{
+		fprintf(stderr, "error while writing a file\n");
+		return ERROR_UNKNOWN;
+	}
+	return SUCCESS;
+}
+
+// Moves on to the next pass that has any scanlines, a pass starts again from an all zero previous row
+static int adam7_next_pass(struct adam7 *adam7, struct image_info *image, struct scanlines *rows)
+{
+	int previous_pass = adam7->pass;
+	do
+	{
+		adam7->pass++;
+	} while (adam7->pass < 7 && adam7_pass_height(image, adam7->pass) == 0);
+
+	if (adam7->preview_name != NULL && previous_pass < 3 && adam7->pass >= 3)
+	{
+		struct stage_time start = stage_begin(rows->timer);
+		int result = adam7_preview(adam7, image, rows->output_row);
+		if (result != SUCCESS)
+		{
+			return result;
+		}
+		stage_lap(rows->timer, PNG_STAGE_WRITE, start);
+	}
+	if (adam7->pass < 7)
+	{
+		adam7->pass_row = 0;
+		adam7->pass_width = adam7_pass_width(image, adam7->pass);
+		adam7->pass_height = adam7_pass_height(image, adam7->pass);
+		rows->row_length = ((size_t)adam7->pass_width * image->bits_per_pixel + 7) / 8 + 1;
+		memset(rows->previous, 0, rows->row_length);
+	}
+	return SUCCESS;
+}
+
+// Scatters the converted pixels of one pass row to every step-th pixel of the image row
+static void adam7_scatter(unsigned char *destination, const unsigned char *pixels, int count, int step, int pixel_size)
+{
+	if (step == 1)
+	{
+		memcpy(destination, pixels, (size_t)count * pixel_size);
+	}
+	else if (pixel_size == 1)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			destination[i * step] = pixels[i];
+		}
+	}
+	else if (pixel_size == 3)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			unsigned char *pixel = destination + i * step * 3;
+			pixel[0] = pixels[3 * i];
+			pixel[1] = pixels[3 * i + 1];
+			pixel[2] = pixels[3 * i + 2];
+		}
+	}
+	else
+	{
+		for (int i = 0; i < count; i++)
+		{
+			memcpy(destination + (size_t)i * step * pixel_size, pixels + (size_t)i * pixel_size, pixel_size);
+		}
+	}
+}
+
+// Row handler for interlaced images, unfilters a pass row and puts its pixels in place
+static int adam7_row(struct scanlines *rows, struct image_info *image, struct png_output *output)
+{
+	struct adam7 *adam7 = rows->sink;
+	(void)output;
+
+	unsigned char *pixels =
+		decode_row(&rows->kernels, image, rows->current, rows->previous, rows->row_length, adam7->pass_width, rows->output_row, rows->timer);
+	if (pixels == NULL)
+	{
+		return ERROR_DATA_INVALID;
+	}
+	struct stage_time start = stage_begin(rows->timer);
+	int pixel_size = image->output_pixel_size;
+	int pass = adam7->pass;
+	unsigned char *destination = adam7->pixels + (size_t)(adam7_y0[pass] + adam7->pass_row * adam7_dy[pass]) * adam7->stride +
+								 (size_t)adam7_x0[pass] * pixel_size;
+	adam7_scatter(destination, pixels, adam7->pass_width, adam7_dx[pass], pixel_size);
+	stage_lap(rows->timer, PNG_STAGE_WRITE, start);
+
+	unsigned char *temp = rows->previous;
+	rows->previous = rows->current;
+	rows->current = temp;
+	if (++adam7->pass_row == adam7->pass_height)
+	{
+		return adam7_next_pass(adam7, image, rows);
+	}
+	return SUCCESS;
+}
+
+#if defined(HAVE_POSIX)
+// --pipeline: the calling thread inflates into a ring of row blocks, one thread unfilters and converts finished blocks and
+// another writes them out. Blocks only come back to the inflater once they are written, which bounds memory and provides
+// the back pressure between the stages.
+#define PIPELINE_BLOCKS 8
+#define PIPELINE_BLOCK_SIZE (256 * 1024)
+
+struct row_block
+{
+	unsigned char *raw, *pixels;
+	unsigned char **row_pixels;
+	int rows;
+	int last;
+};
+
+struct block_queue
+{
+	int items[PIPELINE_BLOCKS];
+	int head, count;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+};
+
+struct pipeline
+{
+	struct image_info *image;
+	struct png_output *output;
+	struct row_block blocks[PIPELINE_BLOCKS];
+	struct block_queue free_blocks, inflated, unfiltered;
+	int rows_per_block;
+	int current;
+	unsigned char *previous_row;
+	int result;	   // first error of any stage
+	pthread_mutex_t result_lock;
+	pthread_t unfilter_thread, write_thread;
+	int threads;
+	struct stage_timer *timer;	  // every stage adds to its own entries only
+	double thread_cpu[2];		  // CPU time of the unfilter and write threads
+};
+
+static void queue_init(struct block_queue *queue)
+{
+	queue->head = queue->count = 0;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->ready, NULL);
+}
+
+static void queue_destroy(struct block_queue *queue)
+{
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->ready);
+}
+
+// There are only PIPELINE_BLOCKS blocks in flight, so a queue can never overflow
+static void queue_push(struct block_queue *queue, int block)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->items[(queue->head + queue->count++) % PIPELINE_BLOCKS] = block;
+	pthread_cond_signal(&queue->ready);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static int queue_pop(struct block_queue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == 0)
+	{
+		pthread_cond_wait(&queue->ready, &queue->lock);
+	}
+	int block = queue->items[queue->head];
+	queue->head = (queue->head + 1) % PIPELINE_BLOCKS;
+	queue->count--;
+	pthread_mutex_unlock(&queue->lock);
+	return block;
+}
+
+static int pipeline_result(struct pipeline *pipeline)
+{
+	pthread_mutex_lock(&pipeline->result_lock);
+	int result = pipeline->result;
+	pthread_mutex_unlock(&pipeline->result_lock);
+	return result;
+}
+
+static void pipeline_fail(struct pipeline *pipeline, int result)
+{
+	pthread_mutex_lock(&pipeline->result_lock);
+	if (pipeline->result == SUCCESS)
+	{
+		pipeline->result = result;
+	}
+	pthread_mutex_unlock(&pipeline->result_lock);
+}
+
+// A stage thread only lives for one image, so its CPU clock is the CPU time it spent on the image
+static void pipeline_thread_done(struct pipeline *pipeline, int thread)
+{
+	if (pipeline->timer != NULL && pipeline->timer->cpu)
+	{
+		pipeline->thread_cpu[thread] = stage_now(pipeline->timer).cpu;
+	}
+}
+
+// After a failure the stages keep passing blocks along without working on them, so that the last block still gets through
+static void *pipeline_unfilter(void *argument)
+{
+	struct pipeline *pipeline = argument;
+	struct image_info *image = pipeline->image;
+	struct row_kernels kernels;
+	row_kernels_select(&kernels, image);
+
+	for (;;)
+	{
+		int index = queue_pop(&pipeline->inflated);
+		struct row_block *block = &pipeline->blocks[index];
+		unsigned char *previous = pipeline->previous_row;
+
+		for (int r = 0; r < block->rows && pipeline_result(pipeline) == SUCCESS; r++)
+		{
+			unsigned char *row = block->raw + r * image->bytes_per_row;
+			block->row_pixels[r] = decode_row(&kernels, image, row, previous, image->bytes_per_row, image->width,
+											  block->pixels + r * image->output_row_length, pipeline->timer);
+			if (block->row_pixels[r] == NULL)
+			{
+				pipeline_fail(pipeline, ERROR_DATA_INVALID);
+				break;
+			}
+			previous = row;
+		}
+		// the block goes back to the inflater once it is written, so the row the next block refers to is kept aside
+		if (previous != pipeline->previous_row)
+		{
+			memcpy(pipeline->previous_row, previous, image->bytes_per_row);
+		}
+
+		int last = block->last;
+		queue_push(&pipeline->unfiltered, index);
+		if (last)
+		{
+			pipeline_thread_done(pipeline, 0);
+			return NULL;
+		}
+	}
+}
+
+static void *pipeline_write(void *argument)
+{
+	struct pipeline *pipeline = argument;
+	size_t length = pipeline->image->output_row_length;
+
+	for (;;)
+	{
+		int index = queue_pop(&pipeline->unfiltered);
+		struct row_block *block = &pipeline->blocks[index];
+
+		struct stage_time start = stage_begin(pipeline->timer);
+		for (int r = 0; r < block->rows && pipeline_result(pipeline) == SUCCESS; r++)
+		{
+			int result = output_row(pipeline->output, block->row_pixels[r], length);
+			if (result != SUCCESS)
+			{
+				pipeline_fail(pipeline, result);
+			}
+		}
+		// the queued rows point into the block, which can only go back once they are written
+		if (pipeline_result(pipeline) == SUCCESS)
+		{
+			int result = output_flush(pipeline->output);
+			if (result != SUCCESS)
+			{
+				pipeline_fail(pipeline, result);
+			}
+		}
+		stage_lap(pipeline->timer, PNG_STAGE_WRITE, start);
+
+		int last = block->last;
+		queue_push(&pipeline->free_blocks, index);
+		if (last)
+		{
+			pipeline_thread_done(pipeline, 1);
+			return NULL;
+		}
+	}
+}
+
+// Row handler of the inflate stage, a finished row only moves the write position on within the current block
+static int pipeline_row(struct scanlines *rows, struct image_info *image, struct png_output *output)
+{
+	struct pipeline *pipeline = rows->sink;
+	struct row_block *block = &pipeline->blocks[pipeline->current];
+	(void)output;
+
+	if (++block->rows == pipeline->rows_per_block)
+	{
+		queue_push(&pipeline->inflated, pipeline->current);
+		pipeline->current = queue_pop(&pipeline->free_blocks);
+		block = &pipeline->blocks[pipeline->current];
+		block->rows = 0;
+	}
+	rows->current = block->raw + block->rows * image->bytes_per_row;
+	return pipeline_result(pipeline);
+}
+
+// Sends the partly filled block down as the last one, waits for the other stages and frees the pipeline
+static int pipeline_finish(struct pipeline *pipeline, int result)
+{
+	if (result != SUCCESS)
+	{
+		pipeline_fail(pipeline, result);
+	}
+	if (pipeline->threads > 0)
+	{
+		pipeline->blocks[pipeline->current].last = 1;
+		queue_push(&pipeline->inflated, pipeline->current);
+		pthread_join(pipeline->unfilter_thread, NULL);
+	}
+	if (pipeline->threads > 1)
+	{
+		pthread_join(pipeline->write_thread, NULL);
+	}
+
+	if (pipeline->timer != NULL)
+	{
+		pipeline->timer->stats->total_cpu_seconds += pipeline->thread_cpu[0] + pipeline->thread_cpu[1];
+	}
+	result = pipeline->result;
+	queue_destroy(&pipeline->free_blocks);
+	queue_destroy(&pipeline->inflated);
+	queue_destroy(&pipeline->unfiltered);
+	pthread_mutex_destroy(&pipeline->result_lock);
+	return result;
+}
+
+static int pipeline_rows_per_block(const struct image_info *image)
+{
+	size_t rows = PIPELINE_BLOCK_SIZE / image->bytes_per_row;
+	return rows < 1 ? 1 : rows > (size_t)image->height ? image->height : (int)rows;
+}
+
+// Row pointers, the blocks and the previous row
+static size_t pipeline_memory_size(const struct image_info *image)
+{
+	size_t rows = pipeline_rows_per_block(image);
+	return PIPELINE_BLOCKS * rows * (sizeof(unsigned char *) + image->bytes_per_row + image->output_row_length) + image->bytes_per_row;
+}
+
+// memory holds pipeline_memory_size bytes. On failure everything is released again and pipeline_finish must not be called
+static int pipeline_start(struct pipeline *pipeline, struct image_info *image, struct png_output *output, struct scanlines *rows,
+						  unsigned char *memory)
+{
+	memset(pipeline, 0, sizeof(*pipeline));
+	pipeline->image = image;
+	pipeline->output = output;
+	pipeline->timer = rows->timer;
+	pipeline->rows_per_block = pipeline_rows_per_block(image);
+
+	size_t raw_size = pipeline->rows_per_block * image->bytes_per_row;
+	size_t pixels_size = pipeline->rows_per_block * image->output_row_length;
+	unsigned char **row_pointers = (unsigned char **)memory;
+	memory += PIPELINE_BLOCKS * pipeline->rows_per_block * sizeof(unsigned char *);
+	pipeline->previous_row = memory + PIPELINE_BLOCKS * (raw_size + pixels_size);
+	memset(pipeline->previous_row, 0, image->bytes_per_row);
+
+	queue_init(&pipeline->free_blocks);
+	queue_init(&pipeline->inflated);
+	queue_init(&pipeline->unfiltered);
+	pthread_mutex_init(&pipeline->result_lock, NULL);
+	for (int i = 0; i < PIPELINE_BLOCKS; i++)
+	{
+		pipeline->blocks[i].raw = memory + i * (raw_size + pixels_size);
+		pipeline->blocks[i].pixels = pipeline->blocks[i].raw + raw_size;
+		pipeline->blocks[i].row_pixels = row_pointers + i * pipeline->rows_per_block;
+		if (i > 0)
+		{
+			queue_push(&pipeline->free_blocks, i);
+		}
+	}
+
+	if (pthread_create(&pipeline->unfilter_thread, NULL, pipeline_unfilter, pipeline) != 0)
+	{
+		fprintf(stderr, "failed to start a thread\n");
+		return pipeline_finish(pipeline, ERROR_UNKNOWN);
+	}
+	pipeline->threads++;
+	if (pthread_create(&pipeline->write_thread, NULL, pipeline_write, pipeline) != 0)
+	{
+		fprintf(stderr, "failed to start a thread\n");
+		return pipeline_finish(pipeline, ERROR_UNKNOWN);
+	}
+	pipeline->threads++;
+
+	rows->current = pipeline->blocks[0].raw;
+	rows->complete = pipeline_row;
+	rows->sink = pipeline;
+	return SUCCESS;
+}
+#endif
+
+struct IDAT_span
+{
+	const unsigned char *data;
+	unsigned int length;
+};
+
+// Everything that can be reused from one image to the next
+struct png_decoder
+{
+	struct inflater *inflater;
+	struct arena arena;	   // every buffer of the current image but the spans
+	unsigned char *IDAT_data;	 // in the arena while a streamed input is decoded
+	struct IDAT_span *spans;
+	size_t spans_capacity;
+	struct scaler scaler;
+	struct png_decode_options options;
+	struct image_info image;
+	struct png_decode_stats stats;
+	struct stage_timer timer;
+	size_t heap_bytes;	  // held by the arena, the spans and the inflater
+	size_t inflater_bytes;
+	unsigned int inflater_allocations;
+	int fdAT;	 // decode_IDAT reads the fdAT chunks of an APNG frame, whose data follows a sequence number
+	unsigned int sequence;	  // the next sequence number of the fcTL and fdAT chunks
+};
+
+// The chunks decode_IDAT takes the compressed data from
+static unsigned char *data_name(const struct png_decoder *decoder)
+{
+	return decoder->fdAT ? fdAT_name : IDAT_name;
+}
+
+// fcTL and fdAT chunks are numbered in the order they appear in, starting at 0
+static int check_sequence(struct png_decoder *decoder, const unsigned char *number)
+{
+	if (big_endian_32(number) != decoder->sequence++)
+	{
+		fprintf(stderr, "APNG chunk out of sequence\n");
+		return ERROR_DATA_INVALID;
+	}
+	return SUCCESS;
+}
+
+// NULL unless the decoder keeps stats
+static struct stage_timer *decoder_timer(struct png_decoder *decoder)
+{
+	return decoder->options.stats != PNG_STATS_OFF ? &decoder->timer : NULL;
+}
+
+// Every buffer the decoder allocates, grows or frees goes through here for the heap stats, allocations also count as
+// reallocs
+static void heap_change(struct png_decoder *decoder, size_t freed, size_t allocated, unsigned int allocations)
+{
+	decoder->heap_bytes = decoder->heap_bytes - freed + allocated;
+	if (decoder->heap_bytes > decoder->stats.peak_heap)
+	{
+		decoder->stats.peak_heap = decoder->heap_bytes;
+	}
+	decoder->stats.reallocs += allocations;
+}
+
+// The memory limit applies to everything the decoder holds, an image is turned down before any of its data is read when
+// its arena alone would go over it
+static int check_memory_limit(struct png_decoder *decoder, size_t bytes)
+{
+	size_t limit = decoder->options.memory_limit;
+	if (bytes == SIZE_MAX || (limit != 0 && bytes > limit))
+	{
+		fprintf(stderr, "the image needs more memory than the limit of %zu bytes\n", limit);
+		return ERROR_OUT_OF_MEMORY;
+	}
+	return SUCCESS;
+}
+
+// Empties the arena for an image whose buffers take size bytes
+static int arena_begin(struct png_decoder *decoder, size_t size)
+{
+	int result = check_memory_limit(decoder, size);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	size_t capacity = decoder->arena.capacity;
+	result = arena_reserve(&decoder->arena, size);
+	heap_change(decoder, capacity, decoder->arena.capacity, decoder->arena.capacity > capacity);
+	return result;
+}
+
+// Records where the run of IDAT chunks starting with the current one lies in a mapped input, without copying any of it
+static int index_IDAT(struct png_input *input, unsigned char *buff, unsigned int *chunk_length, struct png_decoder *decoder, size_t *count)
+{
+	*count = 0;
+	while (check_name(buff, data_name(decoder), 4) == SUCCESS)
+	{
+		if (*count == decoder->spans_capacity)
+		{
+			size_t capacity = decoder->spans_capacity ? decoder->spans_capacity * 2 : 16;
+			struct IDAT_span *temp = realloc(decoder->spans, capacity * sizeof(struct IDAT_span));
+			if (temp == NULL)
+			{
+				fprintf(stderr, "out of memory\n");
+				return ERROR_OUT_OF_MEMORY;
+			}
+			heap_change(decoder, decoder->spans_capacity * sizeof(struct IDAT_span), capacity * sizeof(struct IDAT_span), 1);
+			decoder->spans = temp;
+			decoder->spans_capacity = capacity;
+		}
+
+		// payload and crc, the crc is checked right before the payload is inflated
+		const unsigned char *data = input_span(input, (size_t)*chunk_length + 4);
+		if (data == NULL)
+		{
+			fprintf(stderr, "error while reading a file\n");
+			return ERROR_DATA_INVALID;
+		}
+		if (decoder->fdAT)
+		{
+			if (*chunk_length < 4 || check_sequence(decoder, data) != SUCCESS)
+			{
+				return ERROR_DATA_INVALID;
+			}
+			data += 4;
+			*chunk_length -= 4;
+		}
+		decoder->spans[*count].data = data;
+		decoder->spans[*count].length = *chunk_length;
+		(*count)++;
+
+		if (read_to_buff(input, buff, 4) != SUCCESS)
+		{
+			return ERROR_DATA_INVALID;
+		}
+		*chunk_length = big_endian_32(buff);
+		input_chunk_start(input);
+		if (read_to_buff(input, buff, 4) != SUCCESS)
+		{
+			return ERROR_DATA_INVALID;
+		}
+	}
+	return SUCCESS;
+}
+
+// Inflates the spans index_IDAT found
+static int feed_mapped_IDAT(struct png_input *input, struct png_output *output, struct image_info *image, size_t count,
+							struct png_decoder *decoder, struct scanlines *rows)
+{
+	int result = SUCCESS;
+	for (size_t i = 0; result == SUCCESS && i < count; i++)
+	{
+		const unsigned char *data = decoder->spans[i].data;
+		unsigned int length = decoder->spans[i].length;
+		if (input->verify)
+		{
+			struct stage_time start = stage_begin(rows->timer);
+			// the crc of an fdAT chunk covers its sequence number as well
+			const unsigned char *stored = data + length;
+			int skip = decoder->fdAT ? 4 : 0;
+			uint32_t crc = crc32_update(crc32_update(0, data_name(decoder), 4), data - skip, length + skip);
+			if (crc != ((uint32_t)stored[0] << 24 | (uint32_t)stored[1] << 16 | (uint32_t)stored[2] << 8 | stored[3]))
+			{
+				fprintf(stderr, "chunk crc mismatch\n");
+				return ERROR_DATA_INVALID;
+			}
+			stage_lap(rows->timer, PNG_STAGE_PARSE, start);
+		}
+		if ((result = inflater_input(decoder->inflater, data, length, 1)) == SUCCESS)
+		{
+			result = drain_rows(decoder->inflater, output, image, rows);
+		}
+	}
+	return result;
+}
+
+static int feed_streamed_IDAT(struct png_input *input, struct png_output *output, struct image_info *image, unsigned char *buff,
+							  unsigned int *chunk_length, struct png_decoder *decoder, struct scanlines *rows)
+{
+	int result = SUCCESS;
+	while (result == SUCCESS && check_name(buff, data_name(decoder), 4) == SUCCESS)
+	{
+		unsigned int left = *chunk_length;
+		if (decoder->fdAT)
+		{
+			unsigned char number[4];
+			if (left < 4 || read_to_buff(input, number, 4) != SUCCESS || check_sequence(decoder, number) != SUCCESS)
+			{
+				return ERROR_DATA_INVALID;
+			}
+			left -= 4;
+		}
+		while (result == SUCCESS && left > 0)
+		{
+			unsigned int bytes_to_read = left < IDAT_BUFF_LENGTH ? left : IDAT_BUFF_LENGTH;
+			struct stage_time start = stage_begin(rows->timer);
+			if (read_to_buff(input, decoder->IDAT_data, bytes_to_read) != SUCCESS)
+			{
+				return ERROR_DATA_INVALID;
+			}
+			stage_lap(rows->timer, PNG_STAGE_PARSE, start);
+			left -= bytes_to_read;
+
+			if ((result = inflater_input(decoder->inflater, decoder->IDAT_data, bytes_to_read, 0)) == SUCCESS)
+			{
+				result = drain_rows(decoder->inflater, output, image, rows);
+			}
+		}
+		if (result != SUCCESS)
+		{
+			return result;
+		}
+		decoder->stats.IDAT_chunks++;
+
+		// crc, then the length and name of the next chunk
+		struct stage_time start = stage_begin(rows->timer);
+		if (input_chunk_end(input) != SUCCESS || read_to_buff(input, buff, 4) != SUCCESS)
+		{
+			return ERROR_DATA_INVALID;
+		}
+		*chunk_length = big_endian_32(buff);
+		input_chunk_start(input);
+		if (read_to_buff(input, buff, 4) != SUCCESS)
+		{
+			return ERROR_DATA_INVALID;
+		}
+		stage_lap(rows->timer, PNG_STAGE_PARSE, start);
+	}
+	return result;
+}
+
+// Sums, weights, row sums and columns of the scaler
+static size_t scaler_memory_size(const struct image_info *image)
+{
+	return (size_t)image->scaled_width * image->output_channels * sizeof(uint64_t) + (size_t)image->scaled_width * sizeof(double) +
+		   (size_t)image->width * image->output_channels * sizeof(uint32_t) + ((size_t)image->scaled_width + 1) * sizeof(int);
+}
+
+// Points the output at a scaler for an image that --scale shrinks, memory holds scaler_memory_size bytes
+static void scaler_start(struct scaler *scaler, struct image_info *image, struct png_output *output, unsigned char *memory)
+{
+	static const scaler_fold_function fold[4] = { scaler_fold_1, scaler_fold_2, scaler_fold_3, scaler_fold_4 };
+	int channels = image->output_channels;
+	size_t sums_size = (size_t)image->scaled_width * channels * sizeof(uint64_t);
+	size_t weights_size = (size_t)image->scaled_width * sizeof(double);
+	size_t rows_size = (size_t)image->width * channels * sizeof(uint32_t);
+	memset(scaler, 0, sizeof(*scaler));
+	scaler->image = image;
+	scaler->fold = fold[channels - 1];
+	scaler->sums = (uint64_t *)memory;
+	scaler->weights = (double *)(memory + sums_size);
+	scaler->rows = (uint32_t *)(memory + sums_size + weights_size);
+	scaler->columns = (int *)(memory + sums_size + weights_size + rows_size);
+	memset(scaler->sums, 0, sums_size);
+	memset(scaler->rows, 0, rows_size);
+	for (int x = 0; x <= image->scaled_width; x++)
+	{
+		scaler->columns[x] = box_start(x, image->scaled_width, image->width, image->scale);
+	}
+	for (int x = 0; x < image->scaled_width; x++)
+	{
+		scaler->weights[x] = 1.0 / (scaler->columns[x + 1] - scaler->columns[x]);
+	}
+	scaler->box_end = box_start(1, image->scaled_height, image->height, image->scale);
+	output->scaler = scaler;
+}
+
+// Decodes the IDAT chunks starting with the one whose name is in buff, on return buff holds the name of the next chunk
+static int decode_IDAT(struct png_decoder *decoder, struct png_input *input, struct png_output *output, struct image_info *image,
+					   unsigned char *buff, unsigned int *chunk_length)
+{
+	struct scanlines rows = { 0 };
+	int result;
+	row_kernels_select(&rows.kernels, image);
+	rows.ring_slots = 2;
+	int scaled = image->scaled_width != image->width || image->scaled_height != image->height;
+#if defined(HAVE_POSIX)
+	// an interlaced image is only written once it is complete, there is nothing to overlap
+	int pipelined = decoder->options.pipelined && !image->interlaced;
+#endif
+	size_t batch_rows = 0, queue_size = 0, block_size = 0;
+	if (output->file != NULL)
+	{
+		// rows that need no conversion are written from the scanline ring, which then holds a batch plus the row being
+		// inflated; the others are converted or scaled into a block of a batch of rows. The pipeline converts into its
+		// own blocks and an interlaced image goes out in one piece, neither needs more than the queue unless it is scaled
+		int by_row = !image->interlaced && !decoder->options.pipelined;
+		int copy = by_row && !scaled && !rows.kernels.has_fused && convert_is_copy(rows.kernels.convert);
+		int block = (by_row && !copy) || scaled;
+		batch_rows = OUTPUT_BATCH_BYTES / image->scaled_row_length;
+		batch_rows = batch_rows < 1 ? 1 : batch_rows > OUTPUT_BATCH_ROWS ? OUTPUT_BATCH_ROWS : batch_rows;
+		batch_rows = batch_rows > (size_t)image->scaled_height ? (size_t)image->scaled_height : batch_rows;
+		queue_size = batch_rows * sizeof(struct iovec);
+		block_size = block ? batch_rows * image->scaled_row_length : 0;
+		rows.ring_slots = copy ? (int)batch_rows + 1 : 2;
+	}
+	// passes are scattered straight into a caller's buffer, otherwise the interlaced image is put together in the arena
+	int whole_image = image->interlaced && (output->file != NULL || scaled || output->blend_channels != 0);
+
+	// the buffers are laid out in the arena in the order they are taken below
+	size_t ring_size = (size_t)rows.ring_slots > SIZE_MAX / image->bytes_per_row ? SIZE_MAX : rows.ring_slots * image->bytes_per_row;
+	size_t image_size = !whole_image ? 0
+					   : (size_t)image->height > SIZE_MAX / image->output_row_length ? SIZE_MAX
+																					 : image->output_row_length * image->height;
+	size_t size = arena_add(arena_add(arena_add(0, ring_size), image->output_row_length), image_size);
+	size = arena_add(arena_add(size, queue_size), block_size);
+	size = arena_add(size, scaled ? scaler_memory_size(image) : 0);
+	size = arena_add(size, input->map == NULL ? IDAT_BUFF_LENGTH : 0);
+#if defined(HAVE_POSIX)
+	size = arena_add(size, pipelined ? pipeline_memory_size(image) : 0);
+#endif
+	if ((result = arena_begin(decoder, size)) != SUCCESS)
+	{
+		return result;
+	}
+	struct arena *arena = &decoder->arena;
+	rows.ring = arena_take(arena, ring_size);
+	rows.output_row = arena_take(arena, image->output_row_length);
+	unsigned char *image_memory = arena_take(arena, image_size);
+	output->queue = (struct iovec *)arena_take(arena, queue_size);
+	output->batch_rows = (int)batch_rows;
+	output->block = block_size != 0 ? arena_take(arena, block_size) : NULL;
+	output->scaler = NULL;
+	if (scaled)
+	{
+		scaler_start(&decoder->scaler, image, output, arena_take(arena, scaler_memory_size(image)));
+	}
+	decoder->IDAT_data = input->map == NULL ? arena_take(arena, IDAT_BUFF_LENGTH) : NULL;
+
+	rows.current = rows.ring;
+	rows.previous = rows.ring + (rows.ring_slots - 1) * image->bytes_per_row;
+	memset(rows.previous, 0, image->bytes_per_row);
+	rows.complete = unfilter_row;
+	rows.row_length = image->bytes_per_row;
+	rows.row_count = image->height;
+	rows.timer = decoder_timer(decoder);
+	size_t raw_size = image->bytes_per_row * image->height;
+
+	struct adam7 adam7 = { 0 };
+	if (image->interlaced)
+	{
+		adam7.pixels = whole_image ? image_memory : output->buffer;
+		adam7.stride = whole_image ? image->output_row_length : output->stride;
+		adam7.preview_name = decoder->options.preview_name;
+		rows.row_count = 0;
+		raw_size = 0;
+		for (int pass = 0; pass < 7; pass++)
+		{
+			int height = adam7_pass_height(image, pass);
+			rows.row_count += height;
+			raw_size += height * (((size_t)adam7_pass_width(image, pass) * image->bits_per_pixel + 7) / 8 + 1);
+		}
+		adam7.pass = -1;
+		adam7_next_pass(&adam7, image, &rows);
+		rows.complete = adam7_row;
+		rows.sink = &adam7;
+	}
+	else if (decoder->options.preview_name != NULL)
+	{
+		// says so rather than exit 0 with nothing written, and does not leave an older preview behind
+		fprintf(stderr, "warning: no preview written to %s, only Adam7 interlaced images have one\n", decoder->options.preview_name);
+		remove(decoder->options.preview_name);
+	}
+
+	// a mapped input is indexed up front, which tells the inflater how much data there is
+	size_t count = 0, compressed_size = 0, restarts = 0;
+	if (input->map != NULL)
+	{
+		struct stage_time start = stage_begin(rows.timer);
+		if ((result = index_IDAT(input, buff, chunk_length, decoder, &count)) != SUCCESS)
+		{
+			return result;
+		}
+		stage_lap(rows.timer, PNG_STAGE_PARSE, start);
+		for (size_t i = 0; i < count; i++)
+		{
+			compressed_size += decoder->spans[i].length;
+			restarts += i > 0 && inflater_restart_point(decoder->spans[i - 1].data, decoder->spans[i - 1].length);
+		}
+		decoder->stats.IDAT_chunks += count;
+	}
+
+#if defined(HAVE_POSIX)
+	if (pipelined)
+	{
+		// the pipeline needs rows while the data is still coming in
+		compressed_size = 0;
+	}
+#endif
+	// an encoder that ended IDAT chunks on zlib full flushes lets the pieces between them be inflated at once; the
+	// segments hold up to the whole image besides the rows, so only when the memory limit leaves room for that
+	size_t limit = decoder->options.memory_limit;
+	int parallel = restarts > 0 && decoder->options.inflate_threads > 1 && !pipelined && inflater_available(INFLATE_ZLIB) &&
+				   (decoder->options.backend == INFLATE_AUTO || decoder->options.backend == INFLATE_ZLIB) &&
+				   (limit == 0 || (decoder->heap_bytes <= limit && raw_size <= limit - decoder->heap_bytes));
+	if (parallel)
+	{
+		result = inflater_reset_parallel(decoder->inflater, raw_size, decoder->options.inflate_threads);
+	}
+	else
+	{
+		result = inflater_reset(decoder->inflater, decoder->options.backend, compressed_size, raw_size);
+	}
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+
+#if defined(HAVE_POSIX)
+	struct pipeline pipeline;
+	if (pipelined)
+	{
+		if ((result = pipeline_start(&pipeline, image, output, &rows, arena_take(arena, pipeline_memory_size(image)))) != SUCCESS)
+		{
+			return result;
+		}
+	}
+#endif
+
+	if (input->map != NULL)
+	{
+		result = feed_mapped_IDAT(input, output, image, count, decoder, &rows);
+	}
+	else
+	{
+		result = feed_streamed_IDAT(input, output, image, buff, chunk_length, decoder, &rows);
+	}
+	if (result == SUCCESS)
+	{
+		struct stage_time start = stage_begin(rows.timer);
+		result = inflater_finish(decoder->inflater);
+		stage_lap(rows.timer, PNG_STAGE_INFLATE, start);
+	}
+
+	size_t inflater_bytes;
+	unsigned int allocations;
+	inflater_memory(decoder->inflater, &inflater_bytes, &allocations);
+	heap_change(decoder, decoder->inflater_bytes, inflater_bytes, allocations - decoder->inflater_allocations);
+	decoder->inflater_bytes = inflater_bytes;
+	decoder->inflater_allocations = allocations;
+	if (result == SUCCESS)
+	{
+		// a one-shot backend only allocates once it has all the data
+		result = check_memory_limit(decoder, decoder->heap_bytes);
+	}
+	if (result == SUCCESS && (result = drain_rows(decoder->inflater, output, image, &rows)) == SUCCESS &&
+		(rows.row_index != rows.row_count || !inflater_finished(decoder->inflater)))
+	{
+		fprintf(stderr, "not enough image data\n");
+		result = ERROR_DATA_INVALID;
+	}
+	decoder->stats.inflate_segments = inflater_segments(decoder->inflater);
+	if (result == SUCCESS && image->interlaced && (scaled || output->blend_channels != 0))
+	{
+		struct stage_time start = stage_begin(rows.timer);
+		for (int y = 0; result == SUCCESS && y < image->height; y++)
+		{
+			result = output_row(output, adam7.pixels + (size_t)y * adam7.stride, image->output_row_length);
+		}
+		stage_lap(rows.timer, PNG_STAGE_WRITE, start);
+	}
+	else if (result == SUCCESS && image->interlaced && output->file != NULL)
+	{
+		result = output_row(output, adam7.pixels, image->output_row_length * image->height);
+	}
+
+#if defined(HAVE_POSIX)
+	if (pipelined)
+	{
+		result = pipeline_finish(&pipeline, result);
+	}
+#endif
+	if (result == SUCCESS && output->file != NULL)
+	{
+		struct stage_time start = stage_begin(rows.timer);
+		result = output_flush(output);
+		stage_lap(rows.timer, PNG_STAGE_WRITE, start);
+	}
+	return result;
+}
+
+// Reads the signature and the IHDR chunk, whose fields are checked
+static int read_IHDR(struct png_input *input, unsigned char *readingIHDR)
+{
+	unsigned char png_name[8] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
+
+	unsigned char png_code[8];
+	unsigned char buff[4];
+
+	if (read_to_buff(input, png_code, 8) != SUCCESS)
+	{
+		return ERROR_DATA_INVALID;
+	}
+
+	if (check_name(png_code, png_name, 8) != SUCCESS)
+	{
+		fprintf(stderr, "Is not a png (incorrect signature).\n");
+		return ERROR_PARAMETER_INVALID;
+	}
+
+	if (read_to_buff(input, buff, 4) != SUCCESS)
+	{
+		return ERROR_DATA_INVALID;
+	}
+
+	if (check_name(buff, length_req, 4) != SUCCESS)
+	{
+		fprintf(stderr, "Incorrect IHDR len\n");
+		return ERROR_DATA_INVALID;
+	}
+
+	input_chunk_start(input);
+	if (read_to_buff(input, buff, 4) != SUCCESS)
+	{
+		return ERROR_DATA_INVALID;
+	}
+
+	if (check_name(buff, IHDR_name, 4) != SUCCESS)
+	{
+		fprintf(stderr, "expected IHDR \n");
+		return ERROR_DATA_INVALID;
+	}
+
+	if (read_to_buff(input, readingIHDR, 13) != SUCCESS)
+	{
+		return ERROR_DATA_INVALID;
+	}
+
+	uint32_t width = big_endian_32(readingIHDR), height = big_endian_32(readingIHDR + 4);
+	if (width == 0 || width > 0x7fffffff || height == 0 || height > 0x7fffffff)
+	{
+		return ERROR_DATA_INVALID;
+	}
+
+	int correct_data = check_IHDR_data(readingIHDR[8], readingIHDR[9], readingIHDR[10], readingIHDR[11], readingIHDR[12]);
+
+	if (correct_data != SUCCESS)
+	{
+		return correct_data;
+	}
+
+	if (input_chunk_end(input) != SUCCESS)
+	{
+		return ERROR_DATA_INVALID;
+	}
+	return SUCCESS;
+}
+
+// The fields that follow from IHDR alone
+static void image_from_IHDR(struct image_info *image, const unsigned char *IHDR)
+{
+	static const int channels[7] = { 1, 0, 3, 1, 2, 0, 4 };	// samples per pixel of each color type
+	memset(image, 0, sizeof(*image));
+	image->width = (int)big_endian_32(IHDR);
+	image->height = (int)big_endian_32(IHDR + 4);
+	image->bit_depth = IHDR[8];
+	image->color_type = IHDR[9];
+	image->bits_per_pixel = channels[image->color_type] * image->bit_depth;
+	image->bytes_per_pixel = image->bits_per_pixel < 8 ? 1 : image->bits_per_pixel / 8;
+	image->interlaced = IHDR[12] == 0x01;
+	image->output_channels = channels[image->color_type];
+}
+
+// Reads the palette of a PLTE chunk whose length is image->palette_length
+static int read_palette(struct png_input *input, struct image_info *image)
+{
+	if (image->palette_length > 256 * 3 || image->palette_length % 3 != 0)
+	{
+		fprintf(stderr, "pallet size is not correct\n");
+		return ERROR_DATA_INVALID;
+	}
+	if (read_to_buff(input, image->palette, image->palette_length) != SUCCESS)
+	{
+		return ERROR_DATA_INVALID;
+	}
+	if (input_chunk_end(input) != SUCCESS)
+	{
+		return ERROR_DATA_INVALID;
+	}
+	return SUCCESS;
+}
+
+// Row lengths of an image, or of an APNG frame, of the given size that is written as it is
+static void image_size(struct image_info *image, int width, int height)
+{
+	image->width = image->scaled_width = width;
+	image->height = image->scaled_height = height;
+	image->bytes_per_row = ((size_t)width * image->bits_per_pixel + 7) / 8 + 1;
+	image->output_row_length = image->scaled_row_length = (size_t)width * image->output_pixel_size;
+	image->scale = 0;
+}
+
+// The layout of the written rows, once the palette is known
+static void image_output(struct image_info *image, const struct png_decode_options *options)
+{
+	int width = image->width, length = image->height;
+	if (image->color_type == 0x03)
+	{
+		image->output_channels = 1;
+		for (unsigned int i = 0; i < image->palette_length; i += 3)
+		{
+			if (image->palette[i] != image->palette[i + 1] || image->palette[i] != image->palette[i + 2])
+			{
+				image->output_channels = 3;
+				break;
+			}
+		}
+		convert_build_table(image->palette_table, image->palette, image->bit_depth, image->output_channels);
+	}
+	if (options->strip_alpha && (image->color_type == 0x04 || image->color_type == 0x06))
+	{
+		image->output_channels--;
+	}
+	image->output_pixel_size = image->output_channels * (image->bit_depth == 16 ? 2 : 1);
+	image_size(image, width, length);
+
+	// a box filter only ever shrinks
+	if (options->scale_width > 0 && options->scale_height > 0)
+	{
+		image->scaled_width = options->scale_width < width ? options->scale_width : width;
+		image->scaled_height = options->scale_height < length ? options->scale_height : length;
+	}
+	else if (options->scale > 1)
+	{
+		image->scale = options->scale;
+		image->scaled_width = (int)(((long long)width + options->scale - 1) / options->scale);
+		image->scaled_height = (int)(((long long)length + options->scale - 1) / options->scale);
+	}
+	image->scaled_row_length = (size_t)image->scaled_width * image->output_pixel_size;
+}
+
+// Reads everything up to the first IDAT chunk, on return buff holds its name and chunk_length its length
+static int read_header(struct png_input *input, const struct png_decode_options *options, struct image_info *image,
+					   unsigned char *buff, unsigned int *chunk_length)
+{
+	unsigned char readingIHDR[13];
+	int result = read_IHDR(input, readingIHDR);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	image_from_IHDR(image, readingIHDR);
+
+	if (image->color_type == 3)
+	{
+		if (search_for_chunk(input, PLTE_name, buff, &image->palette_length) != SUCCESS)
+		{
+			fprintf(stderr, "couldn't find a pallet for color type 3 image.\n");
+			return ERROR_DATA_INVALID;
+		}
+		if ((result = read_palette(input, image)) != SUCCESS)
+		{
+			return result;
+		}
+	}
+
+	if (search_for_chunk(input, IDAT_name, buff, chunk_length) != SUCCESS)
+	{
+		fprintf(stderr, "couldnt find a IDAT chunk.\n");
+		return ERROR_DATA_INVALID;
+	}
+	image_output(image, options);
+	return SUCCESS;
+}
+
+// Checks that the IDAT chunks are followed by IEND and nothing else
+static int read_trailer(struct png_input *input, unsigned char *buff, unsigned int chunk_length)
+{
+	if (check_name(buff, IEND_name, 4) != SUCCESS && search_for_chunk(input, IEND_name, buff, &chunk_length) != SUCCESS)
+	{
+		fprintf(stderr, "couldnt find a IEND chunk.\n");
+		return ERROR_DATA_INVALID;
+	}
+
+	if (chunk_length != 0)
+	{
+		fprintf(stderr, "IEND chunk length is not 0.\n");
+		return ERROR_DATA_INVALID;
+	}
+
+	if (input_chunk_end(input) != SUCCESS)
+	{
+		return ERROR_DATA_INVALID;
+	}
+
+	if (!input_at_end(input))
+	{
+		fprintf(stderr, "there is more data after IEND chunk\n");
+		return ERROR_DATA_INVALID;
+	}
+	return SUCCESS;
+}
+
+// Clears the stats of the previous image and returns the start time of the next one
+static struct stage_time stats_begin(struct png_decoder *decoder)
+{
+	memset(&decoder->stats, 0, sizeof(decoder->stats));
+	decoder->stats.peak_heap = decoder->heap_bytes;
+	return stage_begin(decoder_timer(decoder));
+}
+
+static void stats_end(struct png_decoder *decoder, struct stage_time start, const struct png_input *input, size_t written)
+{
+	struct stage_timer *timer = decoder_timer(decoder);
+	if (timer != NULL)
+	{
+		struct stage_time now = stage_now(timer);
+		decoder->stats.total_seconds = now.wall - start.wall;
+		decoder->stats.total_cpu_seconds += now.cpu - start.cpu;
+		decoder->stats.bytes_read = input->position;
+		decoder->stats.bytes_written = written;
+	}
+}
+
+// Converts an opened input, the output is only left behind when the conversion succeeds. The caller closes the input
+static int convert_input(struct png_decoder *decoder, struct png_input *input, const char *output_name, struct stage_time begin)
+{
+	struct png_output output = { 0 };
+	unsigned char buff[4];
+	unsigned int chunk_length;
+	struct stage_timer *timer = decoder_timer(decoder);
+
+	input->verify = decoder->options.verify;
+	int result = read_header(input, &decoder->options, &decoder->image, buff, &chunk_length);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	struct stage_time start = stage_lap(timer, PNG_STAGE_PARSE, begin);
+
+	// rows are written out while decoding, so the output file is removed again if the input turns out to be broken. What
+	// went to stdout cannot be taken back, the exit code has to tell
+	int to_stdout = strcmp(output_name, "-") == 0;
+	if (to_stdout)
+	{
+#if defined(_WIN32)
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		output.file = stdout;
+	}
+	else if ((output.file = fopen(output_name, "wb")) == NULL)
+	{
+		fprintf(stderr, "cannot open file %s\n", output_name);
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	// the rows bypass stdio, so the header has to be out before them
+	int header_length = write_header(output.file, &decoder->image, decoder->image.scaled_width, decoder->image.scaled_height);
+	if (fflush(output.file) != 0)
+	{
+		fprintf(stderr, "error while writing a file\n");
+		result = ERROR_UNKNOWN;
+	}
+#if defined(HAVE_POSIX)
+	output.fd = fileno(output.file);
+#endif
+	stage_lap(timer, PNG_STAGE_WRITE, start);
+
+	if (result == SUCCESS)
+	{
+		result = decode_IDAT(decoder, input, &output, &decoder->image, buff, &chunk_length);
+	}
+
+	if (result == SUCCESS)
+	{
+		start = stage_begin(timer);
+		result = read_trailer(input, buff, chunk_length);
+		stage_lap(timer, PNG_STAGE_PARSE, start);
+	}
+
+	start = stage_begin(timer);
+	if ((to_stdout ? fflush(output.file) : fclose(output.file)) != 0 && result == SUCCESS)
+	{
+		fprintf(stderr, "error while writing a file\n");
+		result = ERROR_UNKNOWN;
+	}
+	stage_lap(timer, PNG_STAGE_WRITE, start);
+	if (result != SUCCESS && !to_stdout)
+	{
+		remove(output_name);
+	}
+	stats_end(decoder, begin, input, header_length + decoder->image.scaled_row_length * decoder->image.scaled_height);
+	return result;
+}
+
+int png_decoder_convert_file(struct png_decoder *decoder, const char *input_name, const char *output_name)
+{
+	struct png_input input;
+	struct stage_time begin = stats_begin(decoder);
+	if (input_open(&input, input_name) != SUCCESS)
+	{
+		fprintf(stderr, "Cannot open file %s\n", input_name);
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	int result = convert_input(decoder, &input, output_name, begin);
+	input_close(&input);
+	return result;
+}
+
+int png_decoder_convert_memory(struct png_decoder *decoder, const unsigned char *data, size_t size, const char *output_name)
+{
+	struct png_input input;
+	struct stage_time begin = stats_begin(decoder);
+	input_memory(&input, data, size);
+	return convert_input(decoder, &input, output_name, begin);
+}
+
+int png_decoder_pnm_header(const struct png_image *image, char *header, size_t size)
+{
+	if (image->channels == 1 || image->channels == 3)
+	{
+		return snprintf(header, size, "%s\n%d %d\n%d\n", image->channels == 1 ? "P5" : "P6", image->width, image->height, image->maxval);
+	}
+	return snprintf(header, size, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %d\nTUPLTYPE %s\nENDHDR\n", image->width, image->height,
+					image->channels, image->maxval, image->channels == 2 ? "GRAYSCALE_ALPHA" : "RGB_ALPHA");
+}
+
+// APNG: the fcTL chunk in front of the data of every frame
+struct frame_control
+{
+	int width, height, x, y;	// of the region of the canvas the frame covers
+	int dispose, blend;
+};
+
+#define APNG_DISPOSE_NONE 0
+#define APNG_DISPOSE_BACKGROUND 1	 // the region is cleared to transparent black once the frame has been shown
+#define APNG_DISPOSE_PREVIOUS 2		 // the region goes back to what it was before the frame
+#define APNG_BLEND_OVER 1			 // the frame is composed over the region instead of replacing it
+
+// What png_decoder_convert_frames keeps besides the buffers of a single frame
+struct animation
+{
+	struct image_info canvas;	 // the layout of the canvas, alpha included even when it is stripped from the output
+	unsigned char *pixels;		 // the canvas
+	unsigned char *previous;	 // a frame disposed to the previous canvas keeps its region here meanwhile
+	unsigned char *row;			 // a canvas row without its alpha channel
+	size_t bytes;				 // of the buffers above
+	const char *output_name;
+	int numbered;	 // output_name is a pattern, every frame gets a file of its own
+	char *name;		 // of the numbered file being written
+	FILE *file;		 // the one output of a stream of frames
+	int strip_alpha;
+	unsigned int frames;	// written so far
+	size_t written;
+};
+
+// 1 when name holds a single %d conversion, optionally with a 0 flag and a width; 0 without any; -1 for anything else
+static int frame_pattern(const char *name)
+{
+	int conversions = 0;
+	for (const char *c = strchr(name, '%'); c != NULL; c = strchr(c, '%'))
+	{
+		c++;
+		if (*c == '%')
+		{
+			c++;
+			continue;
+		}
+		while (*c >= '0' && *c <= '9')
+		{
+			c++;
+		}
+		if (*c != 'd')
+		{
+			return -1;
+		}
+		conversions++;
+	}
+	return conversions <= 1 ? conversions : -1;
+}
+
+// Reads the length and name of the next chunk into chunk_length and buff and starts its crc
+static int next_chunk(struct png_input *input, unsigned char *buff, unsigned int *chunk_length)
+{
+	if (read_to_buff(input, buff, 4) != SUCCESS)
+	{
+		return ERROR_DATA_INVALID;
+	}
+	*chunk_length = big_endian_32(buff);
+	input_chunk_start(input);
+	return read_to_buff(input, buff, 4);
+}
+
+// bytes holds the 26 bytes of an fcTL chunk: sequence number, width, height, x and y offset, the delay as a fraction,
+// dispose op and blend op. The delay is of no use for single images
+static int read_frame_control(struct frame_control *control, const unsigned char *bytes, const struct image_info *canvas)
+{
+	uint32_t width = big_endian_32(bytes + 4), height = big_endian_32(bytes + 8);
+	uint32_t x = big_endian_32(bytes + 12), y = big_endian_32(bytes + 16);
+	if (width == 0 || height == 0 || x > (uint32_t)canvas->width || width > (uint32_t)canvas->width - x ||
+		y > (uint32_t)canvas->height || height > (uint32_t)canvas->height - y || bytes[24] > APNG_DISPOSE_PREVIOUS ||
+		bytes[25] > APNG_BLEND_OVER)
+	{
+		fprintf(stderr, "invalid fcTL chunk\n");
+		return ERROR_DATA_INVALID;
+	}
+	control->width = (int)width;
+	control->height = (int)height;
+	control->x = (int)x;
+	control->y = (int)y;
+	control->dispose = bytes[24];
+	control->blend = bytes[25];
+	return SUCCESS;
+}
+
+// Takes the canvas and the row buffer once the layout of the image is known, the canvas starts out transparent black
+static int animation_start(struct png_decoder *decoder, struct animation *animation)
+{
+	struct image_info *canvas = &animation->canvas;
+	animation->strip_alpha = animation->strip_alpha && (canvas->color_type == 0x04 || canvas->color_type == 0x06);
+	size_t bytes = (size_t)canvas->height > SIZE_MAX / canvas->output_row_length ? SIZE_MAX
+																				 : canvas->output_row_length * canvas->height;
+	bytes = arena_add(bytes, animation->strip_alpha ? canvas->output_row_length : 0);
+	int result = check_memory_limit(decoder, arena_add(decoder->heap_bytes, bytes));
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	if ((animation->pixels = calloc(1, bytes)) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	animation->row = animation->pixels + canvas->output_row_length * canvas->height;
+	animation->bytes = bytes;
+	heap_change(decoder, 0, bytes, 1);
+	return SUCCESS;
+}
+
+// A copy of the canvas for the regions of frames disposed to the previous canvas, only taken when one is
+static int animation_keep_previous(struct png_decoder *decoder, struct animation *animation)
+{
+	size_t bytes = animation->canvas.output_row_length * animation->canvas.height;
+	if (animation->previous != NULL)
+	{
+		return SUCCESS;
+	}
+	int result = check_memory_limit(decoder, arena_add(decoder->heap_bytes, bytes));
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	if ((animation->previous = malloc(bytes)) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	animation->bytes += bytes;
+	heap_change(decoder, 0, bytes, 1);
+	return SUCCESS;
+}
+
+// Copies the rows of a region from one canvas sized buffer to another, or clears them when from is NULL
+static void copy_region(unsigned char *to, const unsigned char *from, const struct image_info *canvas, const struct frame_control *control)
+{
+	size_t offset = (size_t)control->y * canvas->output_row_length + (size_t)control->x * canvas->output_pixel_size;
+	size_t length = (size_t)control->width * canvas->output_pixel_size;
+	for (int y = 0; y < control->height; y++, offset += canvas->output_row_length)
+	{
+		if (from != NULL)
+		{
+			memcpy(to + offset, from + offset, length);
+		}
+		else
+		{
+			memset(to + offset, 0, length);
+		}
+	}
+}
+
+// Writes the canvas as the next PNM image, to a file of its own when the output is numbered
+static int animation_write(struct animation *animation)
+{
+	struct image_info *canvas = &animation->canvas;
+	FILE *file = animation->file;
+	if (animation->numbered)
+	{
+		size_t size = strlen(animation->output_name) + 32;
+		int length = snprintf(animation->name, size, animation->output_name, animation->frames);
+		if (length < 0 || (size_t)length >= size)
+		{
+			fprintf(stderr, "the output name of frame %u is too long\n", animation->frames);
+			return ERROR_PARAMETER_INVALID;
+		}
+		if ((file = fopen(animation->name, "wb")) == NULL)
+		{
+			fprintf(stderr, "cannot open file %s\n", animation->name);
+			return ERROR_CANNOT_OPEN_FILE;
+		}
+	}
+
+	struct png_image image;
+	char header[PNG_PNM_HEADER_SIZE];
+	describe_image(canvas, &image);
+	image.channels -= animation->strip_alpha;
+	int header_length = png_decoder_pnm_header(&image, header, sizeof(header));
+	size_t row_length = (size_t)canvas->width * image.channels * image.sample_size;
+	int failed = fwrite(header, 1, header_length, file) != (size_t)header_length;
+	if (!animation->strip_alpha)
+	{
+		failed = failed || fwrite(animation->pixels, 1, row_length * canvas->height, file) != row_length * canvas->height;
+	}
+	for (int y = 0; animation->strip_alpha && !failed && y < canvas->height; y++)
+	{
+		const unsigned char *pixels = animation->pixels + (size_t)y * canvas->output_row_length;
+		size_t kept = row_length / canvas->width;
+		for (int x = 0; x < canvas->width; x++)
+		{
+			memcpy(animation->row + x * kept, pixels + (size_t)x * canvas->output_pixel_size, kept);
+		}
+		failed = fwrite(animation->row, 1, row_length, file) != row_length;
+	}
+	if (animation->numbered && fclose(file) != 0)
+	{
+		failed = 1;
+	}
+	if (failed)
+	{
+		fprintf(stderr, "error while writing a file\n");
+		if (animation->numbered)
+		{
+			remove(animation->name);
+		}
+		return ERROR_UNKNOWN;
+	}
+	animation->frames++;
+	animation->written += header_length + row_length * canvas->height;
+	return SUCCESS;
+}
+
+// Decodes the frame whose data starts with the chunk in buff into its region of the canvas, writes the canvas and
+// disposes of the frame. On return buff holds the chunk after the data
+static int animation_frame(struct png_decoder *decoder, struct animation *animation, struct png_input *input,
+						   const struct frame_control *control, unsigned char *buff, unsigned int *chunk_length)
+{
+	struct image_info *canvas = &animation->canvas;
+	struct image_info frame = *canvas;
+	image_size(&frame, control->width, control->height);
+	// the first frame has no previous canvas to go back to
+	int dispose = control->dispose == APNG_DISPOSE_PREVIOUS && animation->frames == 0 ? APNG_DISPOSE_BACKGROUND : control->dispose;
+	int result;
+	if (dispose == APNG_DISPOSE_PREVIOUS)
+	{
+		if ((result = animation_keep_previous(decoder, animation)) != SUCCESS)
+		{
+			return result;
+		}
+		copy_region(animation->previous, animation->pixels, canvas, control);
+	}
+
+	// without an alpha channel every pixel is opaque and blending is the same as replacing
+	struct png_output output = { 0 };
+	output.buffer = animation->pixels + (size_t)control->y * canvas->output_row_length + (size_t)control->x * canvas->output_pixel_size;
+	output.stride = canvas->output_row_length;
+	output.fd = -1;
+	if (control->blend == APNG_BLEND_OVER && (canvas->color_type == 0x04 || canvas->color_type == 0x06))
+	{
+		output.blend_channels = canvas->output_channels;
+		output.blend_sample_size = canvas->bit_depth == 16 ? 2 : 1;
+	}
+	if ((result = decode_IDAT(decoder, input, &output, &frame, buff, chunk_length)) != SUCCESS)
+	{
+		return result;
+	}
+
+	struct stage_time start = stage_begin(decoder_timer(decoder));
+	result = animation_write(animation);
+	stage_lap(decoder_timer(decoder), PNG_STAGE_WRITE, start);
+	if (dispose != APNG_DISPOSE_NONE)
+	{
+		copy_region(animation->pixels, dispose == APNG_DISPOSE_PREVIOUS ? animation->previous : NULL, canvas, control);
+	}
+	return result;
+}
+
+// Walks the chunks of the whole file. Without an acTL chunk the image is not animated and its one frame is the image;
+// with one, fcTL and fdAT chunks are taken in their place and the default image only counts when an fcTL chunk precedes it
+static int decode_frames(struct png_decoder *decoder, struct png_input *input, struct animation *animation)
+{
+	unsigned char readingIHDR[13], buff[4], bytes[26];
+	unsigned int chunk_length;
+	struct image_info *canvas = &animation->canvas;
+	struct frame_control control = { 0 };
+	int animated = 0, control_pending = 0, data_seen = 0, palette_seen = 0, have_chunk = 0;
+	struct stage_timer *timer = decoder_timer(decoder);
+
+	struct stage_time start = stage_begin(timer);
+	int result = read_IHDR(input, readingIHDR);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	image_from_IHDR(canvas, readingIHDR);
+	decoder->sequence = 0;
+	for (;;)
+	{
+		if (!have_chunk && next_chunk(input, buff, &chunk_length) != SUCCESS)
+		{
+			return ERROR_DATA_INVALID;
+		}
+		have_chunk = 0;
+		int is_IDAT = check_name(buff, IDAT_name, 4) == SUCCESS;
+		int is_fdAT = animated && check_name(buff, fdAT_name, 4) == SUCCESS;
+		if (check_name(buff, IEND_name, 4) == SUCCESS)
+		{
+			break;
+		}
+		else if (check_name(buff, PLTE_name, 4) == SUCCESS)
+		{
+			if (data_seen || palette_seen)
+			{
+				fprintf(stderr, "unexpected PLTE chunk\n");
+				return ERROR_DATA_INVALID;
+			}
+			canvas->palette_length = chunk_length;
+			if ((result = read_palette(input, canvas)) != SUCCESS)
+			{
+				return result;
+			}
+			palette_seen = 1;
+		}
+		else if (check_name(buff, acTL_name, 4) == SUCCESS && !data_seen)
+		{
+			if (chunk_length != 8 || read_to_buff(input, bytes, 8) != SUCCESS || input_chunk_end(input) != SUCCESS)
+			{
+				fprintf(stderr, "invalid acTL chunk\n");
+				return ERROR_DATA_INVALID;
+			}
+			animated = 1;
+		}
+		else if (animated && check_name(buff, fcTL_name, 4) == SUCCESS)
+		{
+			if (chunk_length != 26 || read_to_buff(input, bytes, 26) != SUCCESS || input_chunk_end(input) != SUCCESS)
+			{
+				fprintf(stderr, "invalid fcTL chunk\n");
+				return ERROR_DATA_INVALID;
+			}
+			if (control_pending)
+			{
+				fprintf(stderr, "fcTL chunk without frame data\n");
+				return ERROR_DATA_INVALID;
+			}
+			if ((result = check_sequence(decoder, bytes)) != SUCCESS || (result = read_frame_control(&control, bytes, canvas)) != SUCCESS)
+			{
+				return result;
+			}
+			control_pending = 1;
+		}
+		else if (is_IDAT || is_fdAT)
+		{
+			if (data_seen == is_IDAT)
+			{
+				fprintf(stderr, is_IDAT ? "unexpected IDAT chunk\n" : "fdAT chunk before the IDAT chunks\n");
+				return ERROR_DATA_INVALID;
+			}
+			if (!data_seen)
+			{
+				if (canvas->color_type == 3 && !palette_seen)
+				{
+					fprintf(stderr, "couldn't find a pallet for color type 3 image.\n");
+					return ERROR_DATA_INVALID;
+				}
+				struct png_decode_options options = decoder->options;
+				options.strip_alpha = 0;
+				image_output(canvas, &options);
+				if ((result = animation_start(decoder, animation)) != SUCCESS)
+				{
+					return result;
+				}
+				data_seen = 1;
+				start = stage_lap(timer, PNG_STAGE_PARSE, start);
+			}
+			if (!animated)
+			{
+				control.width = canvas->width;
+				control.height = canvas->height;
+				control_pending = 1;
+			}
+			if (!control_pending && is_fdAT)
+			{
+				fprintf(stderr, "fdAT chunk without fcTL chunk\n");
+				return ERROR_DATA_INVALID;
+			}
+			if (!control_pending)
+			{
+				// a default image that is not part of the animation
+				while (check_name(buff, IDAT_name, 4) == SUCCESS)
+				{
+					if (input_skip(input, chunk_length) != SUCCESS || input_chunk_end(input) != SUCCESS ||
+						next_chunk(input, buff, &chunk_length) != SUCCESS)
+					{
+						return ERROR_DATA_INVALID;
+					}
+				}
+				have_chunk = 1;
+				continue;
+			}
+			if (is_IDAT && (control.x != 0 || control.y != 0 || control.width != canvas->width || control.height != canvas->height))
+			{
+				fprintf(stderr, "the first frame of an APNG has to cover the whole image\n");
+				return ERROR_DATA_INVALID;
+			}
+			decoder->fdAT = is_fdAT;
+			result = animation_frame(decoder, animation, input, &control, buff, &chunk_length);
+			decoder->fdAT = 0;
+			if (result != SUCCESS)
+			{
+				return result;
+			}
+			control_pending = 0;
+			have_chunk = 1;
+			start = stage_begin(timer);
+		}
+		else if (input_skip(input, chunk_length) != SUCCESS || input_chunk_end(input) != SUCCESS)
+		{
+			return ERROR_DATA_INVALID;
+		}
+	}
+
+	if (!data_seen)
+	{
+		fprintf(stderr, "couldnt find a IDAT chunk.\n");
+		return ERROR_DATA_INVALID;
+	}
+	result = read_trailer(input, buff, chunk_length);
+	stage_lap(timer, PNG_STAGE_PARSE, start);
+	return result;
+}
+
+int png_decoder_convert_frames(struct png_decoder *decoder, const char *input_name, const char *output_name, unsigned int *frames)
+{
+	const struct png_decode_options *options = &decoder->options;
+	struct animation animation = { 0 };
+	*frames = 0;
+	animation.output_name = output_name;
+	animation.numbered = frame_pattern(output_name);
+	animation.strip_alpha = options->strip_alpha;
+	if (animation.numbered < 0)
+	{
+		fprintf(stderr, "the output name of the frames may hold one %%d and no other conversion\n");
+		return ERROR_PARAMETER_INVALID;
+	}
+	if (options->scale > 1 || options->scale_width > 0 || options->preview_name != NULL)
+	{
+		fprintf(stderr, "frames can neither be scaled nor previewed\n");
+		return ERROR_PARAMETER_INVALID;
+	}
+
+	struct png_input input;
+	struct stage_time begin = stats_begin(decoder);
+	if (input_open(&input, input_name) != SUCCESS)
+	{
+		fprintf(stderr, "Cannot open file %s\n", input_name);
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	input.verify = options->verify;
+	int to_stdout = !animation.numbered && strcmp(output_name, "-") == 0;
+	int result = SUCCESS;
+	if (animation.numbered && (animation.name = malloc(strlen(output_name) + 32)) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		result = ERROR_OUT_OF_MEMORY;
+	}
+	else if (to_stdout)
+	{
+#if defined(_WIN32)
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		animation.file = stdout;
+	}
+	else if (!animation.numbered && (animation.file = fopen(output_name, "wb")) == NULL)
+	{
+		fprintf(stderr, "cannot open file %s\n", output_name);
+		result = ERROR_CANNOT_OPEN_FILE;
+	}
+
+	if (result == SUCCESS)
+	{
+		result = decode_frames(decoder, &input, &animation);
+	}
+	// numbered frames that were written stay, like the rows of a stream that went to stdout
+	if (animation.file != NULL && (to_stdout ? fflush(animation.file) : fclose(animation.file)) != 0 && result == SUCCESS)
+	{
+		fprintf(stderr, "error while writing a file\n");
+		result = ERROR_UNKNOWN;
+	}
+	if (result != SUCCESS && animation.file != NULL && !to_stdout)
+	{
+		remove(output_name);
+	}
+	stats_end(decoder, begin, &input, animation.written);
+	input_close(&input);
+	free(animation.pixels);
+	free(animation.previous);
+	free(animation.name);
+	heap_change(decoder, animation.bytes, 0, 0);
+	*frames = animation.frames;
+	return result;
+}
+
+// Walks the chunk headers up to the end of the IDAT run, the chunks themselves are skipped and nothing is inflated
+static int probe_chunks(struct png_input *input, struct png_probe *probe)
+{
+	unsigned char readingIHDR[13];
+	unsigned char header[8];
+	int result = read_IHDR(input, readingIHDR);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	probe->width = (int)big_endian_32(readingIHDR);
+	probe->height = (int)big_endian_32(readingIHDR + 4);
+	probe->bit_depth = readingIHDR[8];
+	probe->color_type = readingIHDR[9];
+	probe->interlaced = readingIHDR[12] == 0x01;
+
+	for (;;)
+	{
+		size_t offset = input->position;
+		if (read_to_buff(input, header, 8) != SUCCESS)
+		{
+			return ERROR_DATA_INVALID;
+		}
+		uint32_t length = big_endian_32(header);
+		if (length > 0x7fffffff)
+		{
+			fprintf(stderr, "chunk length is over 2^31 - 1\n");
+			return ERROR_DATA_INVALID;
+		}
+		if (check_name(header + 4, IDAT_name, 4) == SUCCESS)
+		{
+			if (probe->IDAT_chunks++ == 0)
+			{
+				probe->IDAT_offset = offset;
+			}
+			probe->IDAT_bytes += length;
+		}
+		else if (probe->IDAT_chunks > 0)
+		{
+			// IDAT chunks are consecutive, whatever follows them is not needed
+			return SUCCESS;
+		}
+		else if (check_name(header + 4, IEND_name, 4) == SUCCESS)
+		{
+			fprintf(stderr, "couldnt find a IDAT chunk.\n");
+			return ERROR_DATA_INVALID;
+		}
+		if (input_skip(input, (size_t)length + 4) != SUCCESS)
+		{
+			return ERROR_DATA_INVALID;
+		}
+	}
+}
+
+int png_probe_file(const char *input_name, struct png_probe *probe)
+{
+	struct png_input input;
+	memset(probe, 0, sizeof(*probe));
+	if (input_open_stream(&input, input_name) != SUCCESS)
+	{
+		fprintf(stderr, "Cannot open file %s\n", input_name);
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	int result = probe_chunks(&input, probe);
+	input_close(&input);
+	return result;
+}
+
+#define FINGERPRINT_PIECE (64 * 1024)
+
+// Two XXH64 chains over pieces of FINGERPRINT_PIECE bytes. The IDAT data is hashed as one stream, so the way it is split
+// into chunks does not change the fingerprint
+struct fingerprint
+{
+	uint64_t hash[2];
+	unsigned char *piece;	 // FINGERPRINT_PIECE bytes being collected, followed by as many to read chunks into
+	size_t filled;
+};
+
+static void fingerprint_piece(struct fingerprint *fingerprint, const unsigned char *data, size_t length)
+{
+	fingerprint->hash[0] = xxh64(data, length, fingerprint->hash[0]);
+	fingerprint->hash[1] = xxh64(data, length, fingerprint->hash[1]);
+}
+
+static void fingerprint_add(struct fingerprint *fingerprint, const unsigned char *data, size_t length)
+{
+	if (fingerprint->filled > 0)
+	{
+		size_t part = length < FINGERPRINT_PIECE - fingerprint->filled ? length : FINGERPRINT_PIECE - fingerprint->filled;
+		memcpy(fingerprint->piece + fingerprint->filled, data, part);
+		fingerprint->filled += part;
+		data += part;
+		length -= part;
+		if (fingerprint->filled < FINGERPRINT_PIECE)
+		{
+			return;
+		}
+		fingerprint_piece(fingerprint, fingerprint->piece, FINGERPRINT_PIECE);
+		fingerprint->filled = 0;
+	}
+	// whole pieces straight from a mapped input
+	for (; length >= FINGERPRINT_PIECE; data += FINGERPRINT_PIECE, length -= FINGERPRINT_PIECE)
+	{
+		fingerprint_piece(fingerprint, data, FINGERPRINT_PIECE);
+	}
+	memcpy(fingerprint->piece, data, length);
+	fingerprint->filled = length;
+}
+
+// Ends a part such as the IDAT stream, its name and length keep the parts apart
+static void fingerprint_part(struct fingerprint *fingerprint, const char *name, unsigned long long length)
+{
+	char tag[32];
+	if (fingerprint->filled > 0)
+	{
+		fingerprint_piece(fingerprint, fingerprint->piece, fingerprint->filled);
+		fingerprint->filled = 0;
+	}
+	fingerprint_piece(fingerprint, (const unsigned char *)tag, (size_t)snprintf(tag, sizeof(tag), "%s %llu", name, length));
+}
+
+// Adds the data of a chunk and moves past its crc, checked when the input verifies
+static int fingerprint_chunk(struct png_input *input, struct fingerprint *fingerprint, size_t length)
+{
+	while (length > 0)
+	{
+		size_t part = length < FINGERPRINT_PIECE ? length : FINGERPRINT_PIECE;
+		const unsigned char *data = input_span(input, part);
+		if (data != NULL && input->verify)
+		{
+			input->crc = crc32_update(input->crc, data, part);
+		}
+		else if (data == NULL)
+		{
+			if (input->map != NULL)
+			{
+				fprintf(stderr, "error while reading a file\n");
+				return ERROR_DATA_INVALID;
+			}
+			data = fingerprint->piece + FINGERPRINT_PIECE;
+			if (read_to_buff(input, fingerprint->piece + FINGERPRINT_PIECE, (unsigned int)part) != SUCCESS)
+			{
+				return ERROR_DATA_INVALID;
+			}
+		}
+		fingerprint_add(fingerprint, data, part);
+		length -= part;
+	}
+	return input_chunk_end(input);
+}
+
+// Hashes IHDR, the PLTE of a palette image and the IDAT run, then walks over the rest up to IEND the way read_trailer
+// checks it. Other chunks do not change the PNM and are skipped; nothing is inflated. With verify the crc of every chunk
+// is checked as a conversion would, so that a file the decoder rejects is not served from a cache
+static int fingerprint_chunks(struct png_input *input, const struct png_decode_options *options, struct fingerprint *fingerprint)
+{
+	unsigned char readingIHDR[13];
+	unsigned char header[8];
+	int result = read_IHDR(input, readingIHDR);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	fingerprint_add(fingerprint, readingIHDR, sizeof(readingIHDR));
+	fingerprint_part(fingerprint, "IHDR", sizeof(readingIHDR));
+
+	int palette = readingIHDR[9] == 3;
+	unsigned long long IDAT_bytes = 0;
+	int IDAT_state = 0;	   // 1 within the IDAT run, 2 after it
+	for (;;)
+	{
+		if (read_to_buff(input, header, 4) != SUCCESS)
+		{
+			return ERROR_DATA_INVALID;
+		}
+		input_chunk_start(input);
+		if (read_to_buff(input, header + 4, 4) != SUCCESS)
+		{
+			return ERROR_DATA_INVALID;
+		}
+		uint32_t length = big_endian_32(header);
+		if (length > 0x7fffffff)
+		{
+			fprintf(stderr, "chunk length is over 2^31 - 1\n");
+			return ERROR_DATA_INVALID;
+		}
+		int IDAT = check_name(header + 4, IDAT_name, 4) == SUCCESS;
+		if (IDAT_state == 1 && !IDAT)
+		{
+			fingerprint_part(fingerprint, "IDAT", IDAT_bytes);
+			IDAT_state = 2;
+		}
+
+		if (IDAT && IDAT_state < 2)
+		{
+			IDAT_state = 1;
+			IDAT_bytes += length;
+			result = fingerprint_chunk(input, fingerprint, (size_t)length);
+		}
+		else if (palette && IDAT_state == 0 && check_name(header + 4, PLTE_name, 4) == SUCCESS)
+		{
+			palette = 0;
+			result = fingerprint_chunk(input, fingerprint, (size_t)length);
+			fingerprint_part(fingerprint, "PLTE", (unsigned long long)length);
+		}
+		else if (check_name(header + 4, IEND_name, 4) == SUCCESS)
+		{
+			if (IDAT_state == 0)
+			{
+				fprintf(stderr, "couldnt find a IDAT chunk.\n");
+				return ERROR_DATA_INVALID;
+			}
+			if (length != 0)
+			{
+				fprintf(stderr, "IEND chunk length is not 0.\n");
+				return ERROR_DATA_INVALID;
+			}
+			if (input_chunk_end(input) != SUCCESS)
+			{
+				return ERROR_DATA_INVALID;
+			}
+			if (!input_at_end(input))
+			{
+				fprintf(stderr, "there is more data after IEND chunk\n");
+				return ERROR_DATA_INVALID;
+			}
+			break;
+		}
+		else if ((result = input_skip(input, (size_t)length)) == SUCCESS)
+		{
+			result = input_chunk_end(input);
+		}
+		if (result != SUCCESS)
+		{
+			return ERROR_DATA_INVALID;
+		}
+	}
+
+	// only the options that change the PNM, not how it is decoded
+	char settings[128];
+	int length = snprintf(settings, sizeof(settings), "strip_alpha=%d scale=%d %dx%d verify=%d", options->strip_alpha != 0, options->scale,
+						  options->scale_width, options->scale_height, options->verify != 0);
+	fingerprint_add(fingerprint, (const unsigned char *)settings, (size_t)length);
+	fingerprint_part(fingerprint, "options", (unsigned long long)length);
+	return SUCCESS;
+}
+
+static int fingerprint_input(struct png_input *input, const struct png_decode_options *options, unsigned char *result)
+{
+	struct fingerprint fingerprint = { { 0, 0x9E3779B97F4A7C15ULL }, malloc(2 * FINGERPRINT_PIECE), 0 };
+	if (fingerprint.piece == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	input->verify = options->verify;
+	int status = fingerprint_chunks(input, options, &fingerprint);
+	free(fingerprint.piece);
+	for (int i = 0; i < PNG_FINGERPRINT_SIZE; i++)
+	{
+		result[i] = (unsigned char)(fingerprint.hash[i / 8] >> (56 - 8 * (i % 8)));
+	}
+	return status;
+}
+
+int png_fingerprint_file(const char *input_name, const struct png_decode_options *options, unsigned char fingerprint[PNG_FINGERPRINT_SIZE])
+{
+	struct png_input input;
+	if (input_open(&input, input_name) != SUCCESS)
+	{
+		fprintf(stderr, "Cannot open file %s\n", input_name);
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	int result = fingerprint_input(&input, options, fingerprint);
+	input_close(&input);
+	return result;
+}
+
+int png_fingerprint_memory(const unsigned char *data, size_t size, const struct png_decode_options *options,
+						   unsigned char fingerprint[PNG_FINGERPRINT_SIZE])
+{
+	struct png_input input;
+	input_memory(&input, data, size);
+	return fingerprint_input(&input, options, fingerprint);
+}
+
+int png_decoder_read_info(struct png_decoder *decoder, const unsigned char *data, size_t size, struct png_image *image)
+{
+	struct png_input input;
+	unsigned char buff[4];
+	unsigned int chunk_length;
+
+	input_memory(&input, data, size);
+	input.verify = decoder->options.verify;
+	int result = read_header(&input, &decoder->options, &decoder->image, buff, &chunk_length);
+	if (result == SUCCESS)
+	{
+		describe_image(&decoder->image, image);
+	}
+	return result;
+}
+
+int png_decoder_decode_memory(struct png_decoder *decoder, const unsigned char *data, size_t size, unsigned char *output, size_t stride,
+							  size_t output_size, struct png_image *image)
+{
+	struct png_input input;
+	struct image_info *info = &decoder->image;
+	unsigned char buff[4];
+	unsigned int chunk_length;
+	struct stage_timer *timer = decoder_timer(decoder);
+	struct stage_time begin = stats_begin(decoder);
+
+	input_memory(&input, data, size);
+	input.verify = decoder->options.verify;
+	int result = read_header(&input, &decoder->options, info, buff, &chunk_length);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	stage_lap(timer, PNG_STAGE_PARSE, begin);
+
+	if (output == NULL || stride < info->scaled_row_length || output_size < info->scaled_row_length ||
+		(size_t)(info->scaled_height - 1) > (output_size - info->scaled_row_length) / stride)
+	{
+		fprintf(stderr, "the output buffer is too small for a %dx%d image\n", info->scaled_width, info->scaled_height);
+		return ERROR_PARAMETER_INVALID;
+	}
+	struct png_output target = { NULL, output, stride, 0, -1, NULL, 0, 0, NULL, NULL, 0, 0 };
+
+	result = decode_IDAT(decoder, &input, &target, info, buff, &chunk_length);
+	if (result == SUCCESS)
+	{
+		struct stage_time start = stage_begin(timer);
+		result = read_trailer(&input, buff, chunk_length);
+		stage_lap(timer, PNG_STAGE_PARSE, start);
+	}
+	if (result == SUCCESS && image != NULL)
+	{
+		describe_image(info, image);
+	}
+	stats_end(decoder, begin, &input, info->scaled_row_length * info->scaled_height);
+	return result;
+}
+
+void png_decoder_stats(const struct png_decoder *decoder, struct png_decode_stats *stats)
+{
+	*stats = decoder->stats;
+}
+
+const char *png_decoder_stage_name(enum png_stage stage)
+{
+	static const char *names[PNG_STAGE_COUNT] = { "parse", "inflate", "unfilter", "convert", "write" };
+	return stage >= 0 && stage < PNG_STAGE_COUNT ? names[stage] : "unknown";
+}
+
+#if defined(HAVE_POSIX)
+static pthread_once_t library_once = PTHREAD_ONCE_INIT;
+#endif
+
+// Detects the instruction sets and builds the tables every decoder shares
+static void library_init(void)
+{
+	unfilter_init();
+	convert_init();
+	crc32_init();
+}
+
+int png_decoder_create(struct png_decoder **decoder, const struct png_decode_options *options)
+{
+#if defined(HAVE_POSIX)
+	pthread_once(&library_once, library_init);
+#else
+	static int initialized;
+	if (!initialized)
+	{
+		library_init();
+		initialized = 1;
+	}
+#endif
+
+	if ((*decoder = calloc(1, sizeof(struct png_decoder))) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	if (options != NULL)
+	{
+		(*decoder)->options = *options;
+	}
+	(*decoder)->timer.stats = &(*decoder)->stats;
+	(*decoder)->timer.cpu = (*decoder)->options.stats == PNG_STATS_CPU;
+	int result = inflater_create(&(*decoder)->inflater);
+	if (result != SUCCESS)
+	{
+		free(*decoder);
+		*decoder = NULL;
+	}
+	return result;
+}
+
+void png_decoder_destroy(struct png_decoder *decoder)
+{
+	if (decoder == NULL)
+	{
+		return;
+	}
+	inflater_destroy(decoder->inflater);
+	arena_release(&decoder->arena);
+	free(decoder->spans);
+	free(decoder);
+}
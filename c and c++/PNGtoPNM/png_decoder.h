@@ -0,0 +1,129 @@
+#pragma once
+
+#include "inflater.h"
+
+#include <stddef.h>
+
+// PNG decoder that keeps its decompressor and buffers from one image to the next. A decoder is used by one thread at a
+// time, every function returns one of the return_codes.h values
+
+// The same for every image a decoder handles
+struct png_decode_options
+{
+	int pipelined;			   // decode through the three stage pipeline
+	const char *preview_name;	 // where interlaced images put a quarter size preview once pass 3 is done, others warn
+	int verify;				   // check the chunk crcs
+	int strip_alpha;		   // drop the alpha channel of gray+alpha and RGBA images
+	enum inflate_backend backend;	 // INFLATE_AUTO unless one is asked for
+	int stats;				   // one of the PNG_STATS levels, png_decoder_stats returns what was collected
+	int scale;				   // above 1 the image comes out that many times smaller in both directions, averaged over boxes
+	int scale_width, scale_height;	  // when both are set the image is box filtered down to at most this size instead
+	size_t memory_limit;	// bytes the decoder may hold for an image, ERROR_OUT_OF_MEMORY beyond; 0 for no limit
+	int inflate_threads;	// above 1 a mapped image whose IDAT chunks end on zlib full flushes is inflated on that many threads
+};
+
+#define PNG_STATS_OFF 0
+#define PNG_STATS_WALL 1	// counters and the wall time of every stage
+#define PNG_STATS_CPU 2		// the CPU time of every stage as well, which costs a system call per row and stage
+
+// Parts of a decode that are timed separately
+enum png_stage
+{
+	PNG_STAGE_PARSE,	  // reading and checking the chunks
+	PNG_STAGE_INFLATE,
+	PNG_STAGE_UNFILTER,
+	PNG_STAGE_CONVERT,	  // palette expansion, unpacking and alpha stripping; palette rows are unfiltered in the same pass
+	PNG_STAGE_WRITE,	// scaling included
+	PNG_STAGE_COUNT
+};
+
+struct png_decode_stats
+{
+	double seconds[PNG_STAGE_COUNT];	// the stages of a pipelined decode overlap and can add up to more than total_seconds
+	double cpu_seconds[PNG_STAGE_COUNT];
+	double total_seconds, total_cpu_seconds;
+	unsigned long long bytes_read, bytes_inflated, bytes_written;
+	unsigned int IDAT_chunks;
+	unsigned int inflate_segments;	  // pieces of the zlib stream inflated separately, 0 when it was inflated in one go
+	size_t peak_heap;		   // most bytes the buffers of the decoder held at once
+	unsigned int reallocs;	   // buffers allocated or grown, none once a decoder has seen an image as large
+};
+
+// Layout of the decoded rows, they hold the same samples as the PNM file of the image and are scaled like it
+struct png_image
+{
+	int width, height;
+	int channels;		   // 1 gray, 2 gray+alpha, 3 RGB, 4 RGBA; palette images come out as gray or RGB
+	int sample_size;	   // 1 or 2 bytes, 16 bit samples are big-endian
+	int maxval;			   // largest sample value
+	size_t row_length;	   // bytes of one row, the smallest stride png_decoder_decode_memory accepts
+};
+
+struct png_decoder;
+
+// options may be NULL for the defaults
+int png_decoder_create(struct png_decoder **decoder, const struct png_decode_options *options);
+
+void png_decoder_destroy(struct png_decoder *decoder);
+
+// Reads the layout of a PNG held in memory without decoding its pixels
+int png_decoder_read_info(struct png_decoder *decoder, const unsigned char *data, size_t size, struct png_image *image);
+
+// Decodes a PNG held in memory, row y goes to output + y * stride. image may be NULL, otherwise it receives the layout.
+// Returns ERROR_PARAMETER_INVALID when the rows do not fit into stride or output_size
+int png_decoder_decode_memory(struct png_decoder *decoder, const unsigned char *data, size_t size, unsigned char *output, size_t stride,
+							  size_t output_size, struct png_image *image);
+
+// Converts a PNG file into a PNM file, the output file is only left behind when the conversion succeeds. "-" reads stdin or
+// writes stdout: the input is then streamed through in IDAT sized pieces and rows go out while it still arrives, except for
+// an interlaced image, which is only complete at the end
+int png_decoder_convert_file(struct png_decoder *decoder, const char *input_name, const char *output_name);
+
+// The same for a PNG held in memory
+int png_decoder_convert_memory(struct png_decoder *decoder, const unsigned char *data, size_t size, const char *output_name);
+
+// Converts every frame of an APNG, composed onto the canvas with the dispose and blend ops of the frames the way a viewer
+// shows them. Each frame goes out as soon as it is decoded: when output_name holds a %d, e.g. "frame%03d.pnm", into a file
+// of its own numbered from 0, otherwise as the next image of one PNM stream, which netpbm reads as a multi-image file;
+// "-" is stdout. The canvas and, for frames that are disposed to the previous canvas, one copy of it are all that is held
+// besides the buffers of a single image. A PNG without an acTL chunk comes out as its one frame. frames receives how many
+// were written, numbered files stay behind when a later frame fails. Neither scale nor preview_name, ERROR_PARAMETER_INVALID
+int png_decoder_convert_frames(struct png_decoder *decoder, const char *input_name, const char *output_name, unsigned int *frames);
+
+#define PNG_PNM_HEADER_SIZE 128	   // fits every header png_decoder_pnm_header writes
+
+// P5 or P6, or PAM when the alpha channel is kept; what png_decoder_convert_file puts in front of the rows.
+// Returns the length of the header like snprintf
+int png_decoder_pnm_header(const struct png_image *image, char *header, size_t size);
+
+// What png_probe_file finds out from the chunk headers alone
+struct png_probe
+{
+	int width, height;
+	int bit_depth, color_type;	  // as IHDR has them
+	int interlaced;
+	unsigned long long IDAT_offset;	   // of the length of the first IDAT chunk
+	unsigned long long IDAT_bytes;	  // compressed data of all IDAT chunks, without their headers and crcs
+	unsigned int IDAT_chunks;
+};
+
+// Reads the header of every chunk up to the end of the IDAT chunks through stdio, seeking over the chunks themselves.
+// Needs no decoder, nothing is inflated and no crc is checked
+int png_probe_file(const char *input_name, struct png_probe *probe);
+
+#define PNG_FINGERPRINT_SIZE 16
+
+// What a conversion cache tells inputs apart by: two XXH64 chains over the IHDR, PLTE and IDAT data and the options that
+// change the PNM. Chunks that do not go into the PNM are walked over and nothing is inflated, so a file that fails to
+// decode can still get a fingerprint. With options->verify the crc of every chunk is checked, a mismatch is
+// ERROR_DATA_INVALID like in a conversion; "-" is not accepted
+int png_fingerprint_file(const char *input_name, const struct png_decode_options *options, unsigned char fingerprint[PNG_FINGERPRINT_SIZE]);
+
+int png_fingerprint_memory(const unsigned char *data, size_t size, const struct png_decode_options *options,
+						   unsigned char fingerprint[PNG_FINGERPRINT_SIZE]);
+
+// Stats of the last image the decoder handled, only filled in when it was created with stats
+void png_decoder_stats(const struct png_decoder *decoder, struct png_decode_stats *stats);
+
+// "parse", "inflate", "unfilter", "convert" or "write"
+const char *png_decoder_stage_name(enum png_stage stage);
@@ -0,0 +1,646 @@
+#if !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include "png_encoder.h"
+
+#include "chunk.h"
+#include "crc32.h"
+#include "filter.h"
+#include "input.h"
+#include "return_codes.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+#if defined(ZLIB)
+#include <zlib.h>
+#endif
+
+#define PNG_MAX_CHUNK 0x7FFFFFFFu	 // longest chunk the PNG specification allows
+
+#if defined(ZLIB)
+
+// Layout of the samples of a PNM file, which are the unfiltered rows of the PNG as they are
+struct pnm_image
+{
+	int width, height;
+	int channels;		 // 1 gray, 2 gray+alpha, 3 RGB, 4 RGBA
+	int sample_size;	 // 1 or 2 bytes, 16 bit samples are big-endian in both formats
+	size_t row_length;
+};
+
+static int next_byte(struct png_input *input)
+{
+	unsigned char byte;
+	return input_read(input, &byte, 1) == 1 ? byte : EOF;
+}
+
+// The next decimal number of a P5 or P6 header after whitespace and comments, -1 when there is none or it does not fit
+// into an int. *next receives the byte that ends it
+static long read_number(struct png_input *input, int *next)
+{
+	int c = next_byte(input);
+	while (c == '#' || isspace(c))
+	{
+		if (c == '#')
+		{
+			while (c != '\n' && c != EOF)
+			{
+				c = next_byte(input);
+			}
+		}
+		c = next_byte(input);
+	}
+	if (!isdigit(c))
+	{
+		return -1;
+	}
+	long value = 0;
+	for (; isdigit(c); c = next_byte(input))
+	{
+		if (value > (INT_MAX - (c - '0')) / 10)
+		{
+			return -1;
+		}
+		value = value * 10 + c - '0';
+	}
+	*next = c;
+	return value;
+}
+
+// The lines of a PAM header up to ENDHDR, the tuple type follows from the depth
+static int read_pam_header(struct png_input *input, long *width, long *height, long *depth, long *maxval)
+{
+	char line[256];
+	for (;;)
+	{
+		size_t length = 0;
+		int c;
+		while ((c = next_byte(input)) != '\n')
+		{
+			if (c == EOF)
+			{
+				return ERROR_DATA_INVALID;
+			}
+			if (length + 1 < sizeof(line))
+			{
+				line[length++] = (char)c;
+			}
+		}
+		line[length] = '\0';
+		if (strcmp(line, "ENDHDR") == 0)
+		{
+			return SUCCESS;
+		}
+		sscanf(line, "WIDTH %ld", width);
+		sscanf(line, "HEIGHT %ld", height);
+		sscanf(line, "DEPTH %ld", depth);
+		sscanf(line, "MAXVAL %ld", maxval);
+	}
+}
+
+static int read_pnm_header(struct png_input *input, struct pnm_image *image)
+{
+	unsigned char magic[2];
+	if (input_read(input, magic, 2) != 2 || magic[0] != 'P' || magic[1] < '5' || magic[1] > '7')
+	{
+		fprintf(stderr, "not a binary PNM file, P5, P6 or P7 expected\n");
+		return ERROR_DATA_INVALID;
+	}
+
+	long width = -1, height = -1, depth = magic[1] == '5' ? 1 : 3, maxval = -1;
+	int valid;
+	if (magic[1] == '7')
+	{
+		valid = next_byte(input) == '\n' && read_pam_header(input, &width, &height, &depth, &maxval) == SUCCESS;
+	}
+	else
+	{
+		// exactly one whitespace byte separates the maxval from the samples
+		int next = EOF;
+		width = read_number(input, &next);
+		height = read_number(input, &next);
+		maxval = read_number(input, &next);
+		valid = isspace(next);
+	}
+	if (!valid || width <= 0 || height <= 0 || depth < 1 || depth > 4 || maxval <= 0 || maxval > 65535)
+	{
+		fprintf(stderr, "invalid PNM header\n");
+		return ERROR_DATA_INVALID;
+	}
+	if (maxval != 255 && maxval != 65535)
+	{
+		fprintf(stderr, "only a maxval of 255 or 65535 is supported, not %ld\n", maxval);
+		return ERROR_UNSUPPORTED;
+	}
+
+	image->width = (int)width;
+	image->height = (int)height;
+	image->channels = (int)depth;
+	image->sample_size = maxval == 255 ? 1 : 2;
+	if ((size_t)width > SIZE_MAX / height / depth / image->sample_size)
+	{
+		fprintf(stderr, "image is too large\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	image->row_length = (size_t)width * depth * image->sample_size;
+	return SUCCESS;
+}
+
+// Points *pixels at the samples, in place when the input is mapped and read into *copy otherwise
+static int read_pixels(struct png_input *input, const struct pnm_image *image, const unsigned char **pixels, unsigned char **copy)
+{
+	size_t size = image->row_length * image->height;
+	*copy = NULL;
+	if (input->map != NULL)
+	{
+		*pixels = input_span(input, size);
+	}
+	else if ((*copy = malloc(size)) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	else
+	{
+		*pixels = input_read(input, *copy, size) == size ? *copy : NULL;
+	}
+	if (*pixels == NULL)
+	{
+		fprintf(stderr, "the PNM file is truncated\n");
+		return ERROR_DATA_INVALID;
+	}
+	return SUCCESS;
+}
+
+struct encode_block
+{
+	unsigned char *data;	// two bytes for the zlib header, the deflate data, four bytes for the adler-32 trailer
+	size_t length;			// of the deflate data
+	uLong adler;			// of the filtered rows of this block alone
+	size_t filtered_length;
+	int result;
+	int done;
+};
+
+struct encoder
+{
+	const unsigned char *pixels;
+	struct pnm_image image;
+	int level;
+	filter_function filter;
+	size_t rows_per_block;
+	size_t block_count;
+	struct encode_block *blocks;
+	size_t next_block;	  // the next one to be compressed
+	size_t written;		  // blocks written out, no block is taken more than window blocks ahead of them
+	size_t window;
+	int stopped;		// by the writer after an error
+#if defined(HAVE_POSIX)
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+#endif
+};
+
+// Every thread that compresses blocks has one, the writing thread included
+struct encode_worker
+{
+	struct encoder *encoder;
+	z_stream stream;
+	int stream_ready;
+	unsigned char *rows;	// the five candidate rows and a zero row above the first one
+#if defined(HAVE_POSIX)
+	pthread_t thread;
+#endif
+};
+
+static void encoder_lock(struct encoder *encoder)
+{
+#if defined(HAVE_POSIX)
+	pthread_mutex_lock(&encoder->lock);
+#else
+	(void)encoder;
+#endif
+}
+
+static void encoder_unlock(struct encoder *encoder)
+{
+#if defined(HAVE_POSIX)
+	pthread_mutex_unlock(&encoder->lock);
+#else
+	(void)encoder;
+#endif
+}
+
+static void encoder_wait(struct encoder *encoder)
+{
+#if defined(HAVE_POSIX)
+	pthread_cond_wait(&encoder->changed, &encoder->lock);
+#else
+	(void)encoder;
+#endif
+}
+
+static void encoder_broadcast(struct encoder *encoder)
+{
+#if defined(HAVE_POSIX)
+	pthread_cond_broadcast(&encoder->changed);
+#else
+	(void)encoder;
+#endif
+}
+
+// Called with the lock held
+static int can_take(const struct encoder *encoder)
+{
+	return !encoder->stopped && encoder->next_block < encoder->block_count && encoder->next_block < encoder->written + encoder->window;
+}
+
+// Filters the rows of one block and deflates them on their own, ending on a full flush or, for the last block, the end of the stream
+static int compress_block(struct encode_worker *worker, size_t index)
+{
+	struct encoder *encoder = worker->encoder;
+	struct encode_block *block = &encoder->blocks[index];
+	const struct pnm_image *image = &encoder->image;
+	size_t first = index * encoder->rows_per_block;
+	size_t end = first + encoder->rows_per_block < (size_t)image->height ? first + encoder->rows_per_block : (size_t)image->height;
+	int last = index + 1 == encoder->block_count;
+
+	if (!worker->stream_ready)
+	{
+		if (deflateInit2(&worker->stream, encoder->level, Z_DEFLATED, -15, 8, Z_FILTERED) != Z_OK)
+		{
+			fprintf(stderr, "failed to allocate compressor\n");
+			return ERROR_OUT_OF_MEMORY;
+		}
+		worker->stream_ready = 1;
+	}
+	else
+	{
+		deflateReset(&worker->stream);
+	}
+	block->filtered_length = (end - first) * (image->row_length + 1);
+	// the bound holds for a finished stream, a full flush adds at most an empty stored block
+	uLong bound = deflateBound(&worker->stream, block->filtered_length) + 16;
+	if ((block->data = malloc(2 + bound + 4)) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+
+	unsigned char *candidates[5];
+	for (int type = 0; type < 5; type++)
+	{
+		candidates[type] = worker->rows + type * (image->row_length + 1);
+	}
+	const unsigned char *zero_row = worker->rows + 5 * (image->row_length + 1);
+	int bytes_per_pixel = image->channels * image->sample_size;
+
+	worker->stream.next_out = block->data + 2;
+	worker->stream.avail_out = (uInt)bound;
+	block->adler = adler32(0, Z_NULL, 0);
+	for (size_t y = first; y < end; y++)
+	{
+		const unsigned char *row = encoder->pixels + y * image->row_length;
+		int type = encoder->filter(row, y > 0 ? row - image->row_length : zero_row, image->row_length, bytes_per_pixel, candidates);
+		block->adler = adler32(block->adler, candidates[type], (uInt)(image->row_length + 1));
+		worker->stream.next_in = candidates[type];
+		worker->stream.avail_in = (uInt)(image->row_length + 1);
+		int flush = y + 1 < end ? Z_NO_FLUSH : last ? Z_FINISH : Z_FULL_FLUSH;
+		int status = deflate(&worker->stream, flush);
+		if (status == Z_STREAM_ERROR || worker->stream.avail_in != 0 || (flush == Z_FINISH && status != Z_STREAM_END))
+		{
+			fprintf(stderr, "failed to compress data\n");
+			return ERROR_UNKNOWN;
+		}
+	}
+	block->length = bound - worker->stream.avail_out;
+	return SUCCESS;
+}
+
+static void finish_block(struct encoder *encoder, size_t index, int result)
+{
+	encoder_lock(encoder);
+	encoder->blocks[index].result = result;
+	encoder->blocks[index].done = 1;
+	encoder_broadcast(encoder);
+	encoder_unlock(encoder);
+}
+
+static void *encode_worker_run(void *argument)
+{
+	struct encode_worker *worker = argument;
+	struct encoder *encoder = worker->encoder;
+	for (;;)
+	{
+		encoder_lock(encoder);
+		while (!encoder->stopped && encoder->next_block < encoder->block_count && !can_take(encoder))
+		{
+			encoder_wait(encoder);
+		}
+		int taken = can_take(encoder);
+		size_t index = encoder->next_block;
+		encoder->next_block += taken;
+		encoder_unlock(encoder);
+		if (!taken)
+		{
+			return NULL;
+		}
+		finish_block(encoder, index, compress_block(worker, index));
+	}
+}
+
+// The writer compresses blocks of its own while the one it is to write next is not done, so without threads it does all the work
+static int wait_for_block(struct encode_worker *writer, size_t index)
+{
+	struct encoder *encoder = writer->encoder;
+	encoder_lock(encoder);
+	while (!encoder->blocks[index].done)
+	{
+		if (can_take(encoder))
+		{
+			size_t taken = encoder->next_block++;
+			encoder_unlock(encoder);
+			int result = compress_block(writer, taken);
+			finish_block(encoder, taken, result);
+			encoder_lock(encoder);
+		}
+		else
+		{
+			encoder_wait(encoder);
+		}
+	}
+	encoder_unlock(encoder);
+	return encoder->blocks[index].result;
+}
+
+// The zlib stream header for the compression level, FLEVEL only informs but is set the way zlib sets it
+static unsigned int zlib_header(int level)
+{
+	unsigned int flevel = level == Z_DEFAULT_COMPRESSION || level == 6 ? 2 : level < 2 ? 0 : level < 6 ? 1 : 3;
+	unsigned int header = 0x78 << 8 | flevel << 6;
+	return header + 31 - header % 31;
+}
+
+// Writes the blocks as they are done, in order, the first with the zlib header in front and the last with the adler-32 of all
+static int write_blocks(struct encode_worker *writer, FILE *file)
+{
+	struct encoder *encoder = writer->encoder;
+	uLong adler = adler32(0, Z_NULL, 0);
+	int result = SUCCESS;
+	for (size_t i = 0; result == SUCCESS && i < encoder->block_count; i++)
+	{
+		struct encode_block *block = &encoder->blocks[i];
+		if ((result = wait_for_block(writer, i)) != SUCCESS)
+		{
+			break;
+		}
+		adler = adler32_combine(adler, block->adler, (z_off_t)block->filtered_length);
+		unsigned char *begin = block->data + 2, *end = block->data + 2 + block->length;
+		if (i == 0)
+		{
+			unsigned int header = zlib_header(encoder->level);
+			*--begin = header & 0xFF;
+			*--begin = header >> 8;
+		}
+		if (i + 1 == encoder->block_count)
+		{
+			chunk_put_u32(end, (uint32_t)adler);
+			end += 4;
+		}
+		while (result == SUCCESS && begin < end)
+		{
+			size_t length = (size_t)(end - begin) < PNG_MAX_CHUNK ? (size_t)(end - begin) : PNG_MAX_CHUNK;
+			result = chunk_write(file, "IDAT", begin, length);
+			begin += length;
+		}
+
+		free(block->data);
+		block->data = NULL;
+		encoder_lock(encoder);
+		encoder->written++;
+		encoder_broadcast(encoder);
+		encoder_unlock(encoder);
+	}
+	return result;
+}
+
+static int worker_start(struct encode_worker *worker, struct encoder *encoder)
+{
+	worker->encoder = encoder;
+	if ((worker->rows = calloc(6, encoder->image.row_length + 1)) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	return SUCCESS;
+}
+
+static void worker_end(struct encode_worker *worker)
+{
+	if (worker->stream_ready)
+	{
+		deflateEnd(&worker->stream);
+	}
+	free(worker->rows);
+}
+
+// Compresses with threads - 1 workers plus the writing thread
+static int encode_rows(struct encoder *encoder, FILE *file, int threads)
+{
+	struct encode_worker *workers = calloc(threads, sizeof(struct encode_worker));
+	if (workers == NULL || (encoder->blocks = calloc(encoder->block_count, sizeof(struct encode_block))) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		free(workers);
+		return ERROR_OUT_OF_MEMORY;
+	}
+	encoder->window = 2 * (size_t)threads;
+#if defined(HAVE_POSIX)
+	pthread_mutex_init(&encoder->lock, NULL);
+	pthread_cond_init(&encoder->changed, NULL);
+#endif
+
+	int result = worker_start(&workers[0], encoder);
+	int started = 1;
+#if defined(HAVE_POSIX)
+	// a worker that cannot be started only costs parallelism
+	while (result == SUCCESS && started < threads && worker_start(&workers[started], encoder) == SUCCESS &&
+		   pthread_create(&workers[started].thread, NULL, encode_worker_run, &workers[started]) == 0)
+	{
+		started++;
+	}
+#endif
+	if (result == SUCCESS)
+	{
+		result = write_blocks(&workers[0], file);
+	}
+
+	encoder_lock(encoder);
+	encoder->stopped = 1;
+	encoder_broadcast(encoder);
+	encoder_unlock(encoder);
+#if defined(HAVE_POSIX)
+	for (int i = 1; i < started; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+	}
+	pthread_mutex_destroy(&encoder->lock);
+	pthread_cond_destroy(&encoder->changed);
+#endif
+	// the worker that failed to start, if any, has its rows but no thread
+	for (int i = 0; i < threads; i++)
+	{
+		worker_end(&workers[i]);
+	}
+	for (size_t i = 0; i < encoder->block_count; i++)
+	{
+		free(encoder->blocks[i].data);
+	}
+	free(encoder->blocks);
+	free(workers);
+	return result;
+}
+
+static int encode_image(struct encoder *encoder, const char *output_name, const struct png_encode_options *options)
+{
+	const struct pnm_image *image = &encoder->image;
+	// zlib counts its buffers in unsigned ints
+	if (image->row_length >= UINT_MAX / 2)
+	{
+		fprintf(stderr, "rows of %zu bytes are too long\n", image->row_length);
+		return ERROR_UNSUPPORTED;
+	}
+	size_t block_size = options->block_size ? options->block_size : PNG_ENCODE_BLOCK_SIZE;
+	encoder->rows_per_block = block_size / (image->row_length + 1) + (block_size % (image->row_length + 1) != 0);
+	encoder->block_count = (image->height + encoder->rows_per_block - 1) / encoder->rows_per_block;
+	encoder->level = options->level ? options->level : Z_DEFAULT_COMPRESSION;
+	encoder->filter = filter_select();
+
+	long threads = options->threads;
+#if defined(HAVE_POSIX)
+	if (threads <= 0)
+	{
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+#else
+	threads = 1;
+#endif
+	threads = threads < 1 ? 1 : (size_t)threads > encoder->block_count ? (long)encoder->block_count : threads;
+
+	// the output is removed again if the encoding fails, what went to stdout cannot be taken back
+	int to_stdout = strcmp(output_name, "-") == 0;
+	FILE *file;
+	if (to_stdout)
+	{
+#if defined(_WIN32)
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		file = stdout;
+	}
+	else if ((file = fopen(output_name, "wb")) == NULL)
+	{
+		fprintf(stderr, "cannot open file %s\n", output_name);
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+
+	static const unsigned char signature[8] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
+	static const unsigned char color_types[5] = { 0, 0, 4, 2, 6 };
+	unsigned char header[13];
+	chunk_put_u32(header, image->width);
+	chunk_put_u32(header + 4, image->height);
+	header[8] = 8 * image->sample_size;
+	header[9] = color_types[image->channels];
+	header[10] = header[11] = header[12] = 0;
+	int result = fwrite(signature, 1, 8, file) == 8 ? chunk_write(file, "IHDR", header, 13) : ERROR_UNKNOWN;
+	if (result == SUCCESS)
+	{
+		result = encode_rows(encoder, file, (int)threads);
+	}
+	if (result == SUCCESS)
+	{
+		result = chunk_write(file, "IEND", NULL, 0);
+	}
+	if ((to_stdout ? fflush(file) : fclose(file)) != 0 && result == SUCCESS)
+	{
+		fprintf(stderr, "error while writing a file\n");
+		result = ERROR_UNKNOWN;
+	}
+	if (result != SUCCESS && !to_stdout)
+	{
+		remove(output_name);
+	}
+	return result;
+}
+
+#if defined(HAVE_POSIX)
+static pthread_once_t library_once = PTHREAD_ONCE_INIT;
+#endif
+
+static void library_init(void)
+{
+	filter_init();
+	crc32_init();
+}
+
+int png_encode_file(const char *input_name, const char *output_name, const struct png_encode_options *options)
+{
+#if defined(HAVE_POSIX)
+	pthread_once(&library_once, library_init);
+#else
+	static int initialized;
+	if (!initialized)
+	{
+		library_init();
+		initialized = 1;
+	}
+#endif
+	struct png_encode_options defaults = { 0 };
+	struct png_input input;
+	if (input_open(&input, input_name) != SUCCESS)
+	{
+		fprintf(stderr, "Cannot open file %s\n", input_name);
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+
+	struct encoder encoder = { 0 };
+	unsigned char *copy = NULL;
+	int result = read_pnm_header(&input, &encoder.image);
+	if (result == SUCCESS)
+	{
+		result = read_pixels(&input, &encoder.image, &encoder.pixels, &copy);
+	}
+	if (result == SUCCESS)
+	{
+		result = encode_image(&encoder, output_name, options != NULL ? options : &defaults);
+	}
+	free(copy);
+	input_close(&input);
+	return result;
+}
+
+#else
+
+int png_encode_file(const char *input_name, const char *output_name, const struct png_encode_options *options)
+{
+	(void)input_name;
+	(void)output_name;
+	(void)options;
+	fprintf(stderr, "encoding needs zlib\n");
+	return ERROR_UNSUPPORTED;
+}
+
+#endif
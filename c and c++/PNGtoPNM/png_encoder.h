@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+
+// PNM to PNG encoder for P5, P6 and PAM files with a maxval of 255 or 65535, which covers everything png_decoder writes.
+// Every row gets the filter type with the least sum of absolute differences. The rows are compressed in blocks by several
+// threads at once, pigz style: each block ends on a zlib full flush, so it does not refer back to the blocks before it, and
+// goes out as IDAT chunks of its own. Needs zlib, ERROR_UNSUPPORTED without it
+
+// Uncompressed bytes of a block unless asked otherwise; every block starts without the 32 KiB window of the one before,
+// which costs a few hundred bytes of output each
+#define PNG_ENCODE_BLOCK_SIZE (512 * 1024)
+
+struct png_encode_options
+{
+	int threads;		  // blocks compressed at once, 0 for one per processor
+	int level;			  // zlib compression level from 1 to 9, 0 for zlib's default
+	size_t block_size;	  // uncompressed bytes of a block, rounded up to whole rows; 0 for PNG_ENCODE_BLOCK_SIZE
+};
+
+// Encodes a PNM file as a PNG file, the output file is only left behind when the encoding succeeds. "-" reads stdin or
+// writes stdout. options may be NULL for the defaults; returns one of the return_codes.h values
+int png_encode_file(const char *input_name, const char *output_name, const struct png_encode_options *options);
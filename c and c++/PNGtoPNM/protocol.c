@@ -0,0 +1,61 @@
+#include "protocol.h"
+
+#include "return_codes.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+void protocol_put(unsigned char *buffer, uint32_t value)
+{
+	buffer[0] = (unsigned char)(value >> 24);
+	buffer[1] = (unsigned char)(value >> 16);
+	buffer[2] = (unsigned char)(value >> 8);
+	buffer[3] = (unsigned char)value;
+}
+
+uint32_t protocol_get(const unsigned char *buffer)
+{
+	return (uint32_t)buffer[0] << 24 | (uint32_t)buffer[1] << 16 | (uint32_t)buffer[2] << 8 | buffer[3];
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+size_t protocol_read(int fd, void *buffer, size_t length)
+{
+	size_t done = 0;
+	while (done < length)
+	{
+		ssize_t got = read(fd, (unsigned char *)buffer + done, length - done);
+		if (got < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (got <= 0)
+		{
+			break;
+		}
+		done += got;
+	}
+	return done;
+}
+
+int protocol_write(int fd, const void *buffer, size_t length)
+{
+	size_t done = 0;
+	while (done < length)
+	{
+		ssize_t put = write(fd, (const unsigned char *)buffer + done, length - done);
+		if (put < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (put <= 0)
+		{
+			return ERROR_UNKNOWN;
+		}
+		done += put;
+	}
+	return SUCCESS;
+}
+#endif
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Requests and responses of the conversion daemon over a UNIX stream socket. Every number is 32 bit big-endian like the
+// fields of a PNG, and a connection carries any number of requests one after the other.
+//
+// request:  type, flags, input length, input, output length, output
+//   PROTOCOL_CONVERT: input is the path of a PNG, or the PNG itself with PROTOCOL_INLINE_INPUT; output is the path of
+//   the PNM, or empty with PROTOCOL_INLINE_OUTPUT to get the PNM back. Paths are resolved by the daemon
+//   PROTOCOL_STATS: input and output are empty
+// response: result (a return_codes.h value), length, data: the PNM for PROTOCOL_INLINE_OUTPUT, key=value counters
+//   for PROTOCOL_STATS, nothing otherwise
+
+#define PROTOCOL_CONVERT 1
+#define PROTOCOL_STATS 2
+
+#define PROTOCOL_INLINE_INPUT 1
+#define PROTOCOL_INLINE_OUTPUT 2
+
+#define PROTOCOL_MAX_PATH 4096
+#define PROTOCOL_MAX_INLINE (256u * 1024 * 1024)	// largest PNG a request carries, the daemon closes the connection beyond
+
+void protocol_put(unsigned char *buffer, uint32_t value);
+
+uint32_t protocol_get(const unsigned char *buffer);
+
+// The socket functions are only there on POSIX
+
+// Same contract as fread: fewer bytes than length only at the end of the stream or on an error
+size_t protocol_read(int fd, void *buffer, size_t length);
+
+// SUCCESS or ERROR_UNKNOWN once the peer is gone
+int protocol_write(int fd, const void *buffer, size_t length);
@@ -0,0 +1,536 @@
+#if !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include "server.h"
+
+#include "protocol.h"
+#include "return_codes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#if defined(HAVE_POSIX)
+#define SERVER_PENDING 256	  // accepted connections waiting for a worker, more are turned away
+#define SERVER_LATENCY_BUCKETS 24	 // bucket k counts the requests done within 2^k microseconds, the last one all slower ones
+#define SERVER_IDLE_SECONDS 30	  // a connection that sends or takes nothing for this long gives its worker back
+#define SERVER_KEEP_BUFFER ((size_t)16 << 20)	 // a larger request buffer is freed once the request is answered
+
+struct server_counters
+{
+	unsigned long long requests, failures;
+	unsigned long long bytes_in, bytes_out;	   // over the socket
+	unsigned long long latency[SERVER_LATENCY_BUCKETS];
+};
+
+struct server_worker
+{
+	struct server *server;
+	pthread_t thread;
+	struct png_decoder *decoder;
+	unsigned char *input, *output;	  // inline PNGs and the PNMs that go back, kept like the buffers of the decoder
+	size_t input_capacity, output_capacity;
+	int connection;	   // -1 while the worker waits for one
+};
+
+struct server
+{
+	int listener;
+	pthread_mutex_t lock;	 // the queue, the counters and the connections of the workers
+	pthread_cond_t ready;
+	int pending[SERVER_PENDING];
+	int head, count;
+	int stopping;
+	struct server_counters counters;
+	struct server_worker *workers;
+	int worker_count;
+	size_t memory_limit;	// of --memory-limit, bounds the request buffers of a worker like the buffers of its decoder
+};
+
+static volatile sig_atomic_t stop_requested;
+
+static void request_stop(int signal)
+{
+	(void)signal;
+	stop_requested = 1;
+}
+
+// limit is 0 for none
+static int grow(unsigned char **buffer, size_t *capacity, size_t size, size_t limit)
+{
+	if (*capacity >= size)
+	{
+		return SUCCESS;
+	}
+	if (limit != 0 && size > limit)
+	{
+		fprintf(stderr, "the request needs more memory than the limit of %zu bytes\n", limit);
+		return ERROR_OUT_OF_MEMORY;
+	}
+	unsigned char *temp = realloc(*buffer, size);
+	if (temp == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	*buffer = temp;
+	*capacity = size;
+	return SUCCESS;
+}
+
+// Reads a whole PNG file into the input buffer of the worker
+static int read_file(struct server_worker *worker, const char *path, size_t *size)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		fprintf(stderr, "Cannot open file %s\n", path);
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	int result = SUCCESS;
+	size_t limit = worker->server->memory_limit;
+	*size = 0;
+	for (;;)
+	{
+		// doubling stops at the limit, only a file larger than that fails
+		size_t capacity = *size ? *size * 2 : 65536;
+		capacity = limit != 0 && capacity > limit && *size < limit ? limit : capacity;
+		if (*size == worker->input_capacity && (result = grow(&worker->input, &worker->input_capacity, capacity, limit)) != SUCCESS)
+		{
+			break;
+		}
+		size_t read = fread(worker->input + *size, 1, worker->input_capacity - *size, file);
+		*size += read;
+		if (read == 0)
+		{
+			result = ferror(file) ? ERROR_DATA_INVALID : SUCCESS;
+			break;
+		}
+	}
+	fclose(file);
+	return result;
+}
+
+// Decodes a PNG held in memory into a PNM in the output buffer of the worker
+static int convert_inline(struct server_worker *worker, const unsigned char *png, size_t size, size_t *length)
+{
+	struct png_image image;
+	char header[PNG_PNM_HEADER_SIZE];
+	int result = png_decoder_read_info(worker->decoder, png, size, &image);
+	if (result != SUCCESS)
+	{
+		return result;
+	}
+	size_t header_length = png_decoder_pnm_header(&image, header, sizeof(header));
+	if ((size_t)image.height > (SIZE_MAX - header_length) / image.row_length)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	*length = header_length + image.row_length * image.height;
+	// the PNG stays in the input buffer meanwhile
+	size_t limit = worker->server->memory_limit;
+	if (limit != 0 && size >= limit)
+	{
+		fprintf(stderr, "the request needs more memory than the limit of %zu bytes\n", limit);
+		return ERROR_OUT_OF_MEMORY;
+	}
+	if ((result = grow(&worker->output, &worker->output_capacity, *length, limit != 0 ? limit - size : 0)) != SUCCESS)
+	{
+		return result;
+	}
+	memcpy(worker->output, header, header_length);
+	return png_decoder_decode_memory(worker->decoder, png, size, worker->output + header_length, image.row_length,
+									 *length - header_length, NULL);
+}
+
+// key=value pairs on one line, the latency buckets that are empty are left out
+static size_t format_counters(struct server *server, char *text, size_t size)
+{
+	pthread_mutex_lock(&server->lock);
+	struct server_counters counters = server->counters;
+	pthread_mutex_unlock(&server->lock);
+
+	size_t length = snprintf(text, size, "requests=%llu failures=%llu bytes_in=%llu bytes_out=%llu workers=%d", counters.requests,
+							 counters.failures, counters.bytes_in, counters.bytes_out, server->worker_count);
+	for (int k = 0; k < SERVER_LATENCY_BUCKETS && length < size; k++)
+	{
+		if (counters.latency[k] != 0)
+		{
+			length += k < SERVER_LATENCY_BUCKETS - 1 ? snprintf(text + length, size - length, " latency_us_le_%lu=%llu", 1ul << k, counters.latency[k])
+													 : snprintf(text + length, size - length, " latency_us_gt_%lu=%llu", 1ul << (k - 1), counters.latency[k]);
+		}
+	}
+	if (length < size)
+	{
+		length += snprintf(text + length, size - length, "\n");
+	}
+	return length < size ? length : size - 1;
+}
+
+static double now_seconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Reads past length bytes of a request, returns how many there were
+static size_t skip_input(int fd, size_t length)
+{
+	unsigned char buffer[65536];
+	size_t skipped = 0;
+	while (skipped < length)
+	{
+		size_t part = length - skipped < sizeof(buffer) ? length - skipped : sizeof(buffer);
+		size_t got = protocol_read(fd, buffer, part);
+		skipped += got;
+		if (got != part)
+		{
+			break;
+		}
+	}
+	return skipped;
+}
+
+// Serves one request, returns SUCCESS while the connection can carry the next one
+static int serve_request(struct server_worker *worker, int fd)
+{
+	unsigned char head[12];
+	char output_name[PROTOCOL_MAX_PATH + 1];
+	size_t received = protocol_read(fd, head, sizeof(head));
+	if (received != sizeof(head))
+	{
+		// the client is done, or went away in the middle of a request
+		return ERROR_DATA_INVALID;
+	}
+	uint32_t type = protocol_get(head), flags = protocol_get(head + 4), input_length = protocol_get(head + 8);
+	if ((type != PROTOCOL_CONVERT && type != PROTOCOL_STATS) ||
+		input_length > (flags & PROTOCOL_INLINE_INPUT ? PROTOCOL_MAX_INLINE : PROTOCOL_MAX_PATH))
+	{
+		fprintf(stderr, "invalid request\n");
+		return ERROR_DATA_INVALID;
+	}
+	// a request over the memory limit is read past and answered with the error
+	int result = grow(&worker->input, &worker->input_capacity, (size_t)input_length + 1, worker->server->memory_limit);
+	size_t got = result == SUCCESS ? protocol_read(fd, worker->input, input_length) : skip_input(fd, input_length);
+	if ((result != SUCCESS && result != ERROR_OUT_OF_MEMORY) || got != input_length || protocol_read(fd, head, 4) != 4)
+	{
+		return ERROR_DATA_INVALID;
+	}
+	uint32_t output_length = protocol_get(head);
+	if (output_length > PROTOCOL_MAX_PATH || protocol_read(fd, output_name, output_length) != output_length)
+	{
+		return ERROR_DATA_INVALID;
+	}
+	if (result == SUCCESS)
+	{
+		worker->input[input_length] = '\0';
+	}
+	output_name[output_length] = '\0';
+
+	double start = now_seconds();
+	const unsigned char *data = NULL;
+	size_t length = 0;
+	char text[1024];
+	if (result != SUCCESS)
+	{
+		// answered with the error below
+	}
+	else if (type == PROTOCOL_STATS)
+	{
+		length = format_counters(worker->server, text, sizeof(text));
+		data = (const unsigned char *)text;
+	}
+	else if (!(flags & PROTOCOL_INLINE_OUTPUT))
+	{
+		result = flags & PROTOCOL_INLINE_INPUT ? png_decoder_convert_memory(worker->decoder, worker->input, input_length, output_name)
+											   : png_decoder_convert_file(worker->decoder, (const char *)worker->input, output_name);
+	}
+	else
+	{
+		size_t size = input_length;
+		if (!(flags & PROTOCOL_INLINE_INPUT))
+		{
+			result = read_file(worker, (const char *)worker->input, &size);
+		}
+		if (result == SUCCESS)
+		{
+			result = convert_inline(worker, worker->input, size, &length);
+			data = worker->output;
+		}
+	}
+	if (result != SUCCESS)
+	{
+		length = 0;
+	}
+
+	protocol_put(head, (uint32_t)result);
+	protocol_put(head + 4, (uint32_t)length);
+	int sent = protocol_write(fd, head, 8) == SUCCESS && protocol_write(fd, data, length) == SUCCESS;
+
+	// the latency covers the conversion and the response, not the time the request took to arrive
+	double microseconds = (now_seconds() - start) * 1e6;
+	int bucket = 0;
+	while (bucket < SERVER_LATENCY_BUCKETS - 1 && microseconds > (double)(1ul << bucket))
+	{
+		bucket++;
+	}
+	if (type == PROTOCOL_CONVERT)
+	{
+		pthread_mutex_lock(&worker->server->lock);
+		struct server_counters *counters = &worker->server->counters;
+		counters->requests++;
+		counters->failures += result != SUCCESS;
+		counters->bytes_in += sizeof(head) + 4 + input_length + output_length;
+		counters->bytes_out += 8 + length;
+		counters->latency[bucket]++;
+		pthread_mutex_unlock(&worker->server->lock);
+	}
+	return sent ? SUCCESS : ERROR_UNKNOWN;
+}
+
+static void *server_worker_run(void *argument)
+{
+	struct server_worker *worker = argument;
+	struct server *server = worker->server;
+	for (;;)
+	{
+		pthread_mutex_lock(&server->lock);
+		while (server->count == 0 && !server->stopping)
+		{
+			pthread_cond_wait(&server->ready, &server->lock);
+		}
+		if (server->stopping)
+		{
+			pthread_mutex_unlock(&server->lock);
+			break;
+		}
+		int fd = server->pending[server->head];
+		server->head = (server->head + 1) % SERVER_PENDING;
+		server->count--;
+		worker->connection = fd;
+		pthread_mutex_unlock(&server->lock);
+
+		while (serve_request(worker, fd) == SUCCESS)
+		{
+			// one large request does not keep its buffers for the life of the daemon
+			if (worker->input_capacity > SERVER_KEEP_BUFFER)
+			{
+				free(worker->input);
+				worker->input = NULL;
+				worker->input_capacity = 0;
+			}
+			if (worker->output_capacity > SERVER_KEEP_BUFFER)
+			{
+				free(worker->output);
+				worker->output = NULL;
+				worker->output_capacity = 0;
+			}
+		}
+
+		pthread_mutex_lock(&server->lock);
+		worker->connection = -1;
+		pthread_mutex_unlock(&server->lock);
+		close(fd);
+	}
+	return NULL;
+}
+
+// Binds the socket, a socket left behind by an earlier run is replaced but nothing else is
+static int server_listen(struct server *server, const char *path)
+{
+	struct sockaddr_un address = { 0 };
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path))
+	{
+		fprintf(stderr, "socket path %s is too long\n", path);
+		return ERROR_PARAMETER_INVALID;
+	}
+	strcpy(address.sun_path, path);
+
+	struct stat status;
+	if (stat(path, &status) == 0 && S_ISSOCK(status.st_mode))
+	{
+		unlink(path);
+	}
+	if ((server->listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	{
+		fprintf(stderr, "cannot create a socket\n");
+		return ERROR_UNKNOWN;
+	}
+	if (bind(server->listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(server->listener, 64) != 0)
+	{
+		fprintf(stderr, "cannot listen on %s\n", path);
+		close(server->listener);
+		return ERROR_CANNOT_OPEN_FILE;
+	}
+	return SUCCESS;
+}
+
+int server_main(int argc, char *argv[], const struct png_decode_options *options)
+{
+	if (argc < 1 || argc > 2)
+	{
+		fprintf(stderr, "--daemon takes a socket path and optionally the number of workers\n");
+		return ERROR_PARAMETER_INVALID;
+	}
+	long workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (argc == 2)
+	{
+		char *end;
+		workers = strtol(argv[1], &end, 10);
+		if (*end != '\0' || workers <= 0 || workers > 1024)
+		{
+			fprintf(stderr, "Invalid number of workers %s\n", argv[1]);
+			return ERROR_PARAMETER_INVALID;
+		}
+	}
+	workers = workers < 1 ? 1 : workers;
+
+	struct server server = { 0 };
+	server.worker_count = (int)workers;
+	server.memory_limit = options->memory_limit;
+	if ((server.workers = calloc(workers, sizeof(struct server_worker))) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return ERROR_OUT_OF_MEMORY;
+	}
+	int result = SUCCESS;
+	for (int i = 0; result == SUCCESS && i < server.worker_count; i++)
+	{
+		server.workers[i].server = &server;
+		server.workers[i].connection = -1;
+		result = png_decoder_create(&server.workers[i].decoder, options);
+	}
+	if (result == SUCCESS)
+	{
+		result = server_listen(&server, argv[0]);
+	}
+	if (result != SUCCESS)
+	{
+		for (int i = 0; i < server.worker_count; i++)
+		{
+			png_decoder_destroy(server.workers[i].decoder);
+		}
+		free(server.workers);
+		return result;
+	}
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_cond_init(&server.ready, NULL);
+
+	// only the accepting thread sees the signals, its accept returns EINTR so that the loop can see stop_requested
+	struct sigaction action = { 0 };
+	action.sa_handler = request_stop;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	sigset_t stop_signals, previous;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &previous);
+	int started = 0;
+	while (started < server.worker_count && pthread_create(&server.workers[started].thread, NULL, server_worker_run, &server.workers[started]) == 0)
+	{
+		started++;
+	}
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+	if (started == 0)
+	{
+		fprintf(stderr, "failed to start a thread\n");
+		result = ERROR_UNKNOWN;
+	}
+	else
+	{
+		fprintf(stderr, "listening on %s with %d workers\n", argv[0], started);
+	}
+
+	while (result == SUCCESS && !stop_requested)
+	{
+		int fd = accept(server.listener, NULL, NULL);
+		if (fd < 0)
+		{
+			if (errno != EINTR && errno != ECONNABORTED)
+			{
+				fprintf(stderr, "accept failed\n");
+				result = ERROR_UNKNOWN;
+			}
+			continue;
+		}
+		// a worker stays with its connection between requests, so an idle client must not keep it forever
+		struct timeval idle = { SERVER_IDLE_SECONDS, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
+		pthread_mutex_lock(&server.lock);
+		if (server.count == SERVER_PENDING)
+		{
+			close(fd);
+		}
+		else
+		{
+			server.pending[(server.head + server.count) % SERVER_PENDING] = fd;
+			server.count++;
+			pthread_cond_signal(&server.ready);
+		}
+		pthread_mutex_unlock(&server.lock);
+	}
+
+	// connections a worker holds see the end of their input once the request being served is answered
+	pthread_mutex_lock(&server.lock);
+	server.stopping = 1;
+	for (int i = 0; i < server.worker_count; i++)
+	{
+		if (server.workers[i].connection >= 0)
+		{
+			shutdown(server.workers[i].connection, SHUT_RD);
+		}
+	}
+	pthread_cond_broadcast(&server.ready);
+	pthread_mutex_unlock(&server.lock);
+	for (int i = 0; i < started; i++)
+	{
+		pthread_join(server.workers[i].thread, NULL);
+	}
+	for (; server.count > 0; server.count--, server.head = (server.head + 1) % SERVER_PENDING)
+	{
+		close(server.pending[server.head]);
+	}
+
+	close(server.listener);
+	unlink(argv[0]);
+	for (int i = 0; i < server.worker_count; i++)
+	{
+		png_decoder_destroy(server.workers[i].decoder);
+		free(server.workers[i].input);
+		free(server.workers[i].output);
+	}
+	pthread_cond_destroy(&server.ready);
+	pthread_mutex_destroy(&server.lock);
+	free(server.workers);
+	return result;
+}
+#else
+int server_main(int argc, char *argv[], const struct png_decode_options *options)
+{
+	(void)argc;
+	(void)argv;
+	(void)options;
+	fprintf(stderr, "--daemon needs UNIX domain sockets\n");
+	return ERROR_UNSUPPORTED;
+}
+#endif
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "png_decoder.h"
+
+// --daemon <socket_path> [<workers>]: listens on a UNIX socket and serves the requests of protocol.h from a pool of
+// workers that each keep a decoder, and with it the inflater and the buffers, from one request to the next. A worker
+// serves one connection at a time and closes it once the client has sent or read nothing for 30 seconds. Runs until
+// SIGINT or SIGTERM. A request whose inline input or output would take a worker past --memory-limit is answered with
+// ERROR_OUT_OF_MEMORY, and buffers over 16 MiB are freed once their request is done. argv starts after --daemon; ERROR_UNSUPPORTED where there are no UNIX sockets
+int server_main(int argc, char *argv[], const struct png_decode_options *options);
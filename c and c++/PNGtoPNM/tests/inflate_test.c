@@ -0,0 +1,164 @@
+// Decodes PNGs whose IDAT chunks end on zlib full flushes with one and with two inflate threads and checks both against
+// the pixels they were made from. Covers the stream layouts encoders produce around the last restart point, among them
+// the one where all the image data ends on a full flush and only the empty final block follows in an IDAT of its own.
+// From the PNGtoPNM directory:
+//   gcc -O2 -DZLIB -I. -o inflate_test tests/inflate_test.c png_decoder.c inflater.c unfilter.c convert.c input.c
+//       crc32.c arena.c paths.c cpu.c chunk.c xxh64.c -lz -lm -lpthread && ./inflate_test
+// Prints the failures and returns 1 on any, 0 otherwise
+
+#include "chunk.h"
+#include "png_decoder.h"
+#include "return_codes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define WIDTH 200
+#define HEIGHT 120
+#define MAX_FLUSHES 4
+
+// Where the encoder ends IDAT chunks: after a full flush at each fraction of the image data, then after Z_FINISH
+struct layout
+{
+	const char *name;
+	int flushes;
+	double at[MAX_FLUSHES];
+};
+
+static const struct layout layouts[] = {
+	{ "final block alone", 1, { 1.0 } },
+	{ "two halves", 2, { 0.5, 1.0 } },
+	{ "three parts", 3, { 0.25, 0.6, 1.0 } },
+	{ "two halves, the last with the final block", 1, { 0.5 } },
+};
+
+static unsigned int seed = 12345;
+
+static unsigned int next_random(void)
+{
+	seed = seed * 1103515245u + 12345u;
+	return seed >> 8;
+}
+
+static unsigned char *put_IDAT(unsigned char *out, const unsigned char *data, size_t length)
+{
+	return chunk_put(out, "IDAT", data, length);
+}
+
+// Writes a gray 8 bit PNG of pixels, filter type none, and returns its size or 0
+static size_t make_png(const struct layout *layout, const unsigned char *pixels, unsigned char *png, size_t capacity)
+{
+	size_t raw_size = (size_t)HEIGHT * (WIDTH + 1);
+	unsigned char *raw = malloc(raw_size);
+	unsigned char *deflated = malloc(compressBound(raw_size) + 64 * MAX_FLUSHES);
+	if (raw == NULL || deflated == NULL || capacity < compressBound(raw_size) + 1024)
+	{
+		free(raw);
+		free(deflated);
+		return 0;
+	}
+	for (int y = 0; y < HEIGHT; y++)
+	{
+		raw[(size_t)y * (WIDTH + 1)] = 0;
+		memcpy(raw + (size_t)y * (WIDTH + 1) + 1, pixels + (size_t)y * WIDTH, WIDTH);
+	}
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	unsigned char header[13] = { 0 };
+	chunk_put_u32(header, WIDTH);
+	chunk_put_u32(header + 4, HEIGHT);
+	header[8] = 8;
+	unsigned char *out = png;
+	memcpy(out, signature, sizeof(signature));
+	out = chunk_put(out + sizeof(signature), "IHDR", header, sizeof(header));
+
+	z_stream stream = { 0 };
+	if (deflateInit(&stream, 6) != Z_OK)
+	{
+		free(raw);
+		free(deflated);
+		return 0;
+	}
+	stream.next_in = raw;
+	stream.next_out = deflated;
+	stream.avail_out = (uInt)(compressBound(raw_size) + 64 * MAX_FLUSHES);
+	size_t fed = 0;
+	int ok = 1;
+	for (int i = 0; i < layout->flushes && ok; i++)
+	{
+		size_t end = (size_t)(layout->at[i] * raw_size);
+		stream.avail_in = (uInt)(end - fed);
+		fed = end;
+		unsigned char *start = stream.next_out;
+		ok = deflate(&stream, Z_FULL_FLUSH) == Z_OK && stream.avail_in == 0;
+		out = put_IDAT(out, start, (size_t)(stream.next_out - start));
+	}
+	stream.avail_in = (uInt)(raw_size - fed);
+	unsigned char *start = stream.next_out;
+	ok = ok && deflate(&stream, Z_FINISH) == Z_STREAM_END;
+	out = put_IDAT(out, start, (size_t)(stream.next_out - start));
+	out = chunk_put(out, "IEND", NULL, 0);
+	deflateEnd(&stream);
+	free(raw);
+	free(deflated);
+	return ok ? (size_t)(out - png) : 0;
+}
+
+int main(void)
+{
+	unsigned char *pixels = malloc((size_t)WIDTH * HEIGHT);
+	unsigned char *decoded = malloc((size_t)WIDTH * HEIGHT);
+	size_t capacity = compressBound((size_t)HEIGHT * (WIDTH + 1)) + 4096;
+	unsigned char *png = malloc(capacity);
+	if (pixels == NULL || decoded == NULL || png == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	// smooth enough to compress, noisy enough to need a few blocks
+	for (size_t i = 0; i < (size_t)WIDTH * HEIGHT; i++)
+	{
+		pixels[i] = (unsigned char)(i % WIDTH + (next_random() & 7));
+	}
+
+	int failures = 0, cases = 0;
+	for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++)
+	{
+		size_t size = make_png(&layouts[l], pixels, png, capacity);
+		if (size == 0)
+		{
+			printf("FAIL %s: could not make the PNG\n", layouts[l].name);
+			failures++;
+			continue;
+		}
+		for (int threads = 1; threads <= 2; threads++)
+		{
+			struct png_decode_options options = { 0 };
+			options.inflate_threads = threads;
+			struct png_decoder *decoder;
+			if (png_decoder_create(&decoder, &options) != SUCCESS)
+			{
+				fprintf(stderr, "out of memory\n");
+				return 1;
+			}
+			memset(decoded, 0, (size_t)WIDTH * HEIGHT);
+			int result = png_decoder_decode_memory(decoder, png, size, decoded, WIDTH, (size_t)WIDTH * HEIGHT, NULL);
+			png_decoder_destroy(decoder);
+			cases++;
+			if (result != SUCCESS || memcmp(decoded, pixels, (size_t)WIDTH * HEIGHT) != 0)
+			{
+				failures++;
+				printf("FAIL %s, %d thread%s: %s\n", layouts[l].name, threads, threads > 1 ? "s" : "",
+					   result != SUCCESS ? "not decoded" : "wrong pixels");
+			}
+		}
+	}
+
+	printf("%d cases, %d failures\n", cases, failures);
+	free(pixels);
+	free(decoded);
+	free(png);
+	return failures != 0;
+}
@@ -0,0 +1,131 @@
+// Checks every unfilter kernel unfilter_select can pick against the scalar ones and against the PNG specification, with
+// the wider instruction sets hidden in turn so that the SSE2 and SSSE3 kernels run on an AVX2 processor too.
+// From the PNGtoPNM directory:
+//   gcc -O2 -I. -o unfilter_test tests/unfilter_test.c unfilter.c cpu.c && ./unfilter_test
+// Prints the failures and returns 1 on any, 0 otherwise
+
+#include "cpu.h"
+#include "paeth.h"
+#include "unfilter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GUARD 64	// bytes after a row that no kernel may touch
+#define ROWS 200	// random rows per filter type and pixel size
+
+static const int pixel_sizes[] = { 1, 2, 3, 4, 6, 8 };
+
+// Instruction sets the kernels are picked from in turn, 0 for the scalar ones
+static const struct
+{
+	const char *name;
+	unsigned int mask;
+} levels[] = {
+	{ "scalar", 0 },
+	{ "sse2", CPU_SSE2 },
+	{ "ssse3", CPU_SSE2 | CPU_SSSE3 },
+	{ "avx2", CPU_SSE2 | CPU_SSSE3 | CPU_AVX2 },
+};
+
+static unsigned int seed = 12345;
+
+static unsigned int next_random(void)
+{
+	seed = seed * 1103515245u + 12345u;
+	return seed >> 8;
+}
+
+// Straight from the specification, one byte at a time
+static void reference(unsigned char *row, const unsigned char *upper, size_t length, int bpp, int type)
+{
+	for (size_t i = 0; i < length; i++)
+	{
+		int a = i >= (size_t)bpp ? row[i - bpp] : 0;
+		int b = upper[i];
+		int c = i >= (size_t)bpp ? upper[i - bpp] : 0;
+		int predictor = type == 1 ? a : type == 2 ? b : type == 3 ? (a + b) >> 1 : type == 4 ? paeth(a, b, c) : 0;
+		row[i] = (unsigned char)(row[i] + predictor);
+	}
+}
+
+// Rows of a few pixels, odd lengths and lengths around the vector widths; then random ones
+static size_t row_length(int index, int bpp)
+{
+	static const size_t pixels[] = { 1, 2, 3, 5, 7, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 129, 257 };
+	size_t count = sizeof(pixels) / sizeof(pixels[0]);
+	if ((size_t)index < count)
+	{
+		return pixels[index] * bpp;
+	}
+	return (1 + next_random() % 1000) * bpp;
+}
+
+int main(void)
+{
+	unsigned int available = cpu_features();
+	int failures = 0;
+	size_t rows = 0;
+	unsigned char *upper = malloc(1000 * 8 + GUARD), *input = malloc(1000 * 8 + GUARD);
+	unsigned char *expected = malloc(1000 * 8 + GUARD), *scalar = malloc(1000 * 8 + GUARD), *got = malloc(1000 * 8 + GUARD);
+	if (upper == NULL || input == NULL || expected == NULL || scalar == NULL || got == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	for (size_t level = 0; level < sizeof(levels) / sizeof(levels[0]); level++)
+	{
+		if ((levels[level].mask & available) != levels[level].mask)
+		{
+			printf("skipped %s, the processor does not have it\n", levels[level].name);
+			continue;
+		}
+		for (size_t p = 0; p < sizeof(pixel_sizes) / sizeof(pixel_sizes[0]); p++)
+		{
+			int bpp = pixel_sizes[p];
+			struct unfilter_kernels scalar_kernels, kernels;
+			cpu_restrict(0);
+			unfilter_init();
+			unfilter_select(&scalar_kernels, bpp);
+			cpu_restrict(levels[level].mask);
+			unfilter_init();
+			unfilter_select(&kernels, bpp);
+
+			for (int type = 0; type < 5; type++)
+			{
+				for (int index = 0; index < ROWS; index++)
+				{
+					size_t length = row_length(index, bpp);
+					for (size_t i = 0; i < length + GUARD; i++)
+					{
+						upper[i] = (unsigned char)next_random();
+						input[i] = (unsigned char)next_random();
+					}
+					memcpy(expected, input, length + GUARD);
+					memcpy(scalar, input, length + GUARD);
+					memcpy(got, input, length + GUARD);
+					reference(expected, upper, length, bpp, type);
+					scalar_kernels.functions[type](scalar, upper, length, bpp);
+					kernels.functions[type](got, upper, length, bpp);
+					rows++;
+					if (memcmp(scalar, expected, length + GUARD) != 0 || memcmp(got, expected, length + GUARD) != 0)
+					{
+						failures++;
+						printf("FAIL %s bpp=%d type=%d length=%zu: %s\n", levels[level].name, bpp, type, length,
+							   memcmp(scalar, expected, length + GUARD) != 0 ? "the scalar kernel is wrong" : "differs from the scalar kernel");
+					}
+				}
+			}
+		}
+	}
+
+	printf("%zu rows, %d failures\n", rows, failures);
+	free(upper);
+	free(input);
+	free(expected);
+	free(scalar);
+	free(got);
+	return failures != 0;
+}
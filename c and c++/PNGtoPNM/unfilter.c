@@ -0,0 +1,335 @@
+#include "unfilter.h"
+
+#include "cpu.h"
+#include "paeth.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UNFILTER_X86
+#include <immintrin.h>
+#endif
+
+static void unfilter_none(unsigned char *row, const unsigned char *upper, size_t length, int bytes_per_pixel)
+{
+	(void)row;
+	(void)upper;
+	(void)length;
+	(void)bytes_per_pixel;
+}
+
+static void unfilter_up(unsigned char *row, const unsigned char *upper, size_t length, int bytes_per_pixel)
+{
+	(void)bytes_per_pixel;
+	for (size_t i = 0; i < length; i++)
+	{
+		row[i] += upper[i];
+	}
+}
+
+// Sub, Average and Paeth with the pixel size as a compile time constant, so that each loop is straight-line code
+#define DEFINE_SCALAR_KERNELS(NAME, BPP)                                                                                   \
+	static void unfilter_sub##NAME(unsigned char *row, const unsigned char *upper, size_t length, int bytes_per_pixel)     \
+	{                                                                                                                      \
+		size_t bpp = BPP;                                                                                                  \
+		(void)bytes_per_pixel;                                                                                             \
+		(void)upper;                                                                                                       \
+		for (size_t i = bpp; i < length; i++)                                                                              \
+		{                                                                                                                  \
+			row[i] += row[i - bpp];                                                                                        \
+		}                                                                                                                  \
+	}                                                                                                                      \
+                                                                                                                           \
+	static void unfilter_average##NAME(unsigned char *row, const unsigned char *upper, size_t length, int bytes_per_pixel) \
+	{                                                                                                                      \
+		size_t bpp = BPP;                                                                                                  \
+		(void)bytes_per_pixel;                                                                                             \
+		for (size_t i = 0; i < bpp && i < length; i++)                                                                     \
+		{                                                                                                                  \
+			row[i] += upper[i] >> 1;                                                                                       \
+		}                                                                                                                  \
+		for (size_t i = bpp; i < length; i++)                                                                              \
+		{                                                                                                                  \
+			row[i] += (row[i - bpp] + upper[i]) >> 1;                                                                      \
+		}                                                                                                                  \
+	}                                                                                                                      \
+                                                                                                                           \
+	static void unfilter_paeth##NAME(unsigned char *row, const unsigned char *upper, size_t length, int bytes_per_pixel)   \
+	{                                                                                                                      \
+		size_t bpp = BPP;                                                                                                  \
+		(void)bytes_per_pixel;                                                                                             \
+		for (size_t i = 0; i < bpp && i < length; i++)                                                                     \
+		{                                                                                                                  \
+			row[i] += upper[i];                                                                                            \
+		}                                                                                                                  \
+		for (size_t i = bpp; i < length; i++)                                                                              \
+		{                                                                                                                  \
+			row[i] += paeth(row[i - bpp], upper[i], upper[i - bpp]);                                                       \
+		}                                                                                                                  \
+	}
+
+// The generic versions take the pixel size from the argument
+DEFINE_SCALAR_KERNELS(, bytes_per_pixel)
+DEFINE_SCALAR_KERNELS(1, 1)
+DEFINE_SCALAR_KERNELS(2, 2)
+DEFINE_SCALAR_KERNELS(3, 3)
+DEFINE_SCALAR_KERNELS(4, 4)
+DEFINE_SCALAR_KERNELS(6, 6)
+DEFINE_SCALAR_KERNELS(8, 8)
+
+#define SCALAR_KERNELS(NAME) { unfilter_none, unfilter_sub##NAME, unfilter_up, unfilter_average##NAME, unfilter_paeth##NAME }
+
+// Indexed by bytes per pixel and filter type
+static const unfilter_function scalar_kernels[9][5] = {
+	[0] = SCALAR_KERNELS(),	 [1] = SCALAR_KERNELS(1), [2] = SCALAR_KERNELS(2), [3] = SCALAR_KERNELS(3), [4] = SCALAR_KERNELS(4),
+	[5] = SCALAR_KERNELS(),	 [6] = SCALAR_KERNELS(6), [7] = SCALAR_KERNELS(),  [8] = SCALAR_KERNELS(8),
+};
+
+#if defined(UNFILTER_X86)
+
+static int has_sse2, has_ssse3, has_avx2;
+
+__attribute__((target("sse2"))) static void unfilter_up_sse2(unsigned char *row, const unsigned char *upper, size_t length, int bytes_per_pixel)
+{
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)(row + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(upper + i));
+		_mm_storeu_si128((__m128i *)(row + i), _mm_add_epi8(x, b));
+	}
+	unfilter_up(row + i, upper + i, length - i, bytes_per_pixel);
+}
+
+__attribute__((target("avx2"))) static void unfilter_up_avx2(unsigned char *row, const unsigned char *upper, size_t length, int bytes_per_pixel)
+{
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32)
+	{
+		__m256i x = _mm256_loadu_si256((const __m256i *)(row + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(upper + i));
+		_mm256_storeu_si256((__m256i *)(row + i), _mm256_add_epi8(x, b));
+	}
+	unfilter_up(row + i, upper + i, length - i, bytes_per_pixel);
+}
+
+// Sub for pixel sizes dividing 16: a prefix sum over whole pixels inside each vector, seeded with the last pixel of the previous one
+#define DEFINE_SUB_PREFIX_SSE2(BPP)                                                                                      \
+	__attribute__((target("sse2"))) static void unfilter_sub##BPP##_sse2(unsigned char *row, const unsigned char *upper, \
+																		  size_t length, int bytes_per_pixel)            \
+	{                                                                                                                    \
+		__m128i carry = _mm_setzero_si128();                                                                             \
+		size_t i = 0;                                                                                                    \
+		(void)upper;                                                                                                     \
+		(void)bytes_per_pixel;                                                                                           \
+		for (; i + 16 <= length; i += 16)                                                                                \
+		{                                                                                                                \
+			__m128i x = _mm_add_epi8(_mm_loadu_si128((const __m128i *)(row + i)), carry);                                \
+			x = _mm_add_epi8(x, _mm_slli_si128(x, BPP));                                                                 \
+			if (2 * BPP < 16)                                                                                            \
+				x = _mm_add_epi8(x, _mm_slli_si128(x, (2 * BPP) & 15));                                                  \
+			if (4 * BPP < 16)                                                                                            \
+				x = _mm_add_epi8(x, _mm_slli_si128(x, (4 * BPP) & 15));                                                  \
+			if (8 * BPP < 16)                                                                                            \
+				x = _mm_add_epi8(x, _mm_slli_si128(x, (8 * BPP) & 15));                                                  \
+			_mm_storeu_si128((__m128i *)(row + i), x);                                                                   \
+			carry = _mm_srli_si128(x, 16 - BPP);                                                                         \
+		}                                                                                                                \
+		for (i = i < BPP ? BPP : i; i < length; i++)                                                                     \
+		{                                                                                                                \
+			row[i] += row[i - BPP];                                                                                      \
+		}                                                                                                                \
+	}
+
+DEFINE_SUB_PREFIX_SSE2(1)
+DEFINE_SUB_PREFIX_SSE2(2)
+DEFINE_SUB_PREFIX_SSE2(4)
+DEFINE_SUB_PREFIX_SSE2(8)
+
+// One pixel per iteration for pixel sizes 3 to 8. Pixels are assembled in general purpose registers, moving them through
+// a stack buffer stalls on store forwarding for 3 and 6 byte pixels
+__attribute__((target("sse2"))) static inline __m128i load_pixel(const unsigned char *pointer, size_t bpp)
+{
+	unsigned short low16, high16;
+	unsigned int low32, high32;
+	switch (bpp)
+	{
+	case 3:
+		memcpy(&low16, pointer, 2);
+		return _mm_cvtsi32_si128(low16 | (pointer[2] << 16));
+	case 4:
+		memcpy(&low32, pointer, 4);
+		return _mm_cvtsi32_si128(low32);
+	case 6:
+		memcpy(&low32, pointer, 4);
+		memcpy(&high16, pointer + 4, 2);
+		return _mm_set_epi32(0, 0, high16, low32);
+	default:
+		memcpy(&low32, pointer, 4);
+		memcpy(&high32, pointer + 4, 4);
+		return _mm_set_epi32(0, 0, high32, low32);
+	}
+}
+
+__attribute__((target("sse2"))) static inline void store_pixel(unsigned char *pointer, __m128i value, size_t bpp)
+{
+	unsigned int low32 = _mm_cvtsi128_si32(value);
+	unsigned int high32 = _mm_cvtsi128_si32(_mm_srli_si128(value, 4));
+	switch (bpp)
+	{
+	case 3:
+		memcpy(pointer, &low32, 2);
+		pointer[2] = (unsigned char)(low32 >> 16);
+		break;
+	case 4:
+		memcpy(pointer, &low32, 4);
+		break;
+	case 6:
+		memcpy(pointer, &low32, 4);
+		memcpy(pointer + 4, &high32, 2);
+		break;
+	default:
+		memcpy(pointer, &low32, 4);
+		memcpy(pointer + 4, &high32, 4);
+		break;
+	}
+}
+
+#define DEFINE_SUB_PIXEL_SSE2(BPP)                                                                                       \
+	__attribute__((target("sse2"))) static void unfilter_sub##BPP##_sse2(unsigned char *row, const unsigned char *upper, \
+																		  size_t length, int bytes_per_pixel)            \
+	{                                                                                                                    \
+		__m128i a = _mm_setzero_si128();                                                                                 \
+		(void)upper;                                                                                                     \
+		(void)bytes_per_pixel;                                                                                           \
+		for (size_t i = 0; i + BPP <= length; i += BPP)                                                                  \
+		{                                                                                                                \
+			a = _mm_add_epi8(a, load_pixel(row + i, BPP));                                                               \
+			store_pixel(row + i, a, BPP);                                                                                \
+		}                                                                                                                \
+	}
+
+// floor((a + b) / 2) is the rounding-up _mm_avg_epu8 minus the lost low bit
+#define DEFINE_AVERAGE_SSE2(BPP)                                                                                             \
+	__attribute__((target("sse2"))) static void unfilter_average##BPP##_sse2(unsigned char *row, const unsigned char *upper, \
+																			  size_t length, int bytes_per_pixel)            \
+	{                                                                                                                        \
+		const __m128i ones = _mm_set1_epi8(1);                                                                               \
+		__m128i a = _mm_setzero_si128();                                                                                     \
+		(void)bytes_per_pixel;                                                                                               \
+		for (size_t i = 0; i + BPP <= length; i += BPP)                                                                      \
+		{                                                                                                                    \
+			__m128i b = load_pixel(upper + i, BPP);                                                                          \
+			__m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), ones));                    \
+			a = _mm_add_epi8(load_pixel(row + i, BPP), average);                                                             \
+			store_pixel(row + i, a, BPP);                                                                                    \
+		}                                                                                                                    \
+	}
+
+// Paeth on 16 bit lanes, the predictor differences are pa = b - c, pb = a - c, pc = pa + pb
+#define DEFINE_PAETH(BPP, ISA, ABS)                                                                                       \
+	__attribute__((target(#ISA))) static void unfilter_paeth##BPP##_##ISA(unsigned char *row, const unsigned char *upper, \
+																		   size_t length, int bytes_per_pixel)            \
+	{                                                                                                                     \
+		const __m128i zero = _mm_setzero_si128();                                                                         \
+		__m128i a = zero, c = zero;                                                                                       \
+		(void)bytes_per_pixel;                                                                                            \
+		for (size_t i = 0; i + BPP <= length; i += BPP)                                                                   \
+		{                                                                                                                 \
+			__m128i b = _mm_unpacklo_epi8(load_pixel(upper + i, BPP), zero);                                              \
+			__m128i x = _mm_unpacklo_epi8(load_pixel(row + i, BPP), zero);                                                \
+			__m128i pa = _mm_sub_epi16(b, c);                                                                             \
+			__m128i pb = _mm_sub_epi16(a, c);                                                                             \
+			__m128i pc = _mm_add_epi16(pa, pb);                                                                           \
+			pa = ABS(pa);                                                                                                 \
+			pb = ABS(pb);                                                                                                 \
+			pc = ABS(pc);                                                                                                 \
+			__m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));                                                  \
+			__m128i use_a = _mm_cmpeq_epi16(smallest, pa);                                                                \
+			__m128i use_b = _mm_cmpeq_epi16(smallest, pb);                                                                \
+			__m128i nearest = _mm_or_si128(_mm_and_si128(use_b, b), _mm_andnot_si128(use_b, c));                          \
+			nearest = _mm_or_si128(_mm_and_si128(use_a, a), _mm_andnot_si128(use_a, nearest));                            \
+			a = _mm_and_si128(_mm_add_epi16(x, nearest), _mm_set1_epi16(0xFF));                                           \
+			store_pixel(row + i, _mm_packus_epi16(a, a), BPP);                                                            \
+			c = b;                                                                                                        \
+		}                                                                                                                 \
+	}
+
+#define ABS_SSE2(value) _mm_max_epi16((value), _mm_sub_epi16(_mm_setzero_si128(), (value)))
+#define ABS_SSSE3(value) _mm_abs_epi16(value)
+
+#define DEFINE_PAETH_KERNELS(BPP)     \
+	DEFINE_PAETH(BPP, sse2, ABS_SSE2) \
+	DEFINE_PAETH(BPP, ssse3, ABS_SSSE3)
+
+DEFINE_SUB_PIXEL_SSE2(3)
+DEFINE_SUB_PIXEL_SSE2(6)
+
+DEFINE_AVERAGE_SSE2(3)
+DEFINE_AVERAGE_SSE2(4)
+DEFINE_AVERAGE_SSE2(6)
+DEFINE_AVERAGE_SSE2(8)
+
+DEFINE_PAETH_KERNELS(3)
+DEFINE_PAETH_KERNELS(4)
+DEFINE_PAETH_KERNELS(6)
+DEFINE_PAETH_KERNELS(8)
+
+// Indexed like scalar_kernels, empty entries keep the kernel chosen so far
+static const unfilter_function sse2_kernels[9][5] = {
+	[1] = { [1] = unfilter_sub1_sse2, [2] = unfilter_up_sse2 },
+	[2] = { [1] = unfilter_sub2_sse2, [2] = unfilter_up_sse2 },
+	[3] = { [1] = unfilter_sub3_sse2, [2] = unfilter_up_sse2, [3] = unfilter_average3_sse2, [4] = unfilter_paeth3_sse2 },
+	[4] = { [1] = unfilter_sub4_sse2, [2] = unfilter_up_sse2, [3] = unfilter_average4_sse2, [4] = unfilter_paeth4_sse2 },
+	[6] = { [1] = unfilter_sub6_sse2, [2] = unfilter_up_sse2, [3] = unfilter_average6_sse2, [4] = unfilter_paeth6_sse2 },
+	[8] = { [1] = unfilter_sub8_sse2, [2] = unfilter_up_sse2, [3] = unfilter_average8_sse2, [4] = unfilter_paeth8_sse2 },
+};
+
+static const unfilter_function ssse3_kernels[9][5] = {
+	[3] = { [4] = unfilter_paeth3_ssse3 },
+	[4] = { [4] = unfilter_paeth4_ssse3 },
+	[6] = { [4] = unfilter_paeth6_ssse3 },
+	[8] = { [4] = unfilter_paeth8_ssse3 },
+};
+
+static const unfilter_function avx2_kernels[9][5] = {
+	[1] = { [2] = unfilter_up_avx2 }, [2] = { [2] = unfilter_up_avx2 }, [3] = { [2] = unfilter_up_avx2 },
+	[4] = { [2] = unfilter_up_avx2 }, [6] = { [2] = unfilter_up_avx2 }, [8] = { [2] = unfilter_up_avx2 },
+};
+
+#endif
+
+void unfilter_init(void)
+{
+#if defined(UNFILTER_X86)
+	unsigned int features = cpu_features();
+	has_sse2 = (features & CPU_SSE2) != 0;
+	has_ssse3 = (features & CPU_SSSE3) != 0;
+	has_avx2 = (features & CPU_AVX2) != 0;
+#endif
+}
+
+void unfilter_select(struct unfilter_kernels *kernels, int bytes_per_pixel)
+{
+	int bpp = bytes_per_pixel > 0 && bytes_per_pixel <= 8 ? bytes_per_pixel : 0;
+
+	for (int filter_type = 0; filter_type < 5; filter_type++)
+	{
+		kernels->functions[filter_type] = scalar_kernels[bpp][filter_type];
+#if defined(UNFILTER_X86)
+		if (has_sse2 && sse2_kernels[bpp][filter_type] != NULL)
+		{
+			kernels->functions[filter_type] = sse2_kernels[bpp][filter_type];
+		}
+		if (has_ssse3 && ssse3_kernels[bpp][filter_type] != NULL)
+		{
+			kernels->functions[filter_type] = ssse3_kernels[bpp][filter_type];
+		}
+		if (has_avx2 && avx2_kernels[bpp][filter_type] != NULL)
+		{
+			kernels->functions[filter_type] = avx2_kernels[bpp][filter_type];
+		}
+#endif
+	}
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+
+// Reverses one PNG filter type in place; row and previous_row point past the filter type byte
+typedef void (*unfilter_function)(unsigned char *row, const unsigned char *previous_row, size_t length, int bytes_per_pixel);
+
+struct unfilter_kernels
+{
+	unfilter_function functions[5];	   // indexed by filter type
+};
+
+// Detects the available instruction sets, must be called once before unfilter_select
+void unfilter_init(void);
+
+// Picks the fastest kernel for every filter type and the given bytes per pixel
+void unfilter_select(struct unfilter_kernels *kernels, int bytes_per_pixel);
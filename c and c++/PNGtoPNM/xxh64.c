@@ -0,0 +1,86 @@
+#include "xxh64.h"
+
+static const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t prime3 = 0x165667B19E3779F9ULL;
+static const uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotate_left(uint64_t value, int bits)
+{
+	return value << bits | value >> (64 - bits);
+}
+
+static inline uint64_t load_le64(const unsigned char *data)
+{
+	uint64_t value = 0;
+	for (int i = 7; i >= 0; i--)
+	{
+		value = value << 8 | data[i];
+	}
+	return value;
+}
+
+static inline uint32_t load_le32(const unsigned char *data)
+{
+	return data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static inline uint64_t round64(uint64_t accumulator, uint64_t input)
+{
+	return rotate_left(accumulator + input * prime2, 31) * prime1;
+}
+
+static inline uint64_t merge_round(uint64_t hash, uint64_t accumulator)
+{
+	return (hash ^ round64(0, accumulator)) * prime1 + prime4;
+}
+
+uint64_t xxh64(const unsigned char *data, size_t length, uint64_t seed)
+{
+	const unsigned char *end = data + length;
+	uint64_t hash;
+	if (length >= 32)
+	{
+		// four lanes of 8 bytes each over the 32 byte stripes
+		uint64_t lanes[4] = { seed + prime1 + prime2, seed + prime2, seed, seed - prime1 };
+		for (; end - data >= 32; data += 32)
+		{
+			for (int i = 0; i < 4; i++)
+			{
+				lanes[i] = round64(lanes[i], load_le64(data + 8 * i));
+			}
+		}
+		hash = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) + rotate_left(lanes[2], 12) + rotate_left(lanes[3], 18);
+		for (int i = 0; i < 4; i++)
+		{
+			hash = merge_round(hash, lanes[i]);
+		}
+	}
+	else
+	{
+		hash = seed + prime5;
+	}
+	hash += length;
+
+	for (; end - data >= 8; data += 8)
+	{
+		hash = rotate_left(hash ^ round64(0, load_le64(data)), 27) * prime1 + prime4;
+	}
+	if (end - data >= 4)
+	{
+		hash = rotate_left(hash ^ load_le32(data) * prime1, 23) * prime2 + prime3;
+		data += 4;
+	}
+	for (; data < end; data++)
+	{
+		hash = rotate_left(hash ^ *data * prime5, 11) * prime1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= prime2;
+	hash ^= hash >> 29;
+	hash *= prime3;
+	hash ^= hash >> 32;
+	return hash;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// XXH64 of length bytes, the same values as the reference xxHash implementation for the same seed
+uint64_t xxh64(const unsigned char *data, size_t length, uint64_t seed);